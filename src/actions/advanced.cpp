@@ -43,6 +43,10 @@ bool PartitionAndFormatSDCard(int cache, int data, int system) {
     sprintf(strData, "%d", data);
     sprintf(strSystem, "%d", system);
 
+    // Nothing on the card may stay mounted.
+    if (!gMounts.UnmountAll())
+        return false;
+
     cout << "Making partitions..." << endl;
     if (!ExecuteShellScript("/scripts/partition.sh", 4, 
             DEV_INTSD, strCache, strData, strSystem))
@@ -91,8 +95,7 @@ bool WipeDalvikCache() {
     cout << "Cleaning..." << endl;
     success = Remove(dalvikPath.c_str(), true, true);
 
-    cout << "Unmounting..." << endl;
-    UnmountA(MOUNT_DATA);
+    gMounts.Release(MOUNT_DATA);
 
     if (success)
         cout << "Success!" << endl;
@@ -192,9 +195,9 @@ bool FixROMPermissions() {
         goto fail;
 
     cout << "Fixing ROM permissions..." << endl;
-    success = ExecuteShellScript("/scripts/fixperms.sh");
+    success = FixPermissions();
 
-    UnmountRootfs();
+    ReleaseRootfs();
 
     if (success)
         cout << "Success!" << endl;
@@ -220,7 +223,7 @@ bool DumpKernelMessages() {
     gTerminal.clear();
     cout << "Dumping kernel messages..." << endl;
 
-    if (ExecuteAndNotifyIfFail("dmesg"))
+    if (ExecuteAndNotifyIfFail("dmesg", SYSCALL_LOG_ALL))
         cout << "Success! Entire \"dmesg\" dumped to log!" << endl;
 
     NotifyWaitForButton();
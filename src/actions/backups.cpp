@@ -3,18 +3,237 @@
  *      - Actions for "Backup\Restore" menu.
  */
 
-// Creates a temporary folder in the given directory.
-// Returns the complete path.
-inline bool MakeTempFolder(string &out, const char *path) {
-    char temp[PATH_MAX], *result;
+// Compression of new backups. LZO is several times faster than
+// "gzip" on the device, where the CPU is the bottleneck.
+static Codec gBackupCodec(CODEC_LZO);
+
+// If set, "ext4" partitions and the NAND volume are backed up as
+// images of their used blocks instead of archives of their files.
+static bool gBackupImages = false;
+
+// Whether new backups store their data in the chunk store of the
+// backup folder (deduplicated across backups).
+static bool gBackupRepository = false;
+
+// Name of the chunk store directory in the backup folder.
+static const char *CHUNK_STORE_NAME = "chunks";
+
+// Name of the member describing the backup and its parent, and the
+// suffixes of the members listing the files of a partition archive
+// and the files deleted since the parent backup.
+static const char *BACKUP_INFO_NAME = "backup.info";
+static const char *MANIFEST_SUFFIX = ".manifest";
+static const char *DELETED_SUFFIX = ".deleted";
+
+// The content of a partition member of which only the payload (e.g.
+// the "zImage" without the padding after it) was backed up.
+struct BackupPayload {
+    string member;
+    string type;
+    long long length;
+};
+
+// Description of a backup ("backup.info" member). Partitions backed
+// up incrementally only contain the files changed since the parent
+// backup, which is in the same folder.
+struct BackupInfo {
+    string id;
+    string parentId;
+    string parentName;
+    vector<string> incremental;
+    vector<BackupPayload> payloads;
+
+    // Returns if the partition was backed up incrementally.
+    bool IsIncremental(const char *partition) const {
+        return find(incremental.begin(), incremental.end(), partition) != incremental.end();
+    }
+
+    // Returns the payload of a member, or NULL for whole partitions.
+    const BackupPayload *FindPayload(const char *member) const {
+        for (size_t i = 0; i < payloads.size(); i++)
+            if (payloads[i].member == member)
+                return &payloads[i];
+
+        return NULL;
+    }
+};
+
+// Returns a (practically) unique backup identifier.
+inline string MakeBackupId() {
+    unsigned int random[2] = { (unsigned int)time(0), (unsigned int)getpid() };
+    char id[32];
+    FILE *fp = fopen("/dev/urandom", "rb");
+
+    if (fp) {
+        fread(random, sizeof(random), 1, fp);
+        fclose(fp);
+    }
+
+    sprintf(id, "%08x%08x", random[0], random[1]);
+    return id;
+}
+
+// Returns the folder of a path.
+inline string GetParentPath(const string &path) {
+    size_t slash = path.rfind('/');
+    return (slash == string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+}
+
+// Returns the file name of a path.
+inline string GetFileName(const string &path) {
+    size_t slash = path.rfind('/');
+    return (slash == string::npos) ? path : path.substr(slash + 1);
+}
+
+// Selects a member of the backup for reading by name.
+inline bool SelectMemberByName(MFWReader &mfw, const string &name) {
+    int i = mfw.FindMember(name.c_str());
+    return i >= 0 && mfw.Select(i);
+}
+
+// Returns if the member only describes the backup.
+inline bool IsMetadataMember(const string &name) {
+    const size_t manifest = strlen(MANIFEST_SUFFIX), deleted = strlen(DELETED_SUFFIX);
+
+    return name == BACKUP_INFO_NAME || 
+        (name.length() > manifest && !name.compare(name.length() - manifest, manifest, MANIFEST_SUFFIX)) ||
+        (name.length() > deleted && !name.compare(name.length() - deleted, deleted, DELETED_SUFFIX));
+}
+
+// Writes the "backup.info" member.
+static bool WriteBackupInfo(MFWWriter &mfw, const BackupInfo &info) {
+    string text = "id " + info.id + "\n";
+
+    if (info.parentName.length())
+        text += "parent " + info.parentId + " " + info.parentName + "\n";
+
+    for (size_t i = 0; i < info.incremental.size(); i++)
+        text += "incremental " + info.incremental[i] + "\n";
+
+    for (size_t i = 0; i < info.payloads.size(); i++) {
+        ostringstream line;
+
+        line << "payload " << info.payloads[i].member << " " << info.payloads[i].type 
+            << " " << info.payloads[i].length << "\n";
+        text += line.str();
+    }
+
+    return mfw.BeginMember(BACKUP_INFO_NAME) && mfw.Write(text.data(), text.length()) &&
+        mfw.EndMember();
+}
+
+// Reads the "backup.info" member. Older backups have none and are
+// read as full backups without an identifier.
+static bool ReadBackupInfo(MFWReader &mfw, BackupInfo &info) {
+    char buffer[1024];
+    string text, line;
+    ssize_t ret;
+
+    info = BackupInfo();
+
+    if (mfw.FindMember(BACKUP_INFO_NAME) < 0)
+        return true;
+
+    if (!SelectMemberByName(mfw, BACKUP_INFO_NAME))
+        return false;
+
+    while ((ret = mfw.Read(buffer, sizeof(buffer))) > 0)
+        text.append(buffer, ret);
+
+    if (ret < 0)
+        return false;
+
+    istringstream lines(text);
+
+    while (getline(lines, line)) {
+        istringstream fields(line);
+        string key, value;
+
+        fields >> key >> value;
+
+        if (key == "id") {
+            info.id = value;
+        } else if (key == "parent") {
+            info.parentId = value;
+            fields.ignore(1);
+            getline(fields, info.parentName);
+        } else if (key == "incremental") {
+            info.incremental.push_back(value);
+        } else if (key == "payload") {
+            BackupPayload payload;
+
+            payload.member = value;
+
+            if (fields >> payload.type >> payload.length)
+                info.payloads.push_back(payload);
+        }
+    }
+
+    return true;
+}
+
+// Loads the chain of backups the backup depends on, from the full
+// backup (first) to the given one (last).
+static bool LoadBackupChain(const char *path, vector<string> &chain, 
+        vector<BackupInfo> &infos) {
+
+    string current = path;
 
-    strcpy(temp, path);
-    strcat(temp, "/tempdir.XXXXXXXX");
+    chain.clear();
+    infos.clear();
 
-    if (!(result = mkdtemp(temp)))
+    for (;;) {
+        MFWReader mfw;
+        BackupInfo info;
+
+        if (!mfw.Open(current.c_str()) || !ReadBackupInfo(mfw, info)) {
+            cout << "Unable to read the backup '" << GetFileName(current) << "'." << endl;
+            return false;
+        }
+
+        // The parent must be the backup that was compared with.
+        if (infos.size() && info.id != infos.front().parentId) {
+            cout << "The backup '" << GetFileName(current) << "' is not the" << endl
+                << "parent of the selected backup (it was replaced)." << endl;
+            return false;
+        }
+
+        chain.insert(chain.begin(), current);
+        infos.insert(infos.begin(), info);
+
+        if (info.parentName.length() == 0)
+            return true;
+
+        if (chain.size() >= 64) {
+            cout << "The chain of backups is too long." << endl;
+            return false;
+        }
+
+        JoinPath(current, GetParentPath(current).c_str(), info.parentName.c_str());
+    }
+}
+
+// Returns the backups (indices in the chain) holding the archives 
+// of the partition to restore in order: the last full archive and the
+// incremental archives on top of it.
+static bool GetPartitionLayers(const vector<BackupInfo> &infos, const char *partition,
+        vector<size_t> &layers) {
+
+    size_t base = infos.size() - 1;
+
+    while (base > 0 && infos[base].IsIncremental(partition))
+        base--;
+
+    if (infos[base].IsIncremental(partition)) {
+        cout << "The full backup of '" << partition << "' is missing." << endl;
         return false;
+    }
+
+    layers.clear();
+
+    for (size_t i = base; i < infos.size(); i++)
+        layers.push_back(i);
 
-    out = temp;
     return true;
 }
 
@@ -32,46 +251,233 @@ inline void MakeBackupPath(string &out, const char *path) {
     JoinPath(out, path, temp);
 }
 
-// Check if there may be insufficient space for backup creation.
+// Check if there may be insufficient space for backup creation. The
+// estimate is the space used on the partitions (only the payload of the
+// kernel), as the ratio of the compression is not known. Partitions
+// backed up incrementally only hold the changed files and are not
+// counted. Mounts the partitions (and attaches NAND) to determine.
 inline bool VerifyBackupCreationSpace(bool backupSystem, bool backupData,
-        const char *tempPath) {
+        const BackupInfo &info, const MTDPayload &kernel, const char *path) {
 
-    size_t kernel = 0, nand = 0, system = 0, data = 0;
+    unsigned long long total = 0, used;
 
     if (backupSystem) {
-        const MTD &mtdKernel = gMTDs[MTD_KERNEL];
         const MTD &mtdNAND = gMTDs[MTD_ROOTFS];
 
-        if (mtdKernel.name)
-            if ((kernel = mtdKernel.size) == 0)
+        if (gMTDs[MTD_KERNEL].name)
+            total += kernel.length;
+
+        if (access(mtdNAND.sysfs, F_OK) == 0) {
+            if (!UBIAttach(mtdNAND.number, UBID_NUMBER) || 
+                    !GetDeviceUsedSpace(DEV_NAND, MOUNT_NAND, "ubifs", used))
                 return false;
 
-        if (access(mtdNAND.sysfs, F_OK) == 0)
-            if ((nand = 512 * GetBlockDeviceSize(mtdNAND.sysfs)) == 0)
+            total += used;
+        }
+
+        if (!info.IsIncremental("system")) {
+            if (!GetDeviceUsedSpace(DEV_SYSTEM, MOUNT_SYSTEM, NULL, used))
                 return false;
 
-        if ((system = 512 * GetBlockDeviceSize(SYS_SYSTEM)) == 0)
-            return false;
+            total += used;
+        }
     }
 
-    if (backupData)
-        if ((data = 512 * GetBlockDeviceSize(SYS_DATA)) == 0)
+    if (backupData && !info.IsIncremental("data")) {
+        if (!GetDeviceUsedSpace(DEV_DATA, MOUNT_DATA, NULL, used))
             return false;
 
-    // Assuming that all partitions are not full and
-    // compression is fairly effective, this estimate
-    // should provide reasonable accuracy.
-    return (kernel + nand + system + data) < 
-        GetMountpointFreeSpace(tempPath);
+        total += used;
+    }
+
+    return total < GetMountpointFreeSpace(path);
+}
+
+// Returns the name of the backup member holding the archive of a 
+// partition ("system.tgz", "system.tar.lzo", etc.).
+inline string MakeArchiveMemberName(const char *partition, const Codec &codec) {
+    return string(partition) + CodecGetExtension(codec);
+}
+
+// Returns if the backup member is the archive of the partition,
+// with any codec.
+inline bool IsArchiveMember(const char *name, const char *partition) {
+    static const CodecType types[] = { CODEC_NONE, CODEC_LZO, CODEC_GZIP };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (MakeArchiveMemberName(partition, Codec(types[i])) == name)
+            return true;
+
+    return false;
+}
+
+// Returns the name of the backup member holding the image of a 
+// partition ("system.simg", "system.simg.lzo", etc.).
+inline string MakeImageMemberName(const char *partition, const Codec &codec) {
+    return string(partition) + ".simg" + CodecGetExtension(codec, false);
+}
+
+// Returns if the backup member is the image of the partition,
+// with any codec.
+inline bool IsImageMember(const char *name, const char *partition) {
+    static const CodecType types[] = { CODEC_NONE, CODEC_LZO, CODEC_GZIP };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (MakeImageMemberName(partition, Codec(types[i])) == name)
+            return true;
+
+    return false;
+}
+
+// Returns if the device holds a filesystem that can be imaged.
+inline bool CanBackupImage(const char *dev) {
+    vector<ImageExtent> extents;
+    off_t size;
+    unsigned int blockSize;
+    int fd = open(dev, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    bool ret = Ext4GetUsedExtents(fd, extents, size, blockSize);
+    close(fd);
+    return ret;
+}
+
+// Starts a member of the backup and returns the stream to write its
+// data to. With a chunk store, the data is added to the store and the
+// member only holds the recipe.
+static OutStream *BeginBackupMember(MFWWriter &mfw, ChunkStore *store, ChunkOutStream &chunks,
+        const char *name, const char *partition, const char *codec) {
+
+    if (!mfw.BeginMember(name, partition, store ? CHUNK_CODEC_NAME : codec))
+        return NULL;
+
+    if (!store)
+        return &mfw;
+
+    return chunks.Init(*store, mfw) ? &chunks : NULL;
+}
+
+// Completes a member started with BeginBackupMember().
+static bool EndBackupMember(MFWWriter &mfw, ChunkStore *store, ChunkOutStream &chunks) {
+    if (!store)
+        return mfw.EndMember();
+
+    if (!chunks.Finish())
+        return false;
+
+    cout << "  " << chunks.GetNewChunkCount() << " of " << chunks.GetChunkCount() 
+        << " chunks were new (" << chunks.GetNewByteCount() / 1024 << " KB)." << endl;
+
+    return mfw.EndMember(chunks.GetByteCount());
+}
+
+// Returns if the selected member of the backup is a chunk recipe.
+inline bool IsChunkedMember(const MFWReader &mfw) {
+    const int i = mfw.FindMember(mfw.GetMemberName());
+    return i >= 0 && mfw.GetMember(i).codec == CHUNK_CODEC_NAME;
+}
+
+// Returns the size of the data of the selected member of the backup.
+inline off_t GetMemberDataSize(const MFWReader &mfw) {
+    return IsChunkedMember(mfw) ? 
+        mfw.GetMember(mfw.FindMember(mfw.GetMemberName())).usize : mfw.GetMemberSize();
+}
+
+// Returns the stream to read the data of the selected member of the
+// backup at "path" from: the member itself or, for recipes, the chunk
+// store next to the backup.
+static InStream *OpenBackupMember(MFWReader &mfw, const string &path, ChunkStore &store,
+        ChunkInStream &chunks) {
+
+    string root;
+
+    if (!IsChunkedMember(mfw))
+        return &mfw;
+
+    JoinPath(root, GetParentPath(path).c_str(), CHUNK_STORE_NAME);
+
+    if (access(root.c_str(), F_OK) != 0) {
+        cout << "The chunk store of the backup is missing." << endl;
+        return NULL;
+    }
+
+    return (store.Open(root.c_str(), 0) && chunks.Init(store, mfw)) ? &chunks : NULL;
+}
+
+// Adds a member with the backup of an "ext4" partition, either as
+// an image or as an archive (if the filesystem can not be imaged).
+// Archives are followed by a manifest and, if the manifest of the 
+// parent backup is given, only contain the files changed since and
+// are followed by the list of deleted files.
+// Calls BackupImage() or BackupMountpoint().
+static bool BackupExtPartition(MFWWriter &mfw, ChunkStore *store, const Codec &codec, 
+        const char *partition, const char *dev, const char *mountpoint,
+        const Manifest *parent = NULL) {
+
+    const string codecName = CodecGetName(codec);
+    const string name = partition;
+    ChunkOutStream chunks;
+    OutStream *out;
+    Manifest manifest;
+    vector<string> deleted;
+
+    if (gBackupImages && !parent) {
+        if (CanBackupImage(dev))
+            return (out = BeginBackupMember(mfw, store, chunks, MakeImageMemberName(partition, 
+                codec).c_str(), partition, codecName.c_str())) && 
+                BackupImage(*out, codec, dev) && EndBackupMember(mfw, store, chunks);
+
+        cout << "Unable to image '" << partition << "', archiving files instead." << endl;
+    }
+
+    if (!(out = BeginBackupMember(mfw, store, chunks, MakeArchiveMemberName(partition, 
+            codec).c_str(), partition, codecName.c_str())) || !BackupMountpoint(*out, codec, 
+            dev, mountpoint, NULL, NULL, &manifest, parent) || !EndBackupMember(mfw, store, chunks))
+        return false;
+
+    if (!mfw.BeginMember((name + MANIFEST_SUFFIX).c_str(), partition, "none") ||
+            !manifest.Save(mfw) || !mfw.EndMember())
+        return false;
+
+    if (!parent)
+        return true;
+
+    parent->GetMissing(manifest, deleted);
+    log << INFO << deleted.size() << " files deleted since the parent backup." << endl;
+
+    return mfw.BeginMember((name + DELETED_SUFFIX).c_str(), partition, "none") &&
+        SavePathList(deleted, mfw) && mfw.EndMember();
+}
+
+// Loads the manifest of a partition from the parent backup. Returns
+// false if the parent has none (e.g. the partition was imaged).
+static bool LoadParentManifest(MFWReader &mfw, const char *partition, Manifest &manifest) {
+    return SelectMemberByName(mfw, string(partition) + MANIFEST_SUFFIX) && manifest.Load(mfw);
 }
 
 // Creates a backup in the directory specified by user using the
-// format provided by MakeBackupPath(). While making the backup
-// the temporary directory provided by MakeTempFolder() is used.
-// Calls BackupUBI(), BackupMountpoint() and BackupMTDPartition().
-static bool CreateBackup(bool backupSystem, bool backupData) {
+// format provided by MakeBackupPath(). Each partition is streamed
+// directly into the backup archive as a member of its own. If a
+// parent backup is given, the backup is placed next to it, and the
+// "system" and "data" archives only contain the files changed since
+// the parent (if it has their manifests).
+// Calls BackupUBI(), BackupExtPartition() and BackupMTDPartition().
+static bool CreateBackup(bool backupSystem, bool backupData, const char *parentPath = NULL) {
     FileWindow fw;
-    string temp, files, tempPath, backupPath;
+    MFWWriter mfw;
+    MFWReader parent;
+    Manifest parentSystem, parentData;
+    BackupInfo info, parentInfo;
+    ChunkStore chunkStore;
+    ChunkStore *store = NULL;
+    ChunkOutStream chunks;
+    OutStream *out;
+    MTDPayload kernel = { MTD_CONTENT_UNKNOWN, -1 };
+    string backupPath, folder, storePath;
+    const Codec codec = gBackupRepository ? Codec(CODEC_NONE) : gBackupCodec;
+    const string codecName = CodecGetName(codec);
     bool failed = false;
 
     gTerminal.clear();
@@ -90,110 +496,167 @@ static bool CreateBackup(bool backupSystem, bool backupData) {
         return false;
     }
 
-    // Get a temporary folder.
-    if (!MakeTempFolder(tempPath, GetDefaultPath())) {
-        cout << "Unable to create a temporary folder for backup creation." << endl;
-        NotifyWaitForButton();
-        return false;
+    info.id = MakeBackupId();
+
+    if (parentPath) {
+        // The manifests of the parent decide what is incremental.
+        if (!parent.Open(parentPath) || !ReadBackupInfo(parent, parentInfo)) {
+            cout << "Unable to read the parent backup." << endl;
+            NotifyWaitForButton();
+            return false;
+        }
+
+        if (parentInfo.id.length() == 0) {
+            cout << "The parent backup is too old for incremental backups." << endl;
+            NotifyWaitForButton();
+            return false;
+        }
+
+        info.parentId = parentInfo.id;
+        info.parentName = GetFileName(parentPath);
+
+        if (backupSystem && LoadParentManifest(parent, "system", parentSystem))
+            info.incremental.push_back("system");
+
+        if (backupData && LoadParentManifest(parent, "data", parentData))
+            info.incremental.push_back("data");
+
+        parent.Close();
+
+        if (info.incremental.size() == 0) {
+            cout << "The parent backup has no file lists, so a full" << endl
+                << "backup is made instead." << endl;
+            info.parentId.resize(0);
+            info.parentName.resize(0);
+        }
+
+        folder = GetParentPath(parentPath);
+    } else {
+        cout << "Press the HOME key to select a folder to place the " << endl
+            << "backup in, or any other key to cancel." << endl;
+
+        if (GetButtonPress() != KEY_HOME)
+            return false;
+
+        // Get the output directory.
+        fw.SetPath(GetDefaultPath());
+        fw.SetDirectoryMode(true);
+        fw.Show();
+
+        folder = fw.GetSelectedPath();
     }
 
-    cout << "Press the HOME key to select a folder to place the " << endl
-        << "backup in, or any other key to cancel." << endl;
+    // Only the payload of the kernel partition is backed up, if its
+    // content is known.
+    if (backupSystem && gMTDs[MTD_KERNEL].name) {
+        kernel = GetMTDPartitionPayload(gMTDs[MTD_KERNEL]);
+
+        if (kernel.type != MTD_CONTENT_UNKNOWN) {
+            BackupPayload payload = { gMTDs[MTD_KERNEL].filename, 
+                GetMTDContentName(kernel.type), kernel.length };
+            info.payloads.push_back(payload);
+        }
+    }
 
-    if (!VerifyBackupCreationSpace(backupSystem, backupData, tempPath.c_str()))
+    // In repository mode, only the chunks missing from the store are
+    // written, so the space needed can not be estimated.
+    if (!gBackupRepository && !VerifyBackupCreationSpace(backupSystem, backupData, info, 
+            kernel, folder.c_str())) {
         cout << "WARNING: There may be insufficient space for creating " << endl
-            << "a backup." << endl;
+            << "a backup. Press HOME key to continue, any other key" << endl
+            << "to cancel." << endl;
 
-    if (GetButtonPress() != KEY_HOME)
-        goto cleanup;
+        if (GetButtonPress() != KEY_HOME)
+            return false;
+    }
 
-    // Get the output directory.
-    fw.SetPath(GetDefaultPath());
-    fw.SetDirectoryMode(true);
-    fw.Show();
+    // In repository mode, the data is compressed chunk by chunk in
+    // the store (with "zlib", at the level of "gzip" if selected).
+    if (gBackupRepository) {
+        JoinPath(storePath, folder.c_str(), CHUNK_STORE_NAME);
+
+        if (!chunkStore.Open(storePath.c_str(), gBackupCodec.type == CODEC_GZIP ? 
+                gBackupCodec.level : (gBackupCodec.type == CODEC_LZO ? 1 : 0))) {
+            cout << "Unable to create the chunk store." << endl;
+            NotifyWaitForButton();
+            return false;
+        }
+
+        store = &chunkStore;
+    }
 
     // Get the backup archive path.
-    MakeBackupPath(backupPath, fw.GetSelectedPath());
+    MakeBackupPath(backupPath, folder.c_str());
+
+    if (!mfw.Open(backupPath.c_str())) {
+        cout << "Unable to create the backup archive." << endl;
+        goto fail;
+    }
+
+    if (!WriteBackupInfo(mfw, info))
+        goto fail;
 
     // Try to backup kernel if needed.
     if (backupSystem && gMTDs[MTD_KERNEL].name) {
         const MTD &mtd = gMTDs[MTD_KERNEL];
         cout << "* Backing up kernel..." << endl;
-        JoinPath(temp, tempPath.c_str(), mtd.filename);
 
-        if (BackupMTDPartition(mtd, temp.c_str())) {
-            files += mtd.filename;
-            files += " ";
-        } else {
+        if (!(out = BeginBackupMember(mfw, store, chunks, mtd.filename, mtd.name, "none")) ||
+                !BackupMTDPartitionImage(mtd, *out, kernel) || !EndBackupMember(mfw, store, chunks))
             goto fail;
-        }
     }
 
     // Try to backup NAND if needed.
-    if (backupSystem && access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0) {
-        const char *tgz = "nand.tgz";
+    if (backupSystem && access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0 && gBackupImages) {
+        cout << "* Backing up NAND image..." << endl;
+
+        if (!(out = BeginBackupMember(mfw, store, chunks, MakeImageMemberName("nand", 
+                codec).c_str(), gMTDs[MTD_ROOTFS].name, codecName.c_str())) || 
+                !BackupUBIImage(*out, codec, gMTDs[MTD_ROOTFS].number, UBID_NUMBER, 
+                UBIV_NUMBER, DEV_NAND) || !EndBackupMember(mfw, store, chunks))
+            goto fail;
+    } else if (backupSystem && access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0) {
         cout << "* Backing up NAND..." << endl;
-        JoinPath(temp, tempPath.c_str(), tgz);
 
-        if (BackupUBI(temp.c_str(), gMTDs[MTD_ROOTFS].number, UBID_NUMBER, 
-                DEV_NAND, MOUNT_NAND)) {
-            files += tgz;
-            files += " ";
-        } else {
+        if (!(out = BeginBackupMember(mfw, store, chunks, MakeArchiveMemberName("nand", 
+                codec).c_str(), gMTDs[MTD_ROOTFS].name, codecName.c_str())) || 
+                !BackupUBI(*out, codec, gMTDs[MTD_ROOTFS].number, UBID_NUMBER, DEV_NAND, 
+                MOUNT_NAND) || !EndBackupMember(mfw, store, chunks))
             goto fail;
-        }
     }
 
     // Try to backup system if needed.
     if (backupSystem) {
-        const char *tgz = "system.tgz";
-        cout << "* Backing up system..." << endl;
-        JoinPath(temp, tempPath.c_str(), tgz);
+        const bool incremental = info.IsIncremental("system");
+        cout << "* Backing up system" << (incremental ? " (changes only)..." : "...") << endl;
 
-        if (BackupMountpoint(temp.c_str(), DEV_SYSTEM, MOUNT_SYSTEM)) {
-            files += tgz;
-            files += " ";
-        } else {
+        if (!BackupExtPartition(mfw, store, codec, "system", DEV_SYSTEM, MOUNT_SYSTEM,
+                incremental ? &parentSystem : NULL))
             goto fail;
-        }
     }
 
     // Try to backup data if needed.
     if (backupData) {
-        const char *tgz = "data.tgz";
-        cout << "* Backing up data..." << endl;
-        JoinPath(temp, tempPath.c_str(), tgz);
+        const bool incremental = info.IsIncremental("data");
+        cout << "* Backing up data" << (incremental ? " (changes only)..." : "...") << endl;
 
-        if (BackupMountpoint(temp.c_str(), DEV_DATA, MOUNT_DATA)) {
-            files += tgz;
-            files += " ";
-        } else {
+        if (!BackupExtPartition(mfw, store, codec, "data", DEV_DATA, MOUNT_DATA,
+                incremental ? &parentData : NULL))
             goto fail;
-        }
     }
 
-    cout << "* Preparing final backup..." << endl;
-    if (Tar(true, backupPath.c_str(), tempPath.c_str(), files.c_str(), false, false))
+    cout << "* Finishing backup..." << endl;
+    if (mfw.Close())
         goto success;
-    else
-        goto fail;
 
 fail:
     failed = true;
 
-success:
-cleanup:
     // Remove the (possibly) partial backup archive.
-    if (failed && backupPath.length() != 0) {
-        cout << "* Cleaning up failed backup archive..." << endl;
-        failed |= !Remove(backupPath.c_str(), false, true);
-    }
-
-    // Remove the entire temporary folder containing the
-    // individual backups.
-    cout << "* Cleaning up temporary folder used for backup creation..." << endl;
-    failed |= !Remove(tempPath.c_str(), true, true);
+    cout << "* Cleaning up failed backup archive..." << endl;
+    mfw.Abort();
 
+success:
     if (!failed)
         cout << "Success!" << endl;
 
@@ -201,65 +664,175 @@ cleanup:
     return false;
 }
 
-// Check if there may be insufficient space for backup restoration.
-inline bool VerifyBackupRestorationSpace(const char *archive, const char *tempPath) {
-    return GetFileSize(archive) < 
-        GetMountpointFreeSpace(tempPath);
+// Shows the contents of the backup and asks which member to restore.
+// Returns the member index, -1 for all members or -2 to cancel.
+static int SelectBackupMember(const MFWReader &mfw) {
+    vector<WindowOption> opts;
+    vector<int> members;
+    Window win;
+
+    opts.push_back(WindowOption("Restore everything", NULL));
+
+    for (int i = 0; i < mfw.GetMemberCount(); i++) {
+        const MFWMember &m = mfw.GetMember(i);
+        string option = "Restore only '" + m.name + "'";
+
+        // Manifests, etc. are restored along with their partition.
+        if (IsMetadataMember(m.name))
+            continue;
+
+        if (m.partition.length() != 0)
+            option += " to '" + m.partition + "'";
+
+        option += " (";
+        option += NumberToString(m.size / 1024);
+        option += " KB)";
+
+        opts.push_back(WindowOption(option, NULL));
+        members.push_back(i);
+    }
+
+    opts.push_back(WindowOption("(Cancel)", NULL));
+
+    win.SetTitle(mfw.GetVersion() >= MFW_VERSION_INDEXED ? 
+        "Contents of backup" : "Contents of backup (old format)");
+    win.SetOptions(opts);
+
+    int ret = win.Show();
+
+    if (ret <= 0)
+        return -1;
+    else if (ret > (int)members.size())
+        return -2;
+    else
+        return members[ret - 1];
+}
+
+// Returns the index of the archive of the partition in the backup.
+static int FindArchiveMember(const MFWReader &mfw, const char *partition) {
+    for (int i = 0; i < mfw.GetMemberCount(); i++)
+        if (IsArchiveMember(mfw.GetMember(i).name.c_str(), partition))
+            return i;
+
+    return -1;
+}
+
+// Verifies that each backup of the chain needed to restore the
+// incrementally backed up partition has its archive.
+static bool VerifyPartitionLayers(const vector<string> &chain, 
+        const vector<BackupInfo> &infos, const char *partition) {
+
+    vector<size_t> layers;
+
+    if (!GetPartitionLayers(infos, partition, layers))
+        return false;
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        MFWReader layer;
+
+        if (!layer.Open(chain[layers[i]].c_str()) || FindArchiveMember(layer, partition) < 0 ||
+                (i > 0 && layer.FindMember((string(partition) + DELETED_SUFFIX).c_str()) < 0)) {
+            cout << "The backup '" << GetFileName(chain[layers[i]]) << "' has no" << endl
+                << "archive of '" << partition << "'." << endl;
+            return false;
+        }
+    }
+
+    return true;
 }
 
-// Restores the backup specified by user. While restoring the backup
-// the temporary directory provided by MakeTempFolder() is used.
-// Calls RestoreUBI(), RestorepMountpoint() and RestoreMTDPartition().
+// Restores an incrementally backed up partition: the full archive is
+// extracted to the formatted partition, and then each incremental
+// archive is extracted over it after removing the deleted files.
+// Calls RestoreMountpoint().
+static bool RestorePartitionLayers(const vector<string> &chain, 
+        const vector<BackupInfo> &infos, const char *partition,
+        const char *dev, const char *mountpoint, const char *fs) {
+
+    vector<size_t> layers;
+
+    if (!GetPartitionLayers(infos, partition, layers))
+        return false;
+
+    for (size_t i = 0; i < layers.size(); i++) {
+        MFWReader layer;
+        ChunkStore store;
+        ChunkInStream chunks;
+        InStream *in;
+        vector<string> deleted;
+
+        cout << "  from '" << GetFileName(chain[layers[i]]) << "'" << endl;
+
+        if (!layer.Open(chain[layers[i]].c_str())) {
+            cout << "Unable to open the backup archive." << endl;
+            return false;
+        }
+
+        if (i > 0 && (!SelectMemberByName(layer, string(partition) + DELETED_SUFFIX) ||
+                !LoadPathList(deleted, layer))) {
+            cout << "Unable to read the list of deleted files." << endl;
+            return false;
+        }
+
+        if (!layer.Select(FindArchiveMember(layer, partition)) || 
+                !(in = OpenBackupMember(layer, chain[layers[i]], store, chunks)) ||
+                !RestoreMountpoint(*in, dev, mountpoint, fs, NULL, i == 0,
+                i > 0 ? &deleted : NULL))
+            return false;
+    }
+
+    return true;
+}
+
+// Restores the backup specified by user. The archive is read twice: 
+// first only the member headers (to verify), and then each member is
+// streamed directly to its partition. The user may choose to restore
+// only one of the members.
+// Calls RestoreUBI(), RestoreMountpoint(), RestoreImage() and 
+// RestoreMTDPartition().
 static bool RestoreBackupFromFile() {
     FileWindow fw;
-    string tempPath;
-    DIR *dir = NULL;
-    dirent *ent = NULL;
-    vector<string> filters;
+    MFWReader mfw;
+    vector<string> filters, chain;
+    vector<BackupInfo> infos;
     bool verifyPhase = true, extractPhase = false,
         modified = false, warning = false, failed = false;
+    int only;
 
     gTerminal.clear();
 
-    // Get a temporary folder.
-    if (!MakeTempFolder(tempPath, GetDefaultPath())) {
-        cout << "Unable to create a temporary folder for backup restoration." << endl;
-        NotifyWaitForButton();
-        return false;
-    }
-
-    cout << "Press the HOME key to select a folder to place the " << endl
-        << "backup in, or any other key to cancel." << endl;
+    cout << "Press the HOME key to select the backup to restore," << endl
+        << "or any other key to cancel." << endl;
 
     if (GetButtonPress() != KEY_HOME)
-        goto cleanup;
+        return false;
 
     filters.push_back("*.mfw");
 
-    // Get the output directory.
+    // Get the backup archive.
     fw.SetPath(GetDefaultPath());
     fw.SetFilters(filters);
     fw.Show();
 
-    if (!VerifyBackupRestorationSpace(fw.GetSelectedPath(), tempPath.c_str())) {
-        cout << "WARNING: There may be insufficient space for restoring " << endl
-            << "the backup. Press HOME key to continue, any other key" << endl
-            << "to exit. Your device has not yet been modified." << endl;
+    // An incremental backup is restored along with its parents.
+    if (!LoadBackupChain(fw.GetSelectedPath(), chain, infos))
+        goto fail;
 
-        if (GetButtonPress() != KEY_HOME) {
-            // To avoid the message shown on a failure reset both flags.
-            verifyPhase = extractPhase = false;
-            goto fail;
-        }
+    if (!mfw.Open(fw.GetSelectedPath())) {
+        cout << "Unable to open the backup archive." << endl;
+        goto fail;
     }
 
-    cout << "* Extracing archived backup..." << endl;
-    if (!Tar(false, fw.GetSelectedPath(), tempPath.c_str()))
-        goto fail;
+    if ((only = SelectBackupMember(mfw)) == -2) {
+        mfw.Close();
+        return false;
+    }
+
+    gTerminal.clear();
 
     for (;;) {
-        if (!(dir = opendir(tempPath.c_str()))) {
-            cout << "Unable to access temporary directory." << endl;
+        if (!mfw.Rewind()) {
+            cout << "Unable to access the backup archive." << endl;
             goto fail;
         }
 
@@ -268,30 +841,41 @@ static bool RestoreBackupFromFile() {
         else
             cout << "+ Extracting..." << endl;
 
-        while ((ent = readdir(dir)) != NULL) {
-            string backupName;
+        while (mfw.Next()) {
+            const char *name = mfw.GetMemberName();
+            const size_t size = GetMemberDataSize(mfw);
+            ChunkStore store;
+            ChunkInStream chunks;
+            InStream *in;
+
+            if (only >= 0 && mfw.GetMember(only).name != name)
+                continue;
 
-            if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            if (IsMetadataMember(name))
                 continue;
 
-            JoinPath(backupName, tempPath.c_str(), ent->d_name);
+            // Recipes are read from the chunk store.
+            if (!(in = OpenBackupMember(mfw, chain.back(), store, chunks)))
+                goto fail;
 
             if (verifyPhase) {
                 // In verify phase, we attempt to check if we can access the required media.
                 // If not, we cancel the process before doing anything.
-                if (gMTDs[MTD_KERNEL].name && !strcmp(ent->d_name, gMTDs[MTD_KERNEL].filename)) {
+                if (gMTDs[MTD_KERNEL].name && !strcmp(name, gMTDs[MTD_KERNEL].filename)) {
                     // Make sure we can access kernel.
                     if (access(gMTDs[MTD_KERNEL].sysfs, F_OK) != 0 && access(SYS_INTSD, F_OK) != 0) {
                         cout << "Unable to access kernel on NAND/MMC." << endl;
                         goto fail;
                     }
 
-                    // Check space requirements.
-                    if (gMTDs[MTD_KERNEL].size < GetFileSize(backupName.c_str())) {
-                        cout << "WARNING: There may be insufficient space on 'kernel' partition." << endl;
-                        warning = true;
+                    const BackupPayload *payload = infos.back().FindPayload(name);
+
+                    // The kernel partition is never overflowed.
+                    if (gMTDs[MTD_KERNEL].size < (payload ? payload->length : (long long)size)) {
+                        cout << "The kernel in the backup is larger than the 'kernel' partition." << endl;
+                        goto fail;
                     }
-                } else if (!strcmp(ent->d_name, "nand.tgz")) {
+                } else if (IsArchiveMember(name, "nand") || IsImageMember(name, "nand")) {
                     // Make sure we can access NAND.
                     if (access(gMTDs[MTD_ROOTFS].sysfs, F_OK) != 0) {
                         cout << "Unable to access NAND." << endl;
@@ -299,11 +883,11 @@ static bool RestoreBackupFromFile() {
                     }
 
                     // Check space requirements.
-                    if (512 * GetBlockDeviceSize(gMTDs[MTD_ROOTFS].sysfs) < GetFileSize(backupName.c_str())) {
+                    if (512 * GetBlockDeviceSize(gMTDs[MTD_ROOTFS].sysfs) < size) {
                         cout << "WARNING: There may be insufficient space on NAND." << endl;
                         warning = true;
                     }
-                } else if (!strcmp(ent->d_name, "system.tgz")) {
+                } else if (IsArchiveMember(name, "system") || IsImageMember(name, "system")) {
                     // Make sure we can access "/system" partition.
                     if (access(SYS_SYSTEM, F_OK) != 0) {
                         cout << "Unable to access 'system' partition on internal SD." << endl;
@@ -311,11 +895,15 @@ static bool RestoreBackupFromFile() {
                     }
 
                     // Check space requirements.
-                    if (512 * GetBlockDeviceSize(SYS_SYSTEM) < GetFileSize(backupName.c_str())) {
+                    if (512 * GetBlockDeviceSize(SYS_SYSTEM) < size) {
                         cout << "WARNING: There may be insufficient space on 'system' partition." << endl;
                         warning = true;
                     }
-                } else if (!strcmp(ent->d_name, "data.tgz")) {
+
+                    if (infos.back().IsIncremental("system") && 
+                            !VerifyPartitionLayers(chain, infos, "system"))
+                        goto fail;
+                } else if (IsArchiveMember(name, "data") || IsImageMember(name, "data")) {
                     // Make sure we can access "/data" partition.
                     if (access(SYS_DATA, F_OK) != 0) {
                         cout << "Unable to access 'data' partition on internal SD." << endl;
@@ -323,47 +911,83 @@ static bool RestoreBackupFromFile() {
                     }
 
                     // Check space requirements.
-                    if (512 * GetBlockDeviceSize(SYS_DATA) < GetFileSize(backupName.c_str())) {
+                    if (512 * GetBlockDeviceSize(SYS_DATA) < size) {
                         cout << "WARNING: There may be insufficient space on 'data' partition." << endl;
                         warning = true;
                     }
+
+                    if (infos.back().IsIncremental("data") && 
+                            !VerifyPartitionLayers(chain, infos, "data"))
+                        goto fail;
                 } else {
-                    cout << "An unknown file in the backup archive was ignored: " << ent->d_name << endl;
-                    log << WARN << "Unknown file in backup: " << ent->d_name << endl;
+                    cout << "An unknown file in the backup archive was ignored: " << name << endl;
+                    log << WARN << "Unknown file in backup: " << name << endl;
                 }
             } else {
-                string temp;
-                JoinPath(temp, tempPath.c_str(), ent->d_name);
-
                 // In extract phase, we actually make changes to the user's system.
-                if (gMTDs[MTD_KERNEL].name && !strcmp(ent->d_name, gMTDs[MTD_KERNEL].filename)) {
+                if (gMTDs[MTD_KERNEL].name && !strcmp(name, gMTDs[MTD_KERNEL].filename)) {
+                    const BackupPayload *payload = infos.back().FindPayload(name);
+
                     modified = true;
-                    cout << "* Flashing kernel..." << endl;
-                    if (!RestoreMTDPartition(gMTDs[MTD_KERNEL], temp.c_str()))
+                    if (payload)
+                        cout << "* Flashing kernel (" << payload->type << ", " 
+                            << payload->length / 1024 << " KB)..." << endl;
+                    else
+                        cout << "* Flashing kernel..." << endl;
+
+                    if (!RestoreMTDPartition(gMTDs[MTD_KERNEL], *in, size))
                         goto fail;
-                } else if (!strcmp(ent->d_name, "nand.tgz")) {
+                } else if (IsArchiveMember(name, "nand")) {
                     modified = true;
                     cout << "* Restoring NAND..." << endl;
-                    if (!RestoreUBI(temp.c_str(), gMTDs[MTD_ROOTFS], UBID_NUMBER, 
+                    if (!RestoreUBI(*in, gMTDs[MTD_ROOTFS], UBID_NUMBER, 
                             DEV_NAND, MOUNT_NAND))
                         goto fail;
-                } else if (!strcmp(ent->d_name, "system.tgz")) {
+                } else if (IsImageMember(name, "nand")) {
+                    modified = true;
+                    cout << "* Restoring NAND image..." << endl;
+                    if (!RestoreUBIImage(*in, gMTDs[MTD_ROOTFS], UBID_NUMBER, UBIV_NUMBER))
+                        goto fail;
+                } else if (IsArchiveMember(name, "system") && infos.back().IsIncremental("system")) {
+                    modified = true;
+                    cout << "* Restoring 'system' partition (incremental)..." << endl;
+                    if (!RestorePartitionLayers(chain, infos, "system", DEV_SYSTEM, 
+                            MOUNT_SYSTEM, FS_SYSTEM))
+                        goto fail;
+                } else if (IsArchiveMember(name, "system")) {
                     modified = true;
                     cout << "* Restoring 'system' partition..." << endl;
-                    if (!RestoreMountpoint(temp.c_str(), DEV_SYSTEM, MOUNT_SYSTEM, FS_SYSTEM))
+                    if (!RestoreMountpoint(*in, DEV_SYSTEM, MOUNT_SYSTEM, FS_SYSTEM))
+                        goto fail;
+                } else if (IsImageMember(name, "system")) {
+                    modified = true;
+                    cout << "* Restoring 'system' partition image..." << endl;
+                    if (!RestoreImage(*in, DEV_SYSTEM))
                         goto fail;
-                } else if (!strcmp(ent->d_name, "data.tgz")) {
+                } else if (IsArchiveMember(name, "data") && infos.back().IsIncremental("data")) {
+                    modified = true;
+                    cout << "* Restoring 'data' partition (incremental)..." << endl;
+                    if (!RestorePartitionLayers(chain, infos, "data", DEV_DATA, 
+                            MOUNT_DATA, FS_DATA))
+                        goto fail;
+                } else if (IsArchiveMember(name, "data")) {
                     modified = true;
                     cout << "* Restoring 'data' partition..." << endl;
-                    if (!RestoreMountpoint(temp.c_str(), DEV_DATA, MOUNT_DATA, FS_DATA))
+                    if (!RestoreMountpoint(*in, DEV_DATA, MOUNT_DATA, FS_DATA))
+                        goto fail;
+                } else if (IsImageMember(name, "data")) {
+                    modified = true;
+                    cout << "* Restoring 'data' partition image..." << endl;
+                    if (!RestoreImage(*in, DEV_DATA))
                         goto fail;
                 }
             }
         }
 
-        // Close the directory.
-        closedir(dir);
-        dir = NULL;
+        if (!mfw.IsEnd()) {
+            cout << "The backup archive is corrupt." << endl;
+            goto fail;
+        }
 
         if (verifyPhase && warning) {
             cout << "Press HOME key to continue, any other key to cancel restoration." << endl
@@ -394,12 +1018,6 @@ static bool RestoreBackupFromFile() {
 fail:
     failed = true;
 
-    // Close the directory if left open.
-    if (dir) {
-        closedir(dir);
-        dir = NULL;
-    }
-
     if (verifyPhase && !extractPhase)
         cout << "Because the failure occurred in the verification phase," << endl
             << "no changes were made to your device and hence it should" << endl
@@ -410,11 +1028,7 @@ fail:
             << "or flash another firmware." << endl;
 
 success:
-cleanup:
-    // Remove the entire temporary folder containing the
-    // individual backups.
-    cout << "* Cleaning up temporary folder used for backup restoration..." << endl;
-    failed |= !Remove(tempPath.c_str(), true, true);
+    mfw.Close();
 
     if (!failed)
         cout << "Success!" << endl;
@@ -423,6 +1037,210 @@ cleanup:
     return false;
 }
 
+// Shows the progress of a verification.
+class VerifyProgress : public MFWProgress {
+private:
+    time_t last;
+
+public:
+    VerifyProgress() : last(0) { }
+
+    virtual void Update(off_t done, off_t total) {
+        ShowImageProgress(last, done, total);
+    }
+
+    void Finish(off_t total) {
+        ShowImageProgress(last, total, total, true);
+    }
+};
+
+// Reads the data of a recipe member from the chunk store (checking
+// each chunk) without writing it anywhere.
+static bool VerifyChunkedMember(MFWReader &mfw, const string &path, int i) {
+    ChunkStore store;
+    ChunkInStream chunks;
+    InStream *in;
+    char *buffer = new char[STREAM_BUFFER_SIZE];
+    long long bytes = 0;
+    ssize_t ret = -1;
+
+    if (mfw.Select(i) && (in = OpenBackupMember(mfw, path, store, chunks)))
+        while ((ret = in->Read(buffer, STREAM_BUFFER_SIZE)) > 0)
+            bytes += ret;
+
+    delete[] buffer;
+    return ret == 0 && bytes == mfw.GetMember(i).usize;
+}
+
+// Verifies the backup specified by user against the checksums 
+// recorded in it, without extracting anything.
+static bool VerifyBackup() {
+    FileWindow fw;
+    MFWReader mfw;
+    MFWVerifier verifier;
+    VerifyProgress progress;
+    BackupInfo info;
+    vector<string> filters, failed;
+    string path;
+    off_t total = 0;
+
+    gTerminal.clear();
+
+    cout << "Press the HOME key to select the backup to verify," << endl
+        << "or any other key to cancel." << endl;
+
+    if (GetButtonPress() != KEY_HOME)
+        return false;
+
+    filters.push_back("*.mfw");
+
+    fw.SetPath(GetDefaultPath());
+    fw.SetFilters(filters);
+    fw.Show();
+
+    path = fw.GetSelectedPath();
+    gTerminal.clear();
+
+    cout << "+ Verifying checksums..." << endl;
+
+    if (!verifier.Verify(path.c_str(), &progress)) {
+        cout << "Unable to verify the backup archive (old format?)." << endl;
+        NotifyWaitForButton();
+        return false;
+    }
+
+    for (size_t i = 0; i < verifier.GetMembers().size(); i++)
+        total += verifier.GetMembers()[i].size;
+
+    progress.Finish(total);
+    failed = verifier.GetFailedMembers();
+
+    // The data of recipes is in the chunk store.
+    if (mfw.Open(path.c_str())) {
+        for (int i = 0; i < mfw.GetMemberCount(); i++) {
+            const MFWMember &m = mfw.GetMember(i);
+
+            if (m.codec != CHUNK_CODEC_NAME || 
+                    find(failed.begin(), failed.end(), m.name) != failed.end())
+                continue;
+
+            cout << "+ Verifying chunks of '" << m.name << "'..." << endl;
+
+            if (!VerifyChunkedMember(mfw, path, i))
+                failed.push_back(m.name);
+        }
+
+        ReadBackupInfo(mfw, info);
+        mfw.Close();
+    }
+
+    if (failed.size() == 0) {
+        cout << "All " << verifier.GetMembers().size() << " members of the backup are intact." << endl;
+    } else {
+        cout << "The following members of the backup are corrupt:" << endl;
+
+        for (size_t i = 0; i < failed.size(); i++)
+            cout << "  " << failed[i] << endl;
+    }
+
+    if (info.parentName.length())
+        cout << "This backup depends on '" << info.parentName << "'," << endl
+            << "which should be verified as well." << endl;
+
+    NotifyWaitForButton();
+    return false;
+}
+
+// Asks for the compression of new backups.
+static bool SelectBackupCompression() {
+    vector<WindowOption> opts;
+    vector<Codec> codecs;
+    Window win;
+
+    codecs.push_back(Codec(CODEC_LZO));
+    opts.push_back(WindowOption("Fast (LZO)", NULL));
+    codecs.push_back(Codec(CODEC_NONE));
+    opts.push_back(WindowOption("None (largest, fastest)", NULL));
+
+    for (int level = 1; level <= 9; level++) {
+        string option = "gzip level ";
+        option += NumberToString(level);
+
+        if (level == 1)
+            option += " (fast)";
+        else if (level == 6)
+            option += " (default)";
+        else if (level == 9)
+            option += " (smallest)";
+
+        codecs.push_back(Codec(CODEC_GZIP, level));
+        opts.push_back(WindowOption(option, NULL));
+    }
+
+    for (size_t i = 0; i < codecs.size(); i++)
+        if (CodecGetName(codecs[i]) == CodecGetName(gBackupCodec))
+            opts[i].first += " *";
+
+    opts.push_back(WindowOption("(Back)", NULL));
+
+    win.SetTitle("Compression of new backups");
+    win.SetOptions(opts);
+
+    int ret = win.Show();
+
+    if (ret >= 0 && ret < (int)codecs.size()) {
+        gBackupCodec = codecs[ret];
+        log << INFO << "Backup compression: " << CodecGetName(gBackupCodec) << endl;
+    }
+
+    return false;
+}
+
+// Asks how "ext4" partitions are backed up.
+static bool SelectBackupMethod() {
+    vector<WindowOption> opts;
+    Window win;
+
+    opts.push_back(WindowOption(string("Files (archive)") + (gBackupImages ? "" : " *"), NULL));
+    opts.push_back(WindowOption(string("Used blocks (image, faster)") + (gBackupImages ? " *" : ""), NULL));
+    opts.push_back(WindowOption("(Back)", NULL));
+
+    win.SetTitle("Backup method of NAND, 'system' and 'data'");
+    win.SetOptions(opts);
+
+    int ret = win.Show();
+
+    if (ret == 0 || ret == 1) {
+        gBackupImages = (ret == 1);
+        log << INFO << "Backup method: " << (gBackupImages ? "image" : "archive") << endl;
+    }
+
+    return false;
+}
+
+// Asks where new backups store their data.
+static bool SelectBackupStorage() {
+    vector<WindowOption> opts;
+    Window win;
+
+    opts.push_back(WindowOption(string("Single file") + (gBackupRepository ? "" : " *"), NULL));
+    opts.push_back(WindowOption(string("Shared chunk store (deduplicated)") + 
+        (gBackupRepository ? " *" : ""), NULL));
+    opts.push_back(WindowOption("(Back)", NULL));
+
+    win.SetTitle("Storage of new backups");
+    win.SetOptions(opts);
+
+    int ret = win.Show();
+
+    if (ret == 0 || ret == 1) {
+        gBackupRepository = (ret == 1);
+        log << INFO << "Backup storage: " << (gBackupRepository ? "chunk store" : "file") << endl;
+    }
+
+    return false;
+}
+
 static bool CreateSystemBackup() {
     return CreateBackup(true, false);
 }
@@ -435,6 +1253,52 @@ static bool CreateDataSystemBackup() {
     return CreateBackup(true, true);
 }
 
+// Creates a backup of the files changed since the backup specified
+// by user, of the partitions that backup contains.
+static bool CreateIncrementalBackup() {
+    FileWindow fw;
+    MFWReader parent;
+    vector<string> filters;
+    string parentPath;
+    bool backupSystem, backupData;
+
+    gTerminal.clear();
+
+    cout << "Press the HOME key to select the backup the new backup" << endl
+        << "is based on, or any other key to cancel." << endl;
+
+    if (GetButtonPress() != KEY_HOME)
+        return false;
+
+    filters.push_back("*.mfw");
+
+    fw.SetPath(GetDefaultPath());
+    fw.SetFilters(filters);
+    fw.Show();
+
+    parentPath = fw.GetSelectedPath();
+
+    if (!parent.Open(parentPath.c_str())) {
+        gTerminal.clear();
+        cout << "Unable to open the backup archive." << endl;
+        NotifyWaitForButton();
+        return false;
+    }
+
+    backupSystem = FindArchiveMember(parent, "system") >= 0;
+    backupData = FindArchiveMember(parent, "data") >= 0;
+    parent.Close();
+
+    if (!backupSystem && !backupData) {
+        gTerminal.clear();
+        cout << "The backup has no archives of 'system' or 'data'." << endl;
+        NotifyWaitForButton();
+        return false;
+    }
+
+    return CreateBackup(backupSystem, backupData, parentPath.c_str());
+}
+
 static bool RestoreBackup() {
     return RestoreBackupFromFile();
 }
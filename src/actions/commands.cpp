@@ -1,12 +1,15 @@
 /*
  *  commands.cpp:
- *      - Shell commands (e.g. tar, mount, etc.) implementation.
+ *      - Shell commands (e.g. mount, dd, etc.) and archive implementation.
  */
 
 // Execute the specified command and notify user if failed.
-// Notification is simply using "cout".
-inline bool ExecuteAndNotifyIfFail(const char *cmd) {
-    if (SysCall(cmd) != 0) {
+// Notification is simply using "cout". Only the tail of the output
+// is logged (if failed), unless "output" is SYSCALL_LOG_ALL.
+inline bool ExecuteAndNotifyIfFail(const char *cmd, SysCallLog output = SYSCALL_LOG_TAIL,
+        SysCallProgress *progress = NULL) {
+
+    if (SysCall(cmd, output, progress) != 0) {
         cout << "An error occured while trying to perform the requested operation" << endl;
         return false;
     }
@@ -14,6 +17,40 @@ inline bool ExecuteAndNotifyIfFail(const char *cmd) {
     return true;
 }
 
+// Execute the specified command writing its output to the stream and
+// notify user if failed. Notification is simply using "cout".
+inline bool ExecuteToStreamAndNotifyIfFail(const char *cmd, OutStream &out) {
+    FILE *pipe = SysCallOpen(cmd, "r");
+    bool success = (pipe != NULL);
+
+    if (pipe) {
+        success = CopyStream(pipe, out);
+        success &= (SysCallClose(pipe) == 0);
+    }
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
+}
+
+// Execute the specified command reading its input from the stream and
+// notify user if failed. Notification is simply using "cout".
+inline bool ExecuteFromStreamAndNotifyIfFail(const char *cmd, InStream &in) {
+    FILE *pipe = SysCallOpen(cmd, "w");
+    bool success = (pipe != NULL);
+
+    if (pipe) {
+        success = CopyStream(in, pipe);
+        success &= (SysCallClose(pipe) == 0);
+    }
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
+}
+
 // Post a message asking for button press to continue.
 inline void NotifyWaitForButton() {
     cout << "Press any key to return to the menu." << endl;
@@ -106,106 +143,505 @@ static bool PopDirectory() {
     return ExecuteAndNotifyIfFail(cmd.c_str());
 }
 
-// Executes "tar" command for creating\extracting an archive.
-static bool Tar(bool create, const char *tar, const char *chdir,
-        const char *files = NULL, bool addPerms = true, 
-        bool compress = true, bool verbose = true) {
+// Prints the progress of archiving\extraction about once a second.
+class ConsoleProgress : public ArchiveProgress {
+private:
+    time_t last;
+    long long entries;
+    long long bytes;
+    bool shown;
+
+public:
+    ConsoleProgress() : last(time(0)), entries(0), bytes(0), shown(false) { }
+
+    virtual void Update(const ArchiveEntry &entry, long long bytes) {
+        this->entries++;
+        this->bytes = bytes;
+
+        if (time(0) != last) {
+            last = time(0);
+            shown = true;
+            cout << "\r" << entries << " files, " << (bytes >> 20) << " MB" << flush;
+        }
+    }
 
-    string 
-    cmd = "tar -";
+    // Ends the progress line (if any).
+    void Done() {
+        if (shown)
+            cout << "\r" << entries << " files, " << (bytes >> 20) << " MB" << endl;
+    }
+};
+
+// Archives the contents of a directory to the stream, compressed
+// with the codec, and notify user if failed. The files are recorded
+// in the manifest (if any), and only files changed since the parent
+// manifest (if any) are archived.
+static bool TarCreate(OutStream &out, const char *dir, const Codec &codec = Codec(),
+        Manifest *manifest = NULL, const Manifest *parent = NULL) {
+    ConsoleProgress progress;
+    CompressOutStream compress;
+    TarWriter tar;
+    bool success;
+
+    log << CMMD << "tar create: " << dir << endl;
+
+    if ((success = compress.Init(out, codec))) {
+        tar.Init(compress, &progress);
+        tar.SetManifest(manifest, parent);
+        success = tar.AddTree(dir) && tar.Finish();
+        success = compress.Finish() && success;
+    }
 
-    if (create && files == NULL)
-        files = ".";
+    progress.Done();
+    log << (success ? INFO : ERRR) << "Archived " << tar.GetEntryCount() << " entries ("
+        << tar.GetByteCount() << " bytes, " << tar.GetStoredByteCount() 
+        << " not compressible, " << tar.GetUnchangedCount() << " files unchanged)." << endl;
 
-    if (create)
-        cmd += "c";
-    else
-        cmd += "x";
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
 
-    if (create && addPerms)
-        cmd += "p";
+    return success;
+}
 
-    if (create && compress)
-        cmd += "z";
+// Extracts a (possibly compressed, with any codec) archive from the 
+// stream to a directory and notify user if failed. If "update" is set,
+// only the files that differ are written and those that are not in the
+// archive deleted (see TarExtractor). Deltas are applied with the
+// patcher (if any).
+static bool TarExtract(InStream &in, const char *dir, bool update = false,
+        DeltaPatcher *patcher = NULL) {
+
+    ConsoleProgress progress;
+    DecompressInStream decompress;
+    TarReader reader;
+    TarExtractor tar;
+    bool success;
+
+    log << CMMD << "tar extract: " << dir << (update ? " (update)" : "") << endl;
+
+    if ((success = decompress.Init(in))) {
+        reader.Init(decompress);
+        tar.Init(dir, &progress);
+        tar.SetUpdate(update);
+        tar.SetDeltaPatcher(patcher);
+        success = tar.ExtractAll(reader);
+        success = decompress.Finish() && success;
+    }
 
-    if (verbose)
-        cmd += "v";
+    progress.Done();
+    log << (success ? INFO : ERRR) << "Extracted " << tar.GetEntryCount() << " entries ("
+        << tar.GetByteCount() << " bytes, " << tar.GetUnchangedCount() << " files unchanged, "
+        << tar.GetRemovedCount() << " removed)." << endl;
 
-    cmd += "f ";
-    cmd += tar;
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
 
-    if (chdir) {
-        cmd += " -C ";
-        cmd += chdir;
+    return success;
+}
+
+// Extracts a (possibly compressed) archive file to a directory
+// and notify user if failed.
+static bool TarExtract(const char *archive, const char *dir, bool update = false,
+        DeltaPatcher *patcher = NULL) {
+
+    FileInStream in;
+
+    if (!in.Open(archive)) {
+        cout << "Unable to open '" << archive << "'." << endl;
+        return false;
     }
 
-    if (files) {
-        cmd += " ";
-        cmd += files;
+    return TarExtract(in, dir, update, patcher);
+}
+
+// Writes data to a device at the offset.
+static bool WriteDevice(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Unable to write device at " << (long long)offset << ": " 
+                << strerror(errno) << endl;
+            return false;
+        }
+
+        buf += ret;
+        offset += ret;
+        len -= ret;
     }
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    return true;
+}
+
+// Prints the progress of imaging about once a second.
+// With "end" = true, the progress line is ended (if shown).
+inline void ShowImageProgress(time_t &last, long long done, long long total, bool end = false) {
+    if (end ? (last != 0) : (time(0) != last)) {
+        last = time(0);
+        cout << "\r" << (done >> 20) << " of " << (total >> 20) << " MB" << (end ? "\n" : "") << flush;
+    }
 }
 
+// Writes an image of the used blocks of the "ext4" device (which must
+// not be mounted) to the stream, compressed with the codec, and notify
+// user if failed.
+static bool ImageCreate(OutStream &out, const char *dev, const Codec &codec) {
+    vector<ImageExtent> extents;
+    CompressOutStream compress;
+    ImageWriter image;
+    off_t size;
+    unsigned int blockSize;
+    long long total = 0, done = 0;
+    time_t last = 0;
+    char *buffer = NULL;
+    bool success = false;
+    int fd;
+
+    log << CMMD << "image create: " << dev << endl;
+
+    if ((fd = open(dev, O_RDONLY)) < 0) {
+        log << ERRR << "Unable to open '" << dev << "': " << strerror(errno) << endl;
+        goto done;
+    }
 
-// Executes the "unzip" command.
-static bool Unzip(const char *zip, const char *chdir,
-        bool quiet = false, bool overwrite = true) {
+    if (!Ext4GetUsedExtents(fd, extents, size, blockSize))
+        goto done;
 
-    string
-    cmd = "unzip";
+    for (size_t i = 0; i < extents.size(); i++)
+        total += extents[i].length;
 
-    if (quiet)
-        cmd += " -q";
+    log << INFO << "Imaging " << total << " of " << (long long)size << " bytes in " 
+        << extents.size() << " extents." << endl;
 
-    if (overwrite)
-        cmd += " -o";
+    if (!(buffer = (char *)malloc(STREAM_BUFFER_SIZE)) || !compress.Init(out, codec))
+        goto done;
 
-    cmd += " ";
-    cmd += zip;
-    cmd += " -d ";
-    cmd += chdir;
+    if (!image.Init(compress, size, blockSize))
+        goto finish;
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    // The extents are in order, so the device is read sequentially.
+    for (size_t i = 0; i < extents.size(); i++) {
+        off_t offset = extents[i].offset, left = extents[i].length;
+
+        if (!image.AddData(offset, left))
+            goto finish;
+
+        while (left > 0) {
+            ssize_t ret = pread(fd, buffer, min(off_t(STREAM_BUFFER_SIZE), left), offset);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret <= 0) {
+                log << ERRR << "Unable to read '" << dev << "' at " << (long long)offset << "." << endl;
+                goto finish;
+            }
+
+            if (!image.Write(buffer, ret))
+                goto finish;
+
+            offset += ret;
+            left -= ret;
+            done += ret;
+            ShowImageProgress(last, done, total);
+        }
+    }
+
+    success = image.Finish();
+
+finish:
+    success = compress.Finish() && success;
+    ShowImageProgress(last, done, total, true);
+
+done:
+    if (fd >= 0)
+        close(fd);
+
+    free(buffer);
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
 }
 
-// Executes "mount" command.
-static bool Mount(const char *dev, const char *mountpoint,
-        const char *fs = NULL, const char *opts = NULL) {
+// Writes a (possibly compressed) image from the stream to the device
+// (which must not be mounted) and notify user if failed. Only the
+// bytes covered by the image records are written.
+static bool ImageExtract(InStream &in, const char *dev) {
+    DecompressInStream decompress;
+    ImageReader image;
+    ImageRecord record;
+    long long done = 0;
+    time_t last = 0;
+    char *buffer = NULL;
+    bool success = false;
+    int fd;
+
+    log << CMMD << "image extract: " << dev << endl;
+
+    if ((fd = open(dev, O_WRONLY)) < 0) {
+        log << ERRR << "Unable to open '" << dev << "': " << strerror(errno) << endl;
+        goto done;
+    }
 
-    string 
-    cmd = "mount";
+    if (!(buffer = (char *)malloc(STREAM_BUFFER_SIZE)) || !decompress.Init(in))
+        goto done;
+
+    if (!image.Init(decompress))
+        goto finish;
 
-    if (fs) {
-        cmd += " -t ";
-        cmd += fs;
+    if (image.GetSize() > lseek(fd, 0, SEEK_END)) {
+        cout << "The image is larger than the partition." << endl;
+        goto finish;
     }
 
-    if (opts) {
-        cmd += " -o ";
-        cmd += opts;
+    while (image.Next(record)) {
+        off_t offset = record.offset, left = record.length;
+
+        // Repeated data is expanded in the buffer.
+        if (record.type == IMAGE_FILL)
+            for (size_t i = 0; i < STREAM_BUFFER_SIZE; i++)
+                buffer[i] = (record.fill >> (8 * (i % 4))) & 0xFF;
+
+        while (left > 0) {
+            ssize_t ret = min(off_t(STREAM_BUFFER_SIZE), left);
+
+            if (record.type == IMAGE_DATA && (ret = image.Read(buffer, ret)) <= 0)
+                goto finish;
+
+            if (!WriteDevice(fd, buffer, ret, offset))
+                goto finish;
+
+            offset += ret;
+            left -= ret;
+            done += ret;
+            ShowImageProgress(last, done, image.GetSize());
+        }
     }
 
-    cmd += " ";
-    cmd += dev;
-    cmd += " ";
-    cmd += mountpoint;
+    success = image.IsEnd() && fsync(fd) == 0;
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+finish:
+    success = decompress.Finish() && success;
+    ShowImageProgress(last, done, image.GetSize(), true);
+
+done:
+    if (fd >= 0)
+        close(fd);
+
+    free(buffer);
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
 }
 
-// Executes "umount" command.
-static bool Unmount(const char *mountpoint, bool lazy = false) {
-    string 
-    cmd = "umount";
+// Writes an image of the UBI volume (which must not be mounted) to the
+// stream, compressed with the codec, and notify user if failed. Only
+// the mapped logical eraseblocks not holding 0xFF only are stored.
+static bool UBIImageCreate(OutStream &out, int device, int volume, const Codec &codec) {
+    UBIVolume vol;
+    CompressOutStream compress;
+    ImageWriter image;
+    long long size, lebSize, done = 0;
+    time_t last = 0;
+    char *buffer = NULL;
+    bool success = false;
+    int used = 0, lebs = 0;
 
-    if (lazy)
-        cmd += " -l";
+    log << CMMD << "ubi image create: " << device << "_" << volume << endl;
 
-    cmd += " ";
-    cmd += mountpoint;
+    if (!vol.Open(device, volume) || (size = vol.GetDataSize()) < 0 || 
+            (lebSize = vol.GetEraseblockSize()) <= 0)
+        goto done;
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    if (!(buffer = (char *)malloc(lebSize)) || !compress.Init(out, codec))
+        goto done;
+
+    if (!image.Init(compress, size, lebSize))
+        goto finish;
+
+    lebs = size / lebSize;
+
+    for (int leb = 0; leb < lebs; leb++) {
+        const off_t offset = (off_t)leb * lebSize;
+        unsigned int fill;
+
+        ShowImageProgress(last, offset, size);
+
+        if (!vol.IsMapped(leb))
+            continue;
+
+        if (pread(vol.GetDescriptor(), buffer, lebSize, offset) != lebSize) {
+            log << ERRR << "Unable to read UBI volume at " << (long long)offset << ": " 
+                << strerror(errno) << endl;
+            goto finish;
+        }
+
+        if (IsUniform(buffer, lebSize, fill) && fill == 0xffffffff)
+            continue;
+
+        if (!image.AddData(offset, lebSize) || !image.Write(buffer, lebSize))
+            goto finish;
+
+        used++;
+        done += lebSize;
+    }
+
+    log << INFO << "Imaged " << used << " of " << lebs << " logical eraseblocks." << endl;
+    success = image.Finish();
+
+finish:
+    success = compress.Finish() && success;
+    ShowImageProgress(last, size, size, true);
+
+done:
+    free(buffer);
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
+}
+
+// Writes a (possibly compressed) image from the stream to the UBI volume
+// (which must not be mounted) with a volume update, and notify user if
+// failed. The gaps of the image are written as 0xFF, which UBI leaves
+// unmapped.
+static bool UBIImageExtract(InStream &in, int device, int volume) {
+    UBIVolume vol;
+    DecompressInStream decompress;
+    ImageReader image;
+    ImageRecord record;
+    long long total = 0, done = 0;
+    time_t last = 0;
+    char *buffer = NULL;
+    bool success = false;
+
+    log << CMMD << "ubi image extract: " << device << "_" << volume << endl;
+
+    if (!vol.Open(device, volume, O_RDWR))
+        goto done;
+
+    if (!(buffer = (char *)malloc(STREAM_BUFFER_SIZE)) || !decompress.Init(in))
+        goto done;
+
+    if (!image.Init(decompress))
+        goto finish;
+
+    if (image.GetSize() > vol.GetDataSize()) {
+        cout << "The image is larger than the NAND volume." << endl;
+        goto finish;
+    }
+
+    // The update covers the whole image: a shorter update would leave
+    // the rest of the volume unmapped anyway, but its length is not
+    // known before the last record.
+    if (!vol.BeginUpdate(total = image.GetSize()))
+        goto finish;
+
+    for (;;) {
+        const bool next = image.Next(record);
+        const off_t end = next ? record.offset : image.GetSize();
+
+        // Gaps (and fill records) are written as repeated data.
+        while (done < end || (next && record.type == IMAGE_FILL && done < record.offset + record.length)) {
+            const bool gap = done < end;
+            const unsigned int fill = gap ? 0xffffffff : record.fill;
+            const off_t start = gap ? 0 : record.offset;
+            const off_t limit = gap ? end : record.offset + record.length;
+            const size_t len = min(off_t(STREAM_BUFFER_SIZE), limit - (off_t)done);
+
+            for (size_t i = 0; i < len; i++)
+                buffer[i] = (fill >> (8 * ((done - start + i) % 4))) & 0xFF;
+
+            if (!WriteDevice(vol.GetDescriptor(), buffer, len, done))
+                goto finish;
+
+            done += len;
+            ShowImageProgress(last, done, total);
+        }
+
+        if (!next)
+            break;
+
+        while (record.type == IMAGE_DATA && done < record.offset + record.length) {
+            ssize_t ret = image.Read(buffer, min(off_t(STREAM_BUFFER_SIZE), 
+                record.offset + record.length - (off_t)done));
+
+            if (ret <= 0 || !WriteDevice(vol.GetDescriptor(), buffer, ret, done))
+                goto finish;
+
+            done += ret;
+            ShowImageProgress(last, done, total);
+        }
+    }
+
+    success = image.IsEnd();
+
+finish:
+    success = decompress.Finish() && success;
+    ShowImageProgress(last, done, total, true);
+
+done:
+    free(buffer);
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
+}
+
+// Extracts a ".zip" file to a directory and notify user if failed.
+// The owner and mode of the files are set from the permission table
+// (if any) as they are created. If "update" is set, only the files
+// that differ are written and those that are not in the archive
+// deleted (see ZipExtractor). Deltas are applied with the patcher
+// (if any).
+static bool Unzip(const char *zip, const char *dir, PermissionTable *table = NULL,
+        bool update = false, DeltaPatcher *patcher = NULL) {
+
+    ConsoleProgress progress;
+    ZipReader reader;
+    ZipExtractor extractor;
+    bool success;
+
+    log << CMMD << "unzip: " << zip << " -> " << dir << (update ? " (update)" : "") << endl;
+
+    if ((success = reader.Open(zip))) {
+        extractor.Init(dir, table, &progress);
+        extractor.SetUpdate(update);
+        extractor.SetDeltaPatcher(patcher);
+        success = extractor.ExtractAll(reader);
+    }
+
+    progress.Done();
+    log << (success ? INFO : ERRR) << "Extracted " << extractor.GetEntryCount() << " entries ("
+        << extractor.GetByteCount() << " bytes, " << extractor.GetUnchangedCount()
+        << " files unchanged, " << extractor.GetRemovedCount() << " removed)." << endl;
+
+    if (!success)
+        cout << "An error occured while trying to perform the requested operation" << endl;
+
+    return success;
+}
+
+// Mounts a device (or reuses its mount, see MountManager) and notify
+// user if failed. Release the mount with gMounts.Release().
+static bool Mount(const char *dev, const char *mountpoint,
+        const char *fs = NULL, const char *opts = NULL) {
+
+    if (!gMounts.Acquire(dev, mountpoint, fs, opts)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
+
+    return true;
 }
 
 // Executes "mkdosfs" command.
@@ -234,151 +670,79 @@ static bool FormatExt(const char *dev, int fs = 2) {
     return ExecuteAndNotifyIfFail(cmd.c_str());
 }
 
-// Executes "dd" command.
-static bool DiskDump(const char *src, const char *dest, 
-        int bs = -1, int count = -1, int skip = 0, int seek = 0) {
-
-    string 
-    cmd = "dd if=";
-    cmd += src;
-    cmd += " of=";
-    cmd += dest;
-
-    if (bs != -1) {
-        cmd += " bs=";
-        cmd += NumberToString(bs);
-    }
-
-    if (count != -1) {
-        cmd += " count=";
-        cmd += NumberToString(count);
-    }
-
-    if (skip != 0) {
-        cmd += " skip=";
-        cmd += NumberToString(skip);
-    }
-
-    if (seek != 0) {
-        cmd += " seek=";
-        cmd += NumberToString(seek);
-    }
-
-    return ExecuteAndNotifyIfFail(cmd.c_str());
-}
-
-// Executes "flash_eraseall" command.
-static bool FlashEraseAll(const char *mtd, bool quiet = true) {
-    string 
-    cmd = "flash_eraseall";
-
-    if (quiet)
-        cmd += " -q";
+// Shows the amount and the throughput of a finished copy.
+inline void ShowDiskThroughput(const DiskDumper &dumper) {
+    cout << (dumper.GetByteCount() >> 10) << " KB in " << dumper.GetMilliseconds() / 1000 
+        << "." << (dumper.GetMilliseconds() / 100) % 10 << " s (" << dumper.GetThroughput()
+        << " KB/s)" << endl;
 
-    cmd += " ";
-    cmd += mtd;
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    log << INFO << "Copied " << dumper.GetByteCount() << " bytes in " 
+        << dumper.GetMilliseconds() << " ms." << endl;
 }
 
-// Executes "nanddump" command.
-static bool NandDump(const char *mtd, const char *file, 
-        bool noOOB = true, bool noBadBlocks = true) {
-
-    string 
-    cmd = "nanddump -f ";
-    cmd += file;
-
-    if (noOOB)
-        cmd += " -o";
+// Copies "length" bytes of the device at "offset" to the stream and
+// notify user if failed.
+static bool DiskDump(const char *dev, off_t offset, off_t length, OutStream &out) {
+    DiskDumper dumper;
 
-    if (noBadBlocks)
-        cmd += " -b";
+    log << CMMD << "disk read: " << dev << " @" << (long long)offset << " +" 
+        << (long long)length << endl;
 
-    cmd += " ";
-    cmd += mtd;
+    if (!dumper.Read(dev, offset, length, out, true)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    ShowDiskThroughput(dumper);
+    return true;
 }
 
-// Executes "nandwrite" command.
-static bool NandWrite(const char *mtd, const char *file, 
-        bool pad = true, bool quiet = true) {
+// Copies the stream to the device at "offset" (at most "length" bytes)
+// and notify user if failed.
+static bool DiskDump(InStream &in, const char *dev, off_t offset, off_t length) {
+    DiskDumper dumper;
 
-    string 
-    cmd = "nandwrite ";
-    cmd += mtd;
-    cmd += " ";
-    cmd += file;
-
-    if (pad)
-        cmd += " -p";
+    log << CMMD << "disk write: " << dev << " @" << (long long)offset << " +" 
+        << (long long)length << endl;
 
-    if (quiet)
-        cmd += " -q";
+    if (!dumper.Write(in, dev, offset, length, true)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    ShowDiskThroughput(dumper);
+    return true;
 }
 
-// Executes "ubiattach" command.
+// Attaches the MTD device as a UBI device for the rest of the session.
 static bool UBIAttach(int MTD, int device) {
-    string 
-    cmd = "ubiattach /dev/ubi_ctrl -m ";
-    cmd += NumberToString(MTD);
-    cmd += " -d ";
-    cmd += NumberToString(device);
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    if (!UBI::Attach(MTD, device)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
+
+    return true;
 }
 
-// Executes "ubimkvol" command.
+// Creates a UBI volume.
 static bool UBIMakeVolume(int device, int volID, const char *volName,
         int sizeInBytes = -1) {
 
-    string 
-    cmd = "ubimkvol ";
-    cmd += DEV_UBI;
-    cmd += NumberToString(device);
-    cmd += " -n ";
-    cmd += NumberToString(volID);
-    cmd += " -N ";
-    cmd += volName;
-
-    if (sizeInBytes == -1) {
-        cmd += " -m";
-    } else {
-        cmd += " -s ";
-        cmd += sizeInBytes;
+    if (!UBI::MakeVolume(device, volID, volName, sizeInBytes)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
     }
 
-    return ExecuteAndNotifyIfFail(cmd.c_str());
-}
-
-// Executes "ubirmvol" command.
-static bool UBIRemoveVolume(int device, int volID) {
-    string
-    cmd = "ubirmvol ";
-    cmd += DEV_UBI;
-    cmd += NumberToString(device);
-    cmd = " -n ";
-    cmd += NumberToString(volID);
-    return ExecuteAndNotifyIfFail(cmd.c_str());
-}
-
-// Executes "ubirmvol" command.
-static bool UBIRemoveVolume(int device, const char *volName) {
-    string
-    cmd = "ubirmvol ";
-    cmd += DEV_UBI;
-    cmd += NumberToString(device);
-    cmd = " -N ";
-    cmd += volName;
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    return true;
 }
 
-// Executes "ubidetach" command.
+// Detaches a UBI device.
 static bool UBIDetach(int device) {
-    string 
-    cmd = "ubidetach /dev/ubi_ctrl -d ";
-    cmd += NumberToString(device);
-    return ExecuteAndNotifyIfFail(cmd.c_str());
+    if (!UBI::Detach(device)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
+
+    return true;
 }
 
@@ -56,21 +56,44 @@ success:
 
 // Returns the free space on the given mountpoint or 0 on error.
 // This will call statvfs() to determine.
-static size_t GetMountpointFreeSpace(const char *path) {
+static unsigned long long GetMountpointFreeSpace(const char *path) {
     struct statvfs buf;
 
     if (statvfs(path, &buf))
         return 0;
 
-    return size_t(buf.f_bsize) * buf.f_bavail;
+    return (unsigned long long)buf.f_bsize * buf.f_bavail;
 }
 
-// First unmounts normally, and then lazy unmounts if there is a problem.
-// There is a "cout" message with lazy-unmount.
-inline bool UnmountA(const char *mountpoint) {
-    if (!Unmount(mountpoint)) {
-        cout << "Unmounting... (lazy-mode)" << endl;
-        return Unmount(mountpoint, true);
+// Returns the space used on the filesystem of the device in "used", or
+// false on error. The device is mounted read-only (or its mount is
+// reused) to call statvfs().
+static bool GetDeviceUsedSpace(const char *dev, const char *mountpoint, const char *fs,
+        unsigned long long &used) {
+
+    struct statvfs buf;
+    bool success;
+
+    if (!gMounts.Acquire(dev, mountpoint, fs, "ro"))
+        return false;
+
+    if ((success = (statvfs(mountpoint, &buf) == 0)))
+        used = (unsigned long long)buf.f_frsize * (buf.f_blocks - buf.f_bfree);
+
+    gMounts.Release(mountpoint);
+    return success;
+}
+
+// Unmounts the device wherever it is mounted (as it is about to be
+// overwritten) and notify user if failed.
+static bool UnmountDevice(const char *dev) {
+    if (!gMounts.IsMounted(dev))
+        return true;
+
+    cout << "Unmounting..." << endl;
+    if (!gMounts.UnmountDevice(dev)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
     }
 
     return true;
@@ -84,6 +107,9 @@ inline bool Format(const char *dev, const char *fs, bool *formatted = NULL) {
     if (formatted)
         *formatted = true;
 
+    if (!UnmountDevice(dev))
+        return false;
+
     if (!strcmp(fs, "vfat"))
         return FormatFat(dev);
     else if (!strcmp(fs, "ext4"))
@@ -99,12 +125,14 @@ inline bool Format(const char *dev, const char *fs, bool *formatted = NULL) {
     return false;
 }
 
-// Mounts a device, archives the contents and then unmounts it.
-// The mount *MUST* be read-only (as specified in "opts").
-// Also, the backup must not reside on the mountpoint.
-static bool BackupMountpoint(const char *tgz, const char *dev, 
+// Mounts a device, archives the contents to the stream (compressed
+// with the codec) and then releases the mount. The mount *MUST* be
+// read-only (as specified in "opts") unless already in use read-write.
+// See TarCreate() for the manifests.
+static bool BackupMountpoint(OutStream &out, const Codec &codec, const char *dev, 
         const char *mountpoint, const char *fs = NULL, 
-        const char *opts = NULL) {
+        const char *opts = NULL, Manifest *manifest = NULL, 
+        const Manifest *parent = NULL) {
 
     bool failed;
 
@@ -113,46 +141,47 @@ static bool BackupMountpoint(const char *tgz, const char *dev,
         return false;
 
     cout << "Compressing..." << endl;
-    if (failed = !Tar(true, tgz, mountpoint)) {
-        cout << "Deleting failed archive..." << endl;
-        Remove(tgz, false, true);
-    }
+    failed = !TarCreate(out, mountpoint, codec, manifest, parent);
 
-    cout << "Unmounting..." << endl;
-    UnmountA(mountpoint);
+    gMounts.Release(mountpoint);
 
     return !failed;
 }
 
-// Backups a UBI device after attaching it and when done
-// detaches it. Calls BackupMountpoint().
-static bool BackupUBI(const char *tgz, int mtd, int ubi,
+// Backups a UBI device after attaching it (it stays attached).
+// Calls BackupMountpoint().
+static bool BackupUBI(OutStream &out, const Codec &codec, int mtd, int ubi,
         const char *dev, const char *mountpoint, 
         const char *opts = NULL) {
 
-    bool failed;
-
     if (opts == NULL)
         opts = "ro";
 
-    cout << "Attaching NAND..." << endl;
+    if (UBI::GetMTD(ubi) != mtd)
+        cout << "Attaching NAND..." << endl;
+
     if (!UBIAttach(mtd, ubi))
         return false;
 
     // Backup mountpoint.
-    failed = !BackupMountpoint(tgz, dev, mountpoint, "ubifs", opts);
-
-    cout << "Detaching NAND..." << endl;
-    UBIDetach(ubi);
-
-    return !failed;
+    return BackupMountpoint(out, codec, dev, mountpoint, "ubifs", opts);
 }
 
 // Formats a UBI device ("ubifs" only) after attaching it
-// and when done leaves it attached.
+// and when done leaves it attached. The device is detached
+// first if attached (its MTD device is erased).
 static bool FormatAndAttachUBI(const MTD &mtd, int ubi) {
+    if (!UnmountDevice(DEV_NAND))
+        goto fail_erase;
+
+    if (UBI::GetMTD(ubi) >= 0) {
+        cout << "Detaching NAND..." << endl;
+        if (!UBIDetach(ubi))
+            goto fail_erase;
+    }
+
     cout << "Erasing NAND..." << endl;
-    if (!FlashEraseAll(mtd.device))
+    if (!mtd.Erase())
         goto fail_erase;
 
     cout << "Attaching NAND..." << endl;
@@ -174,15 +203,44 @@ fail_erase:
     return false;
 }
 
-// Mounts a device, extracts the archive and then unmounts it.
-// NOTE the backup must not reside on the mountpoint.
-// If "needFormat" = true, then Format() is called.
-static bool RestoreMountpoint(const char *tgz, const char *dev, 
+// Removes the files (relative to the mountpoint) deleted since the
+// previous backup. Children are removed before their parents.
+static bool RemoveDeletedFiles(const char *mountpoint, const vector<string> &deleted) {
+    bool failed = false;
+
+    for (size_t i = deleted.size(); i-- > 0; ) {
+        string path = deleted[i], full;
+        struct stat st;
+
+        if (!ArchiveCleanPath(path) || path.length() == 0) {
+            log << WARN << "Ignoring invalid deleted path: " << deleted[i] << endl;
+            continue;
+        }
+
+        JoinPath(full, mountpoint, path.c_str());
+
+        if (lstat(full.c_str(), &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode) ? rmdir(full.c_str()) : unlink(full.c_str())) {
+            log << ERRR << "Unable to remove '" << full << "': " << strerror(errno) << endl;
+            failed = true;
+        }
+    }
+
+    log << INFO << "Removed " << deleted.size() << " deleted files." << endl;
+    return !failed;
+}
+
+// Mounts a device, extracts the archive from the stream and then 
+// releases the mount. If "needFormat" = true, then Format() is called. The
+// "deleted" files (if any) are removed before extracting.
+static bool RestoreMountpoint(InStream &in, const char *dev, 
         const char *mountpoint, const char *fs, 
-        const char *opts = NULL, bool needFormat = true) {
+        const char *opts = NULL, bool needFormat = true,
+        const vector<string> *deleted = NULL) {
 
-    bool failed;
-    string temp;
+    bool failed = false;
 
     if (needFormat) {
         cout << "Formatting..." << endl;
@@ -194,84 +252,249 @@ static bool RestoreMountpoint(const char *tgz, const char *dev,
     if (!Mount(dev, mountpoint, fs, opts))
         return false;
 
+    if (deleted && deleted->size()) {
+        cout << "Removing deleted files..." << endl;
+        failed = !RemoveDeletedFiles(mountpoint, *deleted);
+    }
+
     cout << "Extracting..." << endl;
-    failed = !Tar(false, tgz, mountpoint);
+    failed = !TarExtract(in, mountpoint) || failed;
 
-    cout << "Unmounting..." << endl;
-    UnmountA(mountpoint);
+    gMounts.Release(mountpoint);
 
     return !failed;
 }
 
-// Restores a UBI device after attaching it and when done
-// detaches it. Calls RestoreMountpoint().
-static bool RestoreUBI(const char *tgz, const MTD &mtd, int ubi,
+// Unmounts the "ext4" device if needed and writes an image of its 
+// used blocks to the stream (compressed with the codec).
+static bool BackupImage(OutStream &out, const Codec &codec, const char *dev) {
+
+    if (!UnmountDevice(dev))
+        return false;
+
+    cout << "Reading used blocks..." << endl;
+    return ImageCreate(out, dev, codec);
+}
+
+// Unmounts the device if needed and writes the image from the stream
+// to it. No formatting is needed.
+static bool RestoreImage(InStream &in, const char *dev) {
+    if (!UnmountDevice(dev))
+        return false;
+
+    cout << "Writing blocks..." << endl;
+    return ImageExtract(in, dev);
+}
+
+// Restores a UBI device after formatting and attaching it (it
+// stays attached). Calls RestoreMountpoint().
+static bool RestoreUBI(InStream &in, const MTD &mtd, int ubi,
         const char *dev, const char *mountpoint, 
         const char *opts = NULL) {
 
-    bool failed;
-
     if (opts == NULL)
         opts = "rw";
 
     if (!FormatAndAttachUBI(mtd, ubi))
         return false;
 
-    failed = !RestoreMountpoint(tgz, dev, mountpoint, "ubifs", opts, false);
+    return RestoreMountpoint(in, dev, mountpoint, "ubifs", opts, false);
+}
 
-    cout << "Detaching NAND..." << endl;
-    UBIDetach(ubi);
+// Backups an image of the "ubifs" volume of a UBI device after attaching
+// it (it stays attached) and unmounting it if needed.
+static bool BackupUBIImage(OutStream &out, const Codec &codec, int mtd, int ubi,
+        int volume, const char *dev) {
 
-    return !failed;
+    if (UBI::GetMTD(ubi) != mtd)
+        cout << "Attaching NAND..." << endl;
+
+    if (!UBIAttach(mtd, ubi))
+        return false;
+
+    if (!UnmountDevice(dev))
+        return false;
+
+    cout << "Reading used blocks..." << endl;
+    return UBIImageCreate(out, ubi, volume, codec);
 }
 
-// Erase and flash the specified MTD device. The blocksize and count
-// is only used while writing, the entire device is erased. Uses
-// "flash_eraseall" and "dd".
-inline bool FlashMTD(const char *dev, const char *file) {
-    cout << "Erasing..." << endl;
-    if (!FlashEraseAll(dev))
+// Restores an image of the "ubifs" volume of a UBI device after
+// formatting and attaching it (it stays attached).
+static bool RestoreUBIImage(InStream &in, const MTD &mtd, int ubi, int volume) {
+    if (!FormatAndAttachUBI(mtd, ubi))
         return false;
 
+    cout << "Writing blocks..." << endl;
+    return UBIImageExtract(in, ubi, volume);
+}
+
+// Flashes the MTD partition from the stream, erasing only the blocks
+// written and skipping the blocks that already hold the data. Uses
+// the native MTD engine (see MTD::Flash()).
+inline bool FlashMTD(const MTD &mtd, InStream &in) {
+    MTDFlashStats stats;
+
     cout << "Flashing..." << endl;
-    return NandWrite(dev, file, true);
+
+    if (!mtd.Flash(in, true, &stats)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
+
+    if (stats.unchanged > 0)
+        cout << stats.unchanged << " of " << stats.written + stats.unchanged 
+            << " blocks were unchanged and skipped." << endl;
+
+    return true;
 }
 
-// Backups an MTD partition. If it is not present, backups the corresponding
-// internal SD card area (after accounting for MBR).
-inline bool BackupMTDPartition(const MTD &mtd, const char *file) {
+// Finds the payload of an MTD partition (or of the internal SD card area)
+// from its header. Unknown contents span the whole partition.
+inline MTDPayload GetMTDPartitionPayload(const MTD &mtd) {
+    unsigned char head[MTD_PAYLOAD_HEAD_SIZE];
+    BufferOutStream out(head, sizeof(head));
+    DiskDumper dumper;
     bool success;
 
     if (access(mtd.sysfs, F_OK) == 0)
-        // For NAND devices, read directly.
-        success = NandDump(mtd.device, file);
+        success = mtd.Dump(out, sizeof(head));
     else
+        success = dumper.Read(DEV_INTSD, mtd.GetDiskOffset(), sizeof(head), out);
+
+    return mtd.GetPayload(head, success ? out.GetLength() : 0);
+}
+
+// Backups the first "length" bytes (or all) of an MTD partition to the 
+// stream. If it is not present, backups the corresponding internal SD 
+// card area.
+inline bool BackupMTDPartition(const MTD &mtd, OutStream &out, off_t length = -1) {
+    if (access(mtd.sysfs, F_OK) == 0) {
+        // For NAND devices, read directly.
+        if (!mtd.Dump(out, length)) {
+            cout << "An error occured while trying to perform the requested operation" << endl;
+            return false;
+        }
+
+        return true;
+    } else {
         // For no-NAND devices, read SD card.
-        success = DiskDump(DEV_INTSD, file, 
-            512,                    // size of 1 sector
-            mtd.size / 512,         // number of sectors
-            1 + mtd.start / 512,    // offset in device
-            0);                     // offset in file
+        return DiskDump(DEV_INTSD, mtd.GetDiskOffset(), length < 0 ? mtd.size : length, out);
+    }
+}
+
+// Backups the payload of an MTD partition (see GetMTDPartitionPayload()) to
+// the stream as a sparse image: the erased (0xFF) and zero padding is stored
+// as fill records.
+inline bool BackupMTDPartitionImage(const MTD &mtd, OutStream &out, const MTDPayload &payload) {
+    SparseOutStream image;
+
+    if (!image.Init(out, mtd.size) || !BackupMTDPartition(mtd, image, payload.length) || 
+            !image.Finish())
+        return false;
+
+    log << INFO << "Imaged " << mtd.name << ": " << image.GetDataBytes() << " of " 
+        << image.GetByteCount() << " bytes stored as data." << endl;
+    return true;
+}
+
+// Backups an MTD partition. If it is not present, backups the corresponding
+// internal SD card area. Only the payload of the kernel and logo partitions
+// is backed up (if their content is known), and it is then described in a
+// "<file>.payload" file as "payload <name> <type> <length>", which is
+// checked when the file is flashed; other partitions are dumped in full.
+inline bool BackupMTDPartition(const MTD &mtd, const char *file) {
+    MTDPayload payload = { MTD_CONTENT_UNKNOWN, mtd.size };
+    const string descriptor = string(file) + ".payload";
+    FileOutStream out;
+
+    if (&mtd == &gMTDs[MTD_KERNEL] || &mtd == &gMTDs[MTD_LOGO])
+        payload = GetMTDPartitionPayload(mtd);
+
+    if (payload.type != MTD_CONTENT_UNKNOWN)
+        cout << "Found " << GetMTDContentName(payload.type) << " content of " 
+            << payload.length / 1024 << " KB." << endl;
+
+    bool success = out.Open(file) && BackupMTDPartition(mtd, out, payload.length);
 
-    if (!success)
-        Remove(file, false, true);
+    success &= out.Close();
+
+    // A descriptor of an earlier backup would no longer be true.
+    unlink(descriptor.c_str());
+
+    if (success && payload.type != MTD_CONTENT_UNKNOWN) {
+        ostringstream line;
+
+        line << "payload " << mtd.filename << " " << GetMTDContentName(payload.type)
+            << " " << (long long)payload.length << "\n";
+
+        success = out.Open(descriptor.c_str()) && out.Write(line.str().data(), line.str().length());
+        success &= out.Close();
+    }
+
+    if (!success) {
+        unlink(file);
+        unlink(descriptor.c_str());
+    }
 
     return success;
 }
 
-// Restores an MTD partition. If it is not present, restores the corresponding
-// internal SD card area (after accounting for MBR).
-inline bool RestoreMTDPartition(const MTD &mtd, const char *file) {
+// Writes a raw or sparse image of an MTD partition from the stream. Fill
+// records are expanded; on NAND, erased pages are then not written.
+inline bool WriteMTDPartition(const MTD &mtd, InStream &in) {
+    SparseInStream image;
+
+    if (!image.Init(in)) {
+        cout << "An error occured while trying to perform the requested operation" << endl;
+        return false;
+    }
+
     if (access(mtd.sysfs, F_OK) == 0)
         // For NAND devices, write directly.
-        return FlashMTD(mtd.device, file);
+        return FlashMTD(mtd, image);
     else
         // For no-NAND devices, write to SD card.
-        return DiskDump(file, DEV_INTSD, 
-            512,                    // size of 1 sector
-            mtd.size / 512,         // number of sectors
-            0,                      // offset in file
-            1 + mtd.start / 512);   // offset in device
+        return DiskDump(image, DEV_INTSD, mtd.GetDiskOffset(), mtd.size);
+}
+
+// Restores an MTD partition from the stream ("size" bytes). If it is not
+// present, restores the corresponding internal SD card area.
+inline bool RestoreMTDPartition(const MTD &mtd, InStream &in, off_t size) {
+    if (size > mtd.size) {
+        cout << "The image is larger than '" << mtd.name << "' partition." << endl;
+        return false;
+    }
+
+    return WriteMTDPartition(mtd, in);
+}
+
+// Restores an MTD partition. If it is not present, restores the corresponding
+// internal SD card area. A payload file (see BackupMTDPartition()) must be
+// of the partition and have the length in its descriptor.
+inline bool RestoreMTDPartition(const MTD &mtd, const char *file) {
+    const string descriptor = string(file) + ".payload";
+    ifstream payload(descriptor.c_str());
+    string tag, name, type;
+    long long length;
+    FileInStream in;
+
+    if (!in.Open(file)) {
+        cout << "Unable to open '" << file << "'." << endl;
+        return false;
+    }
+
+    if (payload.is_open()) {
+        if (!(payload >> tag >> name >> type >> length) || tag != "payload" ||
+                name != mtd.filename || (long long)GetFileSize(file) != length) {
+            cout << "The file does not match its payload descriptor." << endl;
+            return false;
+        }
+
+        cout << "Flashing " << type << " content of " << length / 1024 << " KB." << endl;
+    }
+
+    return WriteMTDPartition(mtd, in);
 }
 
 // Mounts '/' and '/system' as needed on "/mnt/root".
@@ -284,13 +507,15 @@ inline bool MountRootfs() {
     if (haveNAND) {
         const MTD &mtd = gMTDs[MTD_ROOTFS];
 
-        cout << "Attaching NAND..." << endl;
+        if (UBI::GetMTD(UBID_NUMBER) != mtd.number)
+            cout << "Attaching NAND..." << endl;
+
         if (!UBIAttach(mtd.number, UBID_NUMBER))
             goto fail_attach_nand;
 
         cout << "Mounting NAND..." << endl;
         if (!Mount(DEV_NAND, root, "ubifs", "rw"))
-            goto fail_mount_nand;
+            goto fail_attach_nand;
 
         cout << "Ensuring '/system' directory exists..." << endl;
         if (!MakeDirectory(MOUNT_ROOT_SYSTEM, true))
@@ -305,43 +530,81 @@ inline bool MountRootfs() {
         return true;
 
 fail_mkdir_nand:
-    if (haveNAND) {
-        cout << "Unmounting NAND..." << endl;
-        UnmountA(root);
-    }
-
-fail_mount_nand:
-    if (haveNAND) {
-        cout << "Detaching NAND..." << endl;
-        UBIDetach(UBID_NUMBER);
-    }
+    if (haveNAND)
+        gMounts.Release(root);
 
 fail_attach_nand:
     return false;
 }
 
-// Unounts '/' and '/system' as needed on "/mnt/root".
-inline bool UnmountRootfs() {
-    bool failed = false;
-    const char *root = MOUNT_ROOT;      // initial mount for rootfs
-    const char *system = MOUNT_ROOT;    // initial mount for system
+// Releases the mounts of '/' and '/system' made by MountRootfs(). They
+// stay mounted for the following operations of the session.
+inline void ReleaseRootfs() {
     const bool haveNAND = (access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0);
 
-    // Change system mountpoint to subdirectory if needed.
     if (haveNAND)
-        system = MOUNT_ROOT_SYSTEM;
+        gMounts.Release(MOUNT_ROOT_SYSTEM);
 
-    cout << "Unmounting 'system' partition..." << endl;
-    failed |= !UnmountA(system);
+    gMounts.Release(MOUNT_ROOT);
+}
 
-    if (haveNAND) {
-        cout << "Unmounting NAND..." << endl;
-        failed |= !UnmountA(root);
+// Fills the permission table of the ROM mounted by MountRootfs(): the
+// default rules and those of the ROM (if any).
+static bool LoadPermissions(PermissionTable &table) {
+    table.AddDefaults();
 
-        cout << "Detaching NAND..." << endl;
-        failed |= !UBIDetach(UBID_NUMBER);
+    if (access(PERMS_ROM_TABLE, F_OK) != 0)
+        return true;
+
+    cout << "Using the permission table of the ROM." << endl;
+    return table.Load(PERMS_ROM_TABLE);
+}
+
+// Sets the permissions of the ROM mounted by MountRootfs() and notify
+// user if failed.
+static bool FixPermissions() {
+    PermissionTable table;
+
+    if (LoadPermissions(table)) {
+        log << CMMD << "fixperms: " << MOUNT_ROOT << " (" << table.GetCount() << " rules)" << endl;
+
+        if (table.Apply(MOUNT_ROOT))
+            return true;
     }
 
-    return !failed;
+    cout << "An error occured while trying to perform the requested operation" << endl;
+    return false;
+}
+
+// Extracts a ROM (or patch) ".zip" to the ROM mounted by MountRootfs(),
+// setting the permissions of the files as they are created, and notify
+// user if failed. The permission table of the ROM is extracted first,
+// so that it applies to the ROM itself. If "update" is set, the ROM
+// is updated in place; deltas are applied with the patcher (if any,
+// see Unzip()).
+static bool UnzipROM(const char *file, bool update = false, DeltaPatcher *patcher = NULL) {
+    const char *tableEntry = PERMS_ROM_TABLE + strlen(MOUNT_ROOT) + 1;
+    PermissionTable table;
+    ZipReader zip;
+    ZipExtractor extractor;
+    const ZipEntry *entry;
+
+    if (zip.Open(file) && (entry = zip.Find(tableEntry)) != NULL) {
+        extractor.Init(MOUNT_ROOT);
+
+        if (!extractor.Extract(zip, *entry))
+            goto fail;
+    }
+
+    zip.Close();
+
+    if (!LoadPermissions(table))
+        goto fail;
+
+    return Unzip(file, MOUNT_ROOT, &table, update, patcher);
+
+fail:
+    cout << "An error occured while trying to perform the requested operation" << endl;
+    return false;
 }
 
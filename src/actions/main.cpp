@@ -4,6 +4,24 @@
  *      - Implementation of menu-to-menu navigation.
  */
 
+// Asks how to install the ROM. Returns 0 to format the partitions and
+// extract everything, 1 to update the installed files in place (only
+// the files that differ are written) or -1 to cancel.
+static int SelectInstallMethod() {
+    vector<WindowOption> opts;
+    Window win;
+
+    opts.push_back(WindowOption("Clean install (format)", NULL));
+    opts.push_back(WindowOption("Update in place (changed files only)", NULL));
+    opts.push_back(WindowOption("(Back)", NULL));
+
+    win.SetTitle("Installation method");
+    win.SetOptions(opts);
+
+    int ret = win.Show();
+    return (ret == 0 || ret == 1) ? ret : -1;
+}
+
 bool FlashROM() {
     const char *rootfsNames[] = {
         "utv210_root.tgz", "utv210_root.tar", 
@@ -14,6 +32,7 @@ bool FlashROM() {
 
     string kernel, rootfs;
     bool isZip = false, warning = false, success = true;
+    int method;
 
     gTerminal.clear();
     cout << "Press the HOME key to select a folder where the " << endl
@@ -28,6 +47,12 @@ bool FlashROM() {
     fw.SetDirectoryMode(true);
     fw.Show();
 
+    if ((method = SelectInstallMethod()) < 0)
+        return false;
+
+    gTerminal.clear();
+    log << INFO << "Install method: " << (method ? "update" : "clean") << endl;
+
     // Locate kernel if applicable.
     if (gMTDs[MTD_KERNEL].name) {
         JoinPath(kernel, fw.GetSelectedPath(), gMTDs[MTD_KERNEL].filename);
@@ -76,36 +101,33 @@ bool FlashROM() {
             goto fail;
     }
 
-    // Initialize NAND if applicable and present.
-    if (gMTDs[MTD_ROOTFS].name && access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0) {
-        cout << "* Preparing NAND..." << endl;
-        if (!FormatAndAttachUBI(gMTDs[MTD_ROOTFS], UBID_NUMBER))
-            goto fail;
+    // Initialize NAND if applicable and present. An update in place
+    // keeps the installed files (NAND is attached by MountRootfs()).
+    if (method == 0) {
+        if (gMTDs[MTD_ROOTFS].name && access(gMTDs[MTD_ROOTFS].sysfs, F_OK) == 0) {
+            cout << "* Preparing NAND..." << endl;
+            if (!FormatAndAttachUBI(gMTDs[MTD_ROOTFS], UBID_NUMBER))
+                goto fail;
+        }
 
-        cout << "Detaching NAND..." << endl;
-        UBIDetach(UBID_NUMBER);
+        cout << "* Formatting 'system' partition..." << endl;
+        if (!Format(DEV_SYSTEM, FS_SYSTEM))
+            goto fail;
     }
 
-    cout << "* Formatting 'system' partition..." << endl;
-    if (!Format(DEV_SYSTEM, FS_SYSTEM))
-        goto fail;
-
     cout << "* Mounting partition(s)..." << endl;
     if (!MountRootfs())
         goto fail;
 
-    cout << "* Installing system..." << endl;
+    cout << (method ? "* Updating system..." : "* Installing system...") << endl;
     if (isZip) {
-        success = Unzip(rootfs.c_str(), MOUNT_ROOT);
-
-        cout << "Fixing permissions..." << endl;
-        success &= ExecuteShellScript("/scripts/fixperms.sh");        
+        success = UnzipROM(rootfs.c_str(), method == 1);
     } else {
-        success = Tar(false, rootfs.c_str(), MOUNT_ROOT);
+        success = TarExtract(rootfs.c_str(), MOUNT_ROOT, method == 1);
     }
 
     cout << "* Unmounting partition(s)..." << endl;
-    UnmountRootfs();
+    ReleaseRootfs();
 
     if (success)
         cout << "Success!" << endl;
@@ -117,6 +139,8 @@ fail:
 
 bool ApplyPatch() {
     vector<string> filters;
+    DeltaPatcher patcher;
+    string patch;
     bool isZip = false, warning = false, success = true;
 
     gTerminal.clear();
@@ -136,25 +160,31 @@ bool ApplyPatch() {
     fw.SetFilters(filters);
     fw.Show();
 
+    patch = fw.GetSelectedPath();
+    isZip = (patch.length() > 3 && patch.compare(patch.length() - 4, 4, ".zip") == 0);
+
     cout << "* Mounting partition(s)..." << endl;
     if (!MountRootfs())
         goto fail;
 
+    // Deltas (see DeltaPatcher) are applied to the installed files as
+    // they are read from the patch.
     cout << "* Extracting patch..." << endl;
     if (isZip) {
-        success = Unzip(fw.GetSelectedPath(), MOUNT_ROOT);
-
-        cout << "Fixing permissions..." << endl;
-        success &= ExecuteShellScript("/scripts/fixperms.sh");
+        success = UnzipROM(patch.c_str(), false, &patcher);
     } else {
-        success = Tar(false, fw.GetSelectedPath(), MOUNT_ROOT);
+        success = TarExtract(patch.c_str(), MOUNT_ROOT, false, &patcher);
     }
 
+    if (patcher.GetAppliedCount() || patcher.GetSkippedCount())
+        cout << patcher.GetAppliedCount() << " file(s) patched, " << patcher.GetSkippedCount()
+            << " already up to date." << endl;
+
     cout << "* Applying patch..." << endl;
     success &= ExecuteShellScript("/scripts/applypatch.sh", 1, MOUNT_ROOT);    
 
     cout << "* Unmounting partition(s)..." << endl;
-    UnmountRootfs();
+    ReleaseRootfs();
 
     if (success)
         cout << "Success!" << endl;
@@ -215,6 +245,8 @@ bool DisplayAdvancedWindow() {
 }
 
 bool Shutdown() {
+    gMounts.UnmountAll();
+    sync();
     SysCall("reboot -f");
     return true;
 }
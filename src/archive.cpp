@@ -0,0 +1,1589 @@
+/*
+ *  archive.cpp:
+ *      - Implementation of in-process "tar" and "gzip" engine.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include "include/log.h"
+#include "include/archive.h"
+#include "include/manifest.h"
+#include "include/delta.h"
+
+using namespace std;
+
+// Alignment of the data buffers (suits O_DIRECT and page cache).
+static const size_t BUFFER_ALIGNMENT = 4096;
+
+// Files smaller than this are always compressed (the compressor
+// would have to end a block for them).
+static const off_t STORE_MIN_SIZE = 64 * 1024;
+
+// Amount of data sampled to estimate the entropy, and the entropy
+// (in bits per byte) above which data is considered random.
+static const size_t ENTROPY_SAMPLE_SIZE = 4096;
+static const double ENTROPY_RANDOM = 7.5;
+
+// Maximum sizes of the GNU long names\links and of the POSIX extended
+// headers that are accepted.
+static const off_t TAR_LONG_NAME_MAX = 8 * 1024;
+static const off_t TAR_PAX_MAX = 1024 * 1024;
+
+// Extensions of already compressed formats.
+static const char *COMPRESSED_EXTENSIONS[] = {
+    "apk", "jar", "zip", "gz", "tgz", "bz2", "xz", "lzo", "lzma", "7z", "rar",
+    "jpg", "jpeg", "png", "gif", "webp", "mp3", "ogg", "oga", "m4a", "aac",
+    "flac", "wma", "mp4", "m4v", "3gp", "mkv", "webm", "avi", "wmv", "flv",
+    NULL
+};
+
+// Utility function(s).
+static char *AllocateBuffer();
+static void WriteOctal(char *field, size_t len, unsigned long long value);
+static unsigned long long ReadNumber(const char *field, size_t len);
+static bool SplitName(const string &name, string &prefix, string &base);
+static bool MakeParents(const string &root, const string &path);
+static bool RemoveExisting(const string &path);
+static bool RemoveTree(const string &path, dev_t dev, long long &count);
+static bool WriteAt(int fd, const char *buf, size_t len, off_t offset);
+static double Log2(double x);
+
+// ============================================================================
+// Structure constructor.
+ArchiveEntry::ArchiveEntry() {
+    type = TAR_FILE;
+    mode = 0644;
+    uid = gid = 0;
+    size = 0;
+    mtime = 0;
+    devMajor = devMinor = 0;
+}
+
+// ============================================================================
+// Fills a "ustar" header for the entry. Long names are truncated
+// and false is returned.
+bool TarMakeHeader(char *block, const ArchiveEntry &entry) {
+    string name, prefix, base;
+    unsigned int checksum = 0;
+    bool fits = true;
+
+    // Directories have a trailing slash and the root is "./".
+    if (entry.path.length() == 0)
+        name = "./";
+    else if (entry.type == TAR_DIRECTORY)
+        name = entry.path + "/";
+    else
+        name = entry.path;
+
+    if (!SplitName(name, prefix, base)) {
+        prefix.resize(0);
+        base = name.substr(0, 100);
+        fits = false;
+    }
+
+    if (entry.link.length() > 100)
+        fits = false;
+
+    memset(block, 0, TAR_BLOCK);
+    memcpy(block, base.data(), base.length());
+    WriteOctal(block + 100, 8, entry.mode & 07777);
+    WriteOctal(block + 108, 8, entry.uid);
+    WriteOctal(block + 116, 8, entry.gid);
+    WriteOctal(block + 124, 12, entry.size);
+    WriteOctal(block + 136, 12, entry.mtime);
+    block[156] = entry.type;
+    memcpy(block + 157, entry.link.data(), min(entry.link.length(), size_t(100)));
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    WriteOctal(block + 329, 8, entry.devMajor);
+    WriteOctal(block + 337, 8, entry.devMinor);
+    memcpy(block + 345, prefix.data(), prefix.length());
+
+    // The checksum is computed with the checksum field as spaces.
+    memset(block + 148, ' ', 8);
+
+    for (size_t i = 0; i < TAR_BLOCK; i++)
+        checksum += (unsigned char)block[i];
+
+    sprintf(block + 148, "%06o", checksum);
+    block[155] = ' ';
+
+    return fits;
+}
+
+// Parses a "ustar" header, verifying the checksum. The path is
+// returned as stored (see ArchiveCleanPath()).
+bool TarParseHeader(const char *block, ArchiveEntry &entry) {
+    unsigned int checksum = 0;
+    int signedChecksum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        bool field = (i >= 148 && i < 156);
+        checksum += field ? ' ' : (unsigned char)block[i];
+        signedChecksum += field ? ' ' : (signed char)block[i];
+    }
+
+    unsigned long long stored = ReadNumber(block + 148, 8);
+
+    if (stored != checksum && stored != (unsigned int)signedChecksum)
+        return false;
+
+    entry.path.assign(block, strnlen(block, 100));
+
+    if (!memcmp(block + 257, "ustar", 5) && block[345] != '\0') {
+        string prefix(block + 345, strnlen(block + 345, 155));
+        entry.path = prefix + "/" + entry.path;
+    }
+
+    entry.link.assign(block + 157, strnlen(block + 157, 100));
+    entry.mode = ReadNumber(block + 100, 8) & 07777;
+    entry.uid = ReadNumber(block + 108, 8);
+    entry.gid = ReadNumber(block + 116, 8);
+    entry.size = ReadNumber(block + 124, 12);
+    entry.mtime = ReadNumber(block + 136, 12);
+    entry.devMajor = ReadNumber(block + 329, 8);
+    entry.devMinor = ReadNumber(block + 337, 8);
+    entry.type = block[156];
+
+    // Old style regular files.
+    if (entry.type == '\0' || entry.type == '7')
+        entry.type = TAR_FILE;
+
+    // Old style directories.
+    if (entry.type == TAR_FILE && entry.path.length() != 0 &&
+            entry.path[entry.path.length() - 1] == '/')
+        entry.type = TAR_DIRECTORY;
+
+    return entry.size >= 0;
+}
+
+// Checks the extension and the entropy of the first block.
+bool ArchiveIsCompressible(const string &path, const void *head, size_t len) {
+    const unsigned char *data = (const unsigned char *)head;
+    size_t dot = path.rfind('.'), slash = path.rfind('/');
+    size_t counts[256];
+    double entropy = 0;
+
+    if (dot != string::npos && (slash == string::npos || dot > slash)) {
+        const char *ext = path.c_str() + dot + 1;
+
+        for (int i = 0; COMPRESSED_EXTENSIONS[i]; i++)
+            if (!strcasecmp(ext, COMPRESSED_EXTENSIONS[i]))
+                return false;
+    }
+
+    if (len > ENTROPY_SAMPLE_SIZE)
+        len = ENTROPY_SAMPLE_SIZE;
+
+    if (len < ENTROPY_SAMPLE_SIZE)
+        return true;
+
+    memset(counts, 0, sizeof(counts));
+
+    for (size_t i = 0; i < len; i++)
+        counts[data[i]]++;
+
+    for (int i = 0; i < 256; i++)
+        if (counts[i]) {
+            double p = (double)counts[i] / len;
+            entropy -= p * Log2(p);
+        }
+
+    return entropy < ENTROPY_RANDOM;
+}
+
+// Returns the clean relative form of an archive path.
+bool ArchiveCleanPath(string &path) {
+    string out;
+    size_t start = 0;
+
+    while (start <= path.length()) {
+        size_t end = path.find('/', start);
+
+        if (end == string::npos)
+            end = path.length();
+
+        string part = path.substr(start, end - start);
+        start = end + 1;
+
+        if (part.length() == 0 || part == ".")
+            continue;
+
+        if (part == "..")
+            return false;
+
+        if (out.length() != 0)
+            out += '/';
+
+        out += part;
+    }
+
+    path = out;
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+GzipOutStream::GzipOutStream() {
+    out = NULL;
+    buffer = NULL;
+    bytesIn = 0;
+    init = false;
+}
+
+// Class destructor.
+GzipOutStream::~GzipOutStream() {
+    if (init)
+        deflateEnd(&strm);
+
+    free(buffer);
+}
+
+// Starts compressing to the given stream.
+bool GzipOutStream::Init(OutStream &out, int level) {
+    if (init)
+        deflateEnd(&strm);
+
+    init = false;
+    memset(&strm, 0, sizeof(strm));
+
+    if (!buffer && !(buffer = AllocateBuffer()))
+        return false;
+
+    // A window of 15 bits + 16 produces the "gzip" wrapper.
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        log << ERRR << "Unable to initialize compressor." << endl;
+        return false;
+    }
+
+    this->out = &out;
+    bytesIn = 0;
+    init = true;
+    return true;
+}
+
+// Writes the remaining compressed data and the "gzip" trailer.
+bool GzipOutStream::Finish() {
+    if (!init)
+        return false;
+
+    bool success = Deflate(Z_FINISH);
+
+    deflateEnd(&strm);
+    init = false;
+    return success;
+}
+
+// Returns the number of uncompressed bytes written.
+long long GzipOutStream::GetBytesIn() const {
+    return bytesIn;
+}
+
+// Compresses the data.
+bool GzipOutStream::Write(const void *buf, size_t len) {
+    if (!init)
+        return false;
+
+    strm.next_in = (Bytef *)buf;
+    strm.avail_in = len;
+    bytesIn += len;
+    return Deflate(Z_NO_FLUSH);
+}
+
+// Runs the compressor over the pending input.
+bool GzipOutStream::Deflate(int flush) {
+    do {
+        strm.next_out = (Bytef *)buffer;
+        strm.avail_out = STREAM_BUFFER_SIZE;
+
+        if (deflate(&strm, flush) == Z_STREAM_ERROR) {
+            log << ERRR << "Compression error." << endl;
+            return false;
+        }
+
+        size_t have = STREAM_BUFFER_SIZE - strm.avail_out;
+
+        if (have && !out->Write(buffer, have))
+            return false;
+    } while (strm.avail_out == 0);
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+GzipInStream::GzipInStream() {
+    in = NULL;
+    buffer = NULL;
+    init = eof = detected = passthrough = memberEnd = false;
+    autodetect = true;
+}
+
+// Class destructor.
+GzipInStream::~GzipInStream() {
+    if (init)
+        inflateEnd(&strm);
+
+    free(buffer);
+}
+
+// Starts decompressing from the given stream.
+bool GzipInStream::Init(InStream &in, bool autodetect) {
+    if (init)
+        inflateEnd(&strm);
+
+    init = false;
+    memset(&strm, 0, sizeof(strm));
+
+    if (!buffer && !(buffer = AllocateBuffer()))
+        return false;
+
+    // A window of 15 bits + 16 accepts only the "gzip" wrapper.
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+        log << ERRR << "Unable to initialize decompressor." << endl;
+        return false;
+    }
+
+    this->in = &in;
+    this->autodetect = autodetect;
+    eof = detected = passthrough = memberEnd = false;
+    init = true;
+    return true;
+}
+
+// Reads more input. Returns false on a read error.
+bool GzipInStream::Fill() {
+    ssize_t ret = in->Read(buffer, STREAM_BUFFER_SIZE);
+
+    if (ret < 0)
+        return false;
+
+    if (ret == 0)
+        eof = true;
+
+    strm.next_in = (Bytef *)buffer;
+    strm.avail_in = ret;
+    return true;
+}
+
+// Reads decompressed data.
+ssize_t GzipInStream::Read(void *buf, size_t len) {
+    if (!init)
+        return -1;
+
+    // Check the magic using the first input.
+    if (!detected) {
+        size_t have = 0;
+
+        while (have < 2) {
+            ssize_t ret = in->Read(buffer + have, STREAM_BUFFER_SIZE - have);
+
+            if (ret < 0)
+                return -1;
+
+            if (ret == 0) {
+                eof = true;
+                break;
+            }
+
+            have += ret;
+        }
+
+        strm.next_in = (Bytef *)buffer;
+        strm.avail_in = have;
+        detected = true;
+        passthrough = !(strm.avail_in >= 2 &&
+            (unsigned char)strm.next_in[0] == 0x1f &&
+            (unsigned char)strm.next_in[1] == 0x8b);
+
+        if (passthrough && !autodetect) {
+            log << ERRR << "Data is not in 'gzip' format." << endl;
+            return -1;
+        }
+    }
+
+    // Data that is not compressed is simply copied.
+    if (passthrough) {
+        if (strm.avail_in == 0)
+            return eof ? 0 : in->Read(buf, len);
+
+        size_t count = min(len, size_t(strm.avail_in));
+        memcpy(buf, strm.next_in, count);
+        strm.next_in += count;
+        strm.avail_in -= count;
+        return count;
+    }
+
+    strm.next_out = (Bytef *)buf;
+    strm.avail_out = len;
+
+    while (strm.avail_out == len) {
+        if (strm.avail_in == 0 && !eof && !Fill())
+            return -1;
+
+        if (memberEnd) {
+            // Another "gzip" member may follow, anything else
+            // (e.g. zero padding) is ignored.
+            if (strm.avail_in == 0 || (unsigned char)strm.next_in[0] != 0x1f)
+                break;
+
+            inflateReset(&strm);
+            memberEnd = false;
+        }
+
+        if (strm.avail_in == 0 && eof) {
+            log << ERRR << "Compressed data is truncated." << endl;
+            return -1;
+        }
+
+        int ret = inflate(&strm, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            memberEnd = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            log << ERRR << "Compressed data is corrupt." << endl;
+            return -1;
+        }
+    }
+
+    return len - strm.avail_out;
+}
+
+// ============================================================================
+// Class constructor.
+TarWriter::TarWriter() {
+    out = NULL;
+    progress = NULL;
+    manifest = NULL;
+    parent = NULL;
+    buffer = NULL;
+    remaining = padding = 0;
+    bytes = entries = storedBytes = unchanged = 0;
+}
+
+// Class destructor.
+TarWriter::~TarWriter() {
+    free(buffer);
+}
+
+// Starts writing an archive to the given stream.
+void TarWriter::Init(OutStream &out, ArchiveProgress *progress) {
+    this->out = &out;
+    this->progress = progress;
+    links.clear();
+    remaining = padding = 0;
+    bytes = entries = storedBytes = unchanged = 0;
+}
+
+// Sets the manifest to fill (and the one to compare with).
+void TarWriter::SetManifest(Manifest *manifest, const Manifest *parent) {
+    this->manifest = manifest;
+    this->parent = manifest ? parent : NULL;
+}
+
+// Writes an entry header.
+bool TarWriter::AddEntry(const ArchiveEntry &entry) {
+    char block[TAR_BLOCK];
+
+    if (!out || remaining != 0)
+        return false;
+
+    if (!TarMakeHeader(block, entry)) {
+        // Long names are stored as GNU extension entries.
+        string prefix, base;
+        string name = entry.path + (entry.type == TAR_DIRECTORY ? "/" : "");
+
+        if (!SplitName(name, prefix, base) && !WriteLongName('L', name))
+            return false;
+
+        if (entry.link.length() > 100 && !WriteLongName('K', entry.link))
+            return false;
+    }
+
+    if (!out->Write(block, TAR_BLOCK))
+        return false;
+
+    if (entry.type == TAR_FILE) {
+        remaining = entry.size;
+        padding = (TAR_BLOCK - entry.size % TAR_BLOCK) % TAR_BLOCK;
+    }
+
+    entries++;
+    return true;
+}
+
+// Adds the file "root/path".
+bool TarWriter::AddFile(const string &root, const string &path) {
+    string full = root;
+    struct stat st;
+    ArchiveEntry entry;
+
+    if (path.length() != 0)
+        full += "/" + path;
+
+    if (lstat(full.c_str(), &st) != 0) {
+        log << ERRR << "Unable to access: " << full << endl;
+        return false;
+    }
+
+    entry.path = path;
+    entry.mode = st.st_mode & 07777;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    entry.mtime = st.st_mtime;
+
+    if (S_ISREG(st.st_mode)) {
+        entry.type = TAR_FILE;
+        entry.size = st.st_size;
+    } else if (S_ISDIR(st.st_mode)) {
+        entry.type = TAR_DIRECTORY;
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(full.c_str(), link, sizeof(link) - 1);
+
+        if (len < 0) {
+            log << ERRR << "Unable to read link: " << full << endl;
+            return false;
+        }
+
+        entry.type = TAR_SYMLINK;
+        entry.link.assign(link, len);
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+        entry.type = S_ISCHR(st.st_mode) ? TAR_CHARDEV : TAR_BLOCKDEV;
+        entry.devMajor = major(st.st_rdev);
+        entry.devMinor = minor(st.st_rdev);
+    } else if (S_ISFIFO(st.st_mode)) {
+        entry.type = TAR_FIFO;
+    } else {
+        log << WARN << "Skipping socket: " << full << endl;
+        return true;
+    }
+
+    // Files with multiple links are stored once.
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+        map<pair<dev_t, ino_t>, string>::iterator it = links.find(key);
+
+        if (it != links.end()) {
+            entry.type = TAR_HARDLINK;
+            entry.link = it->second;
+            entry.size = 0;
+        } else {
+            links[key] = path;
+        }
+    }
+
+    // Files unchanged since the parent archive are only recorded
+    // (directories are always archived, for their attributes).
+    if (parent && entry.type != TAR_DIRECTORY) {
+        const ManifestEntry *old = parent->Find(path);
+
+        if (old && old->Matches(entry)) {
+            manifest->Add(*old);
+            unchanged++;
+            return true;
+        }
+    }
+
+    if (!AddEntry(entry))
+        return false;
+
+    unsigned long crc = crc32(0, Z_NULL, 0);
+
+    if (entry.type == TAR_FILE) {
+        int fd = open(full.c_str(), O_RDONLY);
+        off_t left = entry.size;
+
+        if (fd < 0) {
+            log << ERRR << "Unable to open: " << full << endl;
+            return false;
+        }
+
+        if (!buffer && !(buffer = AllocateBuffer())) {
+            close(fd);
+            return false;
+        }
+
+        while (left > 0) {
+            ssize_t ret = read(fd, buffer, min(off_t(STREAM_BUFFER_SIZE), left));
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret < 0) {
+                log << ERRR << "Unable to read: " << full << endl;
+                close(fd);
+                return false;
+            }
+
+            // The file shrunk while archiving, pad with zeros.
+            if (ret == 0) {
+                log << WARN << "File changed while archiving: " << full << endl;
+                ret = min(off_t(STREAM_BUFFER_SIZE), left);
+                memset(buffer, 0, ret);
+            }
+
+            // Decide on the first block whether to compress.
+            if (left == entry.size && entry.size >= STORE_MIN_SIZE && 
+                    !ArchiveIsCompressible(path, buffer, ret)) {
+                out->SetCompressible(false);
+                storedBytes += entry.size;
+            }
+
+            if (!Write(buffer, ret)) {
+                close(fd);
+                return false;
+            }
+
+            if (manifest)
+                crc = crc32(crc, (const Bytef *)buffer, ret);
+
+            left -= ret;
+        }
+
+        close(fd);
+        out->SetCompressible(true);
+    }
+
+    if (manifest)
+        manifest->Add(ManifestEntry(entry, crc));
+
+    if (progress)
+        progress->Update(entry, bytes);
+
+    return true;
+}
+
+// Adds the entire directory tree.
+bool TarWriter::AddTree(const char *root) {
+    return AddFile(root, "") && AddDirectory(root, "");
+}
+
+// Adds the contents of "root/path" recursively (in sorted order).
+bool TarWriter::AddDirectory(const string &root, const string &path) {
+    string full = root;
+    vector<string> names;
+    dirent *ent;
+    DIR *dir;
+
+    if (path.length() != 0)
+        full += "/" + path;
+
+    if (!(dir = opendir(full.c_str()))) {
+        log << ERRR << "Unable to open directory: " << full << endl;
+        return false;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+            names.push_back(ent->d_name);
+
+    closedir(dir);
+    sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        string child = path.length() ? path + "/" + names[i] : names[i];
+        struct stat st;
+
+        if (!AddFile(root, child))
+            return false;
+
+        if (lstat((root + "/" + child).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            if (!AddDirectory(root, child))
+                return false;
+    }
+
+    return true;
+}
+
+// Writes the end-of-archive marker.
+bool TarWriter::Finish() {
+    return remaining == 0 && WritePadding(2 * TAR_BLOCK);
+}
+
+// Returns the number of entries written.
+long long TarWriter::GetEntryCount() const {
+    return entries;
+}
+
+// Returns the number of data bytes written.
+long long TarWriter::GetByteCount() const {
+    return bytes;
+}
+
+// Returns the size of the files marked as not compressible.
+long long TarWriter::GetStoredByteCount() const {
+    return storedBytes;
+}
+
+// Returns the number of files not archived as unchanged.
+long long TarWriter::GetUnchangedCount() const {
+    return unchanged;
+}
+
+// Writes data of the current entry, followed by padding when complete.
+bool TarWriter::Write(const void *buf, size_t len) {
+    if ((off_t)len > remaining) {
+        log << ERRR << "Archive entry data exceeds its size." << endl;
+        return false;
+    }
+
+    if (!out->Write(buf, len))
+        return false;
+
+    remaining -= len;
+    bytes += len;
+
+    if (remaining == 0 && padding != 0) {
+        size_t pad = padding;
+        padding = 0;
+        return WritePadding(pad);
+    }
+
+    return true;
+}
+
+// Writes a GNU long name\link entry.
+bool TarWriter::WriteLongName(char type, const string &name) {
+    char block[TAR_BLOCK];
+    ArchiveEntry entry;
+
+    entry.path = "././@LongLink";
+    entry.type = type;
+    entry.size = name.length() + 1;
+    TarMakeHeader(block, entry);
+
+    if (!out->Write(block, TAR_BLOCK) || !out->Write(name.c_str(), name.length() + 1))
+        return false;
+
+    return WritePadding((TAR_BLOCK - (name.length() + 1) % TAR_BLOCK) % TAR_BLOCK);
+}
+
+// Writes "len" zero bytes.
+bool TarWriter::WritePadding(size_t len) {
+    char block[TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+
+    while (len > 0) {
+        size_t count = min(len, TAR_BLOCK);
+
+        if (!out->Write(block, count))
+            return false;
+
+        len -= count;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+TarReader::TarReader() {
+    in = NULL;
+    remaining = padding = 0;
+    end = true;
+}
+
+// Starts reading an archive from the given stream.
+void TarReader::Init(InStream &in) {
+    this->in = &in;
+    remaining = padding = 0;
+    end = false;
+}
+
+// Moves to the next entry.
+bool TarReader::Next(ArchiveEntry &entry) {
+    char block[TAR_BLOCK];
+    string longName, longLink;
+    off_t paxSize = -1;
+
+    if (!in || end)
+        return false;
+
+    for (;;) {
+        if (!Skip(remaining + padding))
+            return false;
+
+        remaining = padding = 0;
+
+        if (!ReadBlock(block))
+            return false;
+
+        // A zero block marks the end of the archive.
+        bool zero = true;
+        for (size_t i = 0; i < TAR_BLOCK && zero; i++)
+            zero = (block[i] == '\0');
+
+        if (zero) {
+            end = true;
+            return false;
+        }
+
+        if (!TarParseHeader(block, entry)) {
+            log << ERRR << "Invalid archive header." << endl;
+            return false;
+        }
+
+        off_t dataPadding = (TAR_BLOCK - entry.size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (entry.type == 'L' || entry.type == 'K') {
+            // GNU long name\link for the next entry.
+            if (!ReadString(entry.type == 'L' ? longName : longLink, entry.size,
+                    TAR_LONG_NAME_MAX) || !Skip(dataPadding))
+                return false;
+
+            continue;
+        }
+
+        if (entry.type == 'x' || entry.type == 'g') {
+            // POSIX extended headers. Only the most common keys of
+            // local headers are used.
+            string records;
+
+            if (!ReadString(records, entry.size, TAR_PAX_MAX) || !Skip(dataPadding))
+                return false;
+
+            for (size_t pos = 0; entry.type == 'x' && pos < records.length(); ) {
+                size_t space = records.find(' ', pos);
+                size_t len = atoi(records.c_str() + pos);
+
+                if (space == string::npos || len == 0 || pos + len > records.length())
+                    break;
+
+                string record = records.substr(space + 1, pos + len - space - 2);
+                size_t equals = record.find('=');
+                pos += len;
+
+                if (equals == string::npos)
+                    continue;
+
+                string key = record.substr(0, equals);
+                string value = record.substr(equals + 1);
+
+                if (key == "path")
+                    longName = value;
+                else if (key == "linkpath")
+                    longLink = value;
+                else if (key == "size")
+                    paxSize = strtoull(value.c_str(), NULL, 10);
+            }
+
+            continue;
+        }
+
+        if (longName.length())
+            entry.path = longName;
+
+        if (longLink.length())
+            entry.link = longLink;
+
+        if (paxSize >= 0)
+            entry.size = paxSize;
+
+        if (!ArchiveCleanPath(entry.path)) {
+            log << ERRR << "Unsafe path in archive: " << entry.path << endl;
+            return false;
+        }
+
+        // Only regular files have data, but skip anything stored.
+        remaining = entry.size;
+        padding = (TAR_BLOCK - entry.size % TAR_BLOCK) % TAR_BLOCK;
+
+        if (entry.type != TAR_FILE)
+            entry.size = 0;
+
+        return true;
+    }
+}
+
+// Returns if the end of the archive was reached.
+bool TarReader::IsEnd() const {
+    return end;
+}
+
+// Reads data of the current entry.
+ssize_t TarReader::Read(void *buf, size_t len) {
+    if (remaining <= 0)
+        return 0;
+
+    if ((off_t)len > remaining)
+        len = remaining;
+
+    ssize_t ret = in->Read(buf, len);
+
+    if (ret == 0) {
+        log << ERRR << "Archive is truncated." << endl;
+        return -1;
+    }
+
+    if (ret > 0)
+        remaining -= ret;
+
+    return ret;
+}
+
+// Reads a full block. End of input before any header (without
+// the end-of-archive marker) is accepted as the end.
+bool TarReader::ReadBlock(char *block) {
+    size_t done = 0;
+
+    while (done < TAR_BLOCK) {
+        ssize_t ret = in->Read(block + done, TAR_BLOCK - done);
+
+        if (ret < 0)
+            return false;
+
+        if (ret == 0) {
+            if (done == 0) {
+                end = true;
+                return false;
+            }
+
+            log << ERRR << "Archive is truncated." << endl;
+            return false;
+        }
+
+        done += ret;
+    }
+
+    return true;
+}
+
+// Reads and discards data.
+bool TarReader::Skip(off_t len) {
+    char temp[4096];
+
+    while (len > 0) {
+        ssize_t ret = in->Read(temp, min(off_t(sizeof(temp)), len));
+
+        if (ret <= 0) {
+            if (ret == 0)
+                log << ERRR << "Archive is truncated." << endl;
+
+            return false;
+        }
+
+        len -= ret;
+    }
+
+    return true;
+}
+
+// Reads a NUL terminated string stored as entry data, of up to "max"
+// bytes.
+bool TarReader::ReadString(string &out, off_t len, off_t max) {
+    off_t done = 0;
+
+    if (len > max) {
+        log << ERRR << "Archive header is too large (" << (long long)len << " bytes)." << endl;
+        return false;
+    }
+
+    out.resize(len);
+
+    while (done < len) {
+        ssize_t ret = in->Read(&out[done], len - done);
+
+        if (ret <= 0)
+            return false;
+
+        done += ret;
+    }
+
+    out.resize(strnlen(out.c_str(), len));
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+TarExtractor::TarExtractor() {
+    progress = NULL;
+    patcher = NULL;
+    buffer = existing = NULL;
+    bytes = entries = unchanged = removed = 0;
+    update = false;
+}
+
+// Class destructor.
+TarExtractor::~TarExtractor() {
+    free(buffer);
+    free(existing);
+}
+
+// Starts extracting below the given directory.
+void TarExtractor::Init(const char *root, ArchiveProgress *progress) {
+    this->root = root;
+    this->progress = progress;
+    directories.clear();
+    paths.clear();
+    bytes = entries = unchanged = removed = 0;
+}
+
+// Sets whether the existing files are updated (see the class).
+void TarExtractor::SetUpdate(bool update) {
+    this->update = update;
+}
+
+// Sets the patcher of the deltas (NULL to extract them as files).
+void TarExtractor::SetDeltaPatcher(DeltaPatcher *patcher) {
+    this->patcher = patcher;
+}
+
+// Records an entry whose file is up to date, setting its attributes.
+bool TarExtractor::Keep(const ArchiveEntry &entry) {
+    string path = root;
+
+    if (entry.path.length() != 0)
+        path += "/" + entry.path;
+
+    if (update)
+        paths.insert(entry.path);
+
+    if (!SetAttributes(entry, path)) {
+        log << ERRR << "Unable to update '" << path << "': " << strerror(errno) << endl;
+        return false;
+    }
+
+    entries++;
+    unchanged++;
+
+    if (progress)
+        progress->Update(entry, bytes);
+
+    return true;
+}
+
+// Creates one entry.
+bool TarExtractor::Extract(const ArchiveEntry &entry, InStream &data) {
+    string path = root;
+    bool success = true;
+
+    if (entry.path.length() != 0) {
+        path += "/" + entry.path;
+
+        if (!MakeParents(root, entry.path))
+            return false;
+    }
+
+    if (update)
+        paths.insert(entry.path);
+
+    switch (entry.type) {
+    case TAR_DIRECTORY: {
+        struct stat st;
+
+        if (lstat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode))
+            RemoveExisting(path);
+
+        if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+            success = false;
+
+        // Attributes are set once the contents are extracted.
+        if (success)
+            directories.push_back(entry);
+
+        break;
+    }
+
+    case TAR_FILE: {
+        const size_t extLen = sizeof(DELTA_EXTENSION) - 1;
+        struct stat st;
+
+        // Deltas are applied to their files (which log the errors).
+        if (patcher && path.length() > extLen &&
+                path.compare(path.length() - extLen, extLen, DELTA_EXTENSION) == 0) {
+
+            if (!patcher->Apply(path.substr(0, path.length() - extLen), data,
+                    entry.size, entry.mtime))
+                return false;
+
+            break;
+        }
+
+        // Files of the same size are kept or updated in place (unless
+        // linked elsewhere); the unread data is skipped by the reader.
+        if (update && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                st.st_nlink == 1 && st.st_size == entry.size) {
+
+            if (st.st_mtime == entry.mtime)
+                return Keep(entry);
+
+            success = UpdateFile(entry, path, data);
+            break;
+        }
+
+        success = RemoveExisting(path) && ExtractFile(entry, path, data);
+        break;
+    }
+
+    case TAR_SYMLINK:
+        if (update) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path.c_str(), target, sizeof(target));
+
+            if (len >= 0 && entry.link.compare(0, string::npos, target, len) == 0)
+                return Keep(entry);
+        }
+
+        success = RemoveExisting(path) &&
+            symlink(entry.link.c_str(), path.c_str()) == 0 &&
+            SetAttributes(entry, path);
+        break;
+
+    case TAR_HARDLINK: {
+        string target = entry.link;
+
+        if (!ArchiveCleanPath(target)) {
+            log << ERRR << "Unsafe link in archive: " << entry.link << endl;
+            return false;
+        }
+
+        target = root + "/" + target;
+        success = RemoveExisting(path) && link(target.c_str(), path.c_str()) == 0;
+        break;
+    }
+
+    case TAR_CHARDEV:
+    case TAR_BLOCKDEV:
+    case TAR_FIFO: {
+        mode_t type = (entry.type == TAR_CHARDEV) ? S_IFCHR :
+            (entry.type == TAR_BLOCKDEV) ? S_IFBLK : S_IFIFO;
+
+        success = RemoveExisting(path) &&
+            mknod(path.c_str(), type | 0600, makedev(entry.devMajor, entry.devMinor)) == 0 &&
+            SetAttributes(entry, path);
+        break;
+    }
+
+    default:
+        log << WARN << "Skipping unsupported archive entry: " << entry.path << endl;
+        return true;
+    }
+
+    if (!success) {
+        log << ERRR << "Unable to create '" << path << "': " << strerror(errno) << endl;
+        return false;
+    }
+
+    entries++;
+
+    if (progress)
+        progress->Update(entry, bytes);
+
+    return true;
+}
+
+// Extracts all entries of the archive.
+bool TarExtractor::ExtractAll(TarReader &reader) {
+    ArchiveEntry entry;
+
+    while (reader.Next(entry))
+        if (!Extract(entry, reader))
+            return false;
+
+    return reader.IsEnd() && Finish();
+}
+
+// Applies the deferred directory attributes (deepest first). In update
+// mode the files that are not in the archive are deleted first, so
+// that the modification times of the directories are kept.
+bool TarExtractor::Finish() {
+    bool success = true;
+
+    for (size_t i = directories.size(); i > 0; i--) {
+        const ArchiveEntry &entry = directories[i - 1];
+        string path = root;
+
+        if (entry.path.length() != 0)
+            path += "/" + entry.path;
+
+        if (update)
+            success &= RemoveStale(path, entry.path);
+
+        success &= SetAttributes(entry, path);
+    }
+
+    directories.clear();
+    return success;
+}
+
+// Returns the number of entries extracted.
+long long TarExtractor::GetEntryCount() const {
+    return entries;
+}
+
+// Returns the number of data bytes extracted (written).
+long long TarExtractor::GetByteCount() const {
+    return bytes;
+}
+
+// Returns the number of files that were up to date (update mode).
+long long TarExtractor::GetUnchangedCount() const {
+    return unchanged;
+}
+
+// Returns the number of files deleted (update mode).
+long long TarExtractor::GetRemovedCount() const {
+    return removed;
+}
+
+// Creates a regular file from the data.
+bool TarExtractor::ExtractFile(const ArchiveEntry &entry, const string &path,
+        InStream &data) {
+
+    off_t left = entry.size;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0)
+        return false;
+
+    if (!buffer && !(buffer = AllocateBuffer())) {
+        close(fd);
+        return false;
+    }
+
+    while (left > 0) {
+        ssize_t ret = data.Read(buffer, min(off_t(STREAM_BUFFER_SIZE), left));
+
+        if (ret <= 0) {
+            close(fd);
+            errno = EIO;
+            return false;
+        }
+
+        for (ssize_t done = 0; done < ret; ) {
+            ssize_t count = write(fd, buffer + done, ret - done);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            if (count <= 0) {
+                close(fd);
+                return false;
+            }
+
+            done += count;
+        }
+
+        left -= ret;
+        bytes += ret;
+    }
+
+    if (close(fd) != 0)
+        return false;
+
+    return SetAttributes(entry, path);
+}
+
+// Updates a regular file of the same size: the data is compared with
+// the file and only the blocks that differ are written.
+bool TarExtractor::UpdateFile(const ArchiveEntry &entry, const string &path,
+        InStream &data) {
+
+    off_t offset = 0;
+    bool changed = false;
+    int fd;
+
+    if ((!buffer && !(buffer = AllocateBuffer())) ||
+            (!existing && !(existing = AllocateBuffer())))
+        return false;
+
+    if ((fd = open(path.c_str(), O_RDWR)) < 0)
+        return false;
+
+    while (offset < entry.size) {
+        ssize_t ret = data.Read(buffer, min(off_t(STREAM_BUFFER_SIZE), entry.size - offset));
+
+        if (ret <= 0) {
+            close(fd);
+            errno = EIO;
+            return false;
+        }
+
+        if (!ReadAt(fd, existing, ret, offset) || memcmp(buffer, existing, ret) != 0) {
+            if (!WriteAt(fd, buffer, ret, offset)) {
+                close(fd);
+                return false;
+            }
+
+            bytes += ret;
+            changed = true;
+        }
+
+        offset += ret;
+    }
+
+    if (close(fd) != 0)
+        return false;
+
+    if (!changed)
+        unchanged++;
+
+    return SetAttributes(entry, path);
+}
+
+// Deletes the files of the directory that are not in the archive.
+bool TarExtractor::RemoveStale(const string &dir, const string &path) {
+    vector<string> stale;
+    struct stat parent;
+    struct dirent *de;
+    bool success = true;
+    DIR *d;
+
+    if (lstat(dir.c_str(), &parent) != 0 || !(d = opendir(dir.c_str()))) {
+        log << ERRR << "Unable to read directory: " << dir << endl;
+        return false;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        string name = de->d_name;
+
+        if (name == "." || name == ".." || name == "lost+found")
+            continue;
+
+        if (!paths.count(path.length() ? path + "/" + name : name))
+            stale.push_back(name);
+    }
+
+    closedir(d);
+
+    for (size_t i = 0; i < stale.size(); i++) {
+        string file = dir + "/" + stale[i];
+
+        log << INFO << "Removing: " << file << endl;
+
+        if (!RemoveTree(file, parent.st_dev, removed)) {
+            log << ERRR << "Unable to remove '" << file << "': " << strerror(errno) << endl;
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+// Sets ownership, permissions and modification time.
+bool TarExtractor::SetAttributes(const ArchiveEntry &entry, const string &path) {
+    if (entry.type == TAR_SYMLINK)
+        return lchown(path.c_str(), entry.uid, entry.gid) == 0;
+
+    // Ownership is set first as "chown" clears the set-id bits.
+    if (chown(path.c_str(), entry.uid, entry.gid) != 0 ||
+            chmod(path.c_str(), entry.mode) != 0)
+        return false;
+
+    struct utimbuf times;
+    times.actime = times.modtime = entry.mtime;
+    return utime(path.c_str(), &times) == 0;
+}
+
+// ============================================================================
+// Allocates an aligned buffer of STREAM_BUFFER_SIZE bytes.
+static char *AllocateBuffer() {
+    void *buffer = NULL;
+
+    if (posix_memalign(&buffer, BUFFER_ALIGNMENT, STREAM_BUFFER_SIZE) != 0) {
+        log << ERRR << "Out of memory." << endl;
+        return NULL;
+    }
+
+    return (char *)buffer;
+}
+
+// Writes a zero padded octal field, or base-256 if too large.
+static void WriteOctal(char *field, size_t len, unsigned long long value) {
+    if (value >> (3 * (len - 1))) {
+        memset(field, 0, len);
+
+        for (size_t i = len - 1; i > 0; i--, value >>= 8)
+            field[i] = value & 0xFF;
+
+        field[0] = 0x80;
+        return;
+    }
+
+    char temp[32];
+    sprintf(temp, "%0*llo", int(len - 1), value);
+    memcpy(field, temp, len);
+}
+
+// Reads an octal (or base-256) field.
+static unsigned long long ReadNumber(const char *field, size_t len) {
+    unsigned long long out = 0;
+    size_t i = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        for (i = 1; i < len; i++)
+            out = (out << 8) | (unsigned char)field[i];
+
+        return out;
+    }
+
+    while (i < len && field[i] == ' ')
+        i++;
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        out = (out << 3) + (field[i] - '0');
+
+    return out;
+}
+
+// Splits a name into the "ustar" prefix and name fields.
+static bool SplitName(const string &name, string &prefix, string &base) {
+    if (name.length() <= 100) {
+        prefix.resize(0);
+        base = name;
+        return true;
+    }
+
+    // The split must be at a slash (not the trailing one).
+    size_t pos = name.rfind('/', min(name.length() - 2, size_t(155)));
+
+    if (pos == string::npos || pos == 0 || name.length() - pos - 1 > 100)
+        return false;
+
+    prefix = name.substr(0, pos);
+    base = name.substr(pos + 1);
+    return true;
+}
+
+// Creates the missing parent directories of "root/path".
+static bool MakeParents(const string &root, const string &path) {
+    size_t pos = 0;
+
+    while ((pos = path.find('/', pos)) != string::npos) {
+        string dir = root + "/" + path.substr(0, pos++);
+
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            log << ERRR << "Unable to create directory: " << dir << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Removes an existing file (not directory) before replacing it.
+static bool RemoveExisting(const string &path) {
+    struct stat st;
+
+    if (lstat(path.c_str(), &st) != 0)
+        return true;
+
+    if (S_ISDIR(st.st_mode)) {
+        if (rmdir(path.c_str()) == 0)
+            return true;
+
+        log << ERRR << "Unable to replace directory: " << path << endl;
+        return false;
+    }
+
+    return unlink(path.c_str()) == 0;
+}
+
+// Deletes a file or a directory tree, counting the files. Other file
+// systems mounted in the tree are kept (and so is the tree).
+static bool RemoveTree(const string &path, dev_t dev, long long &count) {
+    vector<string> names;
+    struct stat st;
+    struct dirent *de;
+    bool success = true;
+    DIR *d;
+
+    if (lstat(path.c_str(), &st) != 0)
+        return errno == ENOENT;
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path.c_str()) != 0)
+            return false;
+
+        count++;
+        return true;
+    }
+
+    if (st.st_dev != dev) {
+        log << WARN << "Keeping mountpoint: " << path << endl;
+        return true;
+    }
+
+    if (!(d = opendir(path.c_str())))
+        return false;
+
+    while ((de = readdir(d)) != NULL)
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            names.push_back(de->d_name);
+
+    closedir(d);
+
+    for (size_t i = 0; i < names.size(); i++)
+        success &= RemoveTree(path + "/" + names[i], dev, count);
+
+    if (!success || rmdir(path.c_str()) != 0)
+        return false;
+
+    count++;
+    return true;
+}
+
+// Writes exactly "len" bytes at the offset.
+static bool WriteAt(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            return false;
+
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
+
+// Returns the binary logarithm of a positive number ("math.h" can
+// not be used, as its log() clashes with the log stream).
+static double Log2(double x) {
+    double result = 0, bit = 1;
+
+    while (x >= 2) {
+        x /= 2;
+        result += 1;
+    }
+
+    while (x < 1) {
+        x *= 2;
+        result -= 1;
+    }
+
+    // Square to get the fraction bits one by one.
+    for (int i = 0; i < 16; i++) {
+        x *= x;
+        bit /= 2;
+
+        if (x >= 2) {
+            x /= 2;
+            result += bit;
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,424 @@
+/*
+ *  chunkstore.cpp:
+ *      - Implementation of the content-addressed chunk store and of
+ *        content-defined chunking.
+ */
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "include/log.h"
+#include "include/util.h"
+#include "include/chunkstore.h"
+
+using namespace std;
+
+// Magic bytes of chunk files and recipes.
+static const char CHUNK_MAGIC[4] = { 'M', 'I', 'D', 'C' };
+static const char RECIPE_MAGIC[8] = { 'M', 'I', 'D', 'R', 'C', 'P', '1', '\n' };
+
+// Chunk file data types.
+static const unsigned char CHUNK_RAW = 0;
+static const unsigned char CHUNK_ZLIB = 1;
+
+// Table of the "gear" rolling hash. It is generated from a fixed seed
+// and must never change, or the chunks of new backups would not match
+// the stored ones.
+static unsigned int gGear[256];
+static bool gGearInit = false;
+
+// Utility function(s).
+static void InitGear();
+static bool WriteFile(const string &path, const void *buf, size_t len);
+
+// ============================================================================
+// Class constructor.
+ChunkStore::ChunkStore() {
+    level = 1;
+}
+
+// Opens (creating if needed) the store.
+bool ChunkStore::Open(const char *root, int level) {
+    this->root = root;
+    this->level = level;
+    known.clear();
+
+    if (mkdir(root, 0755) != 0 && errno != EEXIST) {
+        log << ERRR << "Unable to create the chunk store '" << root << "' (errno = "
+            << errno << ")." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+const char *ChunkStore::GetRoot() const {
+    return root.c_str();
+}
+
+// Returns the path of a chunk (the first byte of the digest names a
+// subdirectory, keeping directories small).
+string ChunkStore::GetChunkPath(const string &hex) const {
+    return root + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+// Returns if the chunk is stored.
+bool ChunkStore::Has(const unsigned char *digest) {
+    const string hex = Sha256ToHex(digest);
+
+    if (known.count(hex))
+        return true;
+
+    if (access(GetChunkPath(hex).c_str(), F_OK) != 0)
+        return false;
+
+    known.insert(hex);
+    return true;
+}
+
+// Stores a chunk unless already stored. The chunk is written under a
+// temporary name and renamed, so an interrupted backup never leaves a
+// partial chunk behind.
+bool ChunkStore::Put(const unsigned char *digest, const void *buf, size_t len, bool &added) {
+    const string hex = Sha256ToHex(digest);
+    const string path = GetChunkPath(hex), temp = path + ".tmp";
+    const string dir = root + "/" + hex.substr(0, 2);
+    vector<unsigned char> data(CHUNK_HEADER_SIZE);
+    uLongf zlen;
+
+    added = false;
+
+    if (Has(digest))
+        return true;
+
+    memcpy(&data[0], CHUNK_MAGIC, sizeof(CHUNK_MAGIC));
+    data[4] = CHUNK_RAW;
+    PutLE32(&data[8], len);
+    PutLE32(&data[12], crc32(crc32(0, Z_NULL, 0), (const Bytef *)buf, len));
+
+    // Keep the compressed form only if it is smaller.
+    zlen = compressBound(len);
+    data.resize(CHUNK_HEADER_SIZE + zlen);
+
+    if (level > 0 && compress2(&data[CHUNK_HEADER_SIZE], &zlen, (const Bytef *)buf,
+            len, level) == Z_OK && zlen < len) {
+        data[4] = CHUNK_ZLIB;
+        data.resize(CHUNK_HEADER_SIZE + zlen);
+    } else {
+        memcpy(&data[CHUNK_HEADER_SIZE], buf, len);
+        data.resize(CHUNK_HEADER_SIZE + len);
+    }
+
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        log << ERRR << "Unable to create '" << dir << "' (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    if (!WriteFile(temp, &data[0], data.size()) || rename(temp.c_str(), path.c_str()) != 0) {
+        log << ERRR << "Unable to store the chunk " << hex << " (errno = " << errno << ")." << endl;
+        unlink(temp.c_str());
+        return false;
+    }
+
+    known.insert(hex);
+    added = true;
+    return true;
+}
+
+// Reads a chunk of "len" bytes, verifying its CRC32.
+bool ChunkStore::Get(const unsigned char *digest, void *buf, size_t len) {
+    const string hex = Sha256ToHex(digest);
+    FileInStream in;
+    unsigned char header[CHUNK_HEADER_SIZE];
+    vector<unsigned char> data;
+    uLongf ulen = len;
+    size_t dataLen;
+
+    if (!in.Open(GetChunkPath(hex).c_str())) {
+        log << ERRR << "The chunk " << hex << " is missing from the store." << endl;
+        return false;
+    }
+
+    if (!ReadFully(in, header, sizeof(header)) || memcmp(header, CHUNK_MAGIC, sizeof(CHUNK_MAGIC)) ||
+            GetLE32(&header[8]) != len)
+        goto corrupt;
+
+    if (header[4] == CHUNK_RAW) {
+        if (!ReadFully(in, buf, len))
+            goto corrupt;
+    } else if (header[4] == CHUNK_ZLIB) {
+        struct stat st;
+
+        if (fstat(in.GetDescriptor(), &st) != 0 || st.st_size <= (off_t)CHUNK_HEADER_SIZE)
+            goto corrupt;
+
+        dataLen = st.st_size - CHUNK_HEADER_SIZE;
+        data.resize(dataLen);
+
+        if (!ReadFully(in, &data[0], dataLen) || uncompress((Bytef *)buf, &ulen,
+                &data[0], dataLen) != Z_OK || ulen != len)
+            goto corrupt;
+    } else {
+        goto corrupt;
+    }
+
+    if (crc32(crc32(0, Z_NULL, 0), (const Bytef *)buf, len) != GetLE32(&header[12]))
+        goto corrupt;
+
+    return true;
+
+corrupt:
+    log << ERRR << "The chunk " << hex << " is corrupt." << endl;
+    return false;
+}
+
+// ============================================================================
+// Class constructor.
+ChunkOutStream::ChunkOutStream() {
+    store = NULL;
+    out = NULL;
+    buffer = new char[CHUNK_MAX_SIZE];
+    fill = 0;
+    hash = 0;
+    bytes = chunks = newChunks = newBytes = 0;
+}
+
+ChunkOutStream::~ChunkOutStream() {
+    delete[] buffer;
+}
+
+// Writes the recipe header.
+bool ChunkOutStream::Init(ChunkStore &store, OutStream &out) {
+    InitGear();
+
+    this->store = &store;
+    this->out = &out;
+    fill = 0;
+    hash = 0;
+    bytes = chunks = newChunks = newBytes = 0;
+
+    return out.Write(RECIPE_MAGIC, sizeof(RECIPE_MAGIC));
+}
+
+// Stores the buffered chunk and adds it to the recipe.
+bool ChunkOutStream::WriteChunk() {
+    unsigned char record[CHUNK_RECORD_SIZE];
+    bool added;
+
+    Sha256Digest(buffer, fill, record);
+    PutLE32(&record[SHA256_SIZE], fill);
+
+    if (!store->Put(record, buffer, fill, added) || !out->Write(record, sizeof(record)))
+        return false;
+
+    chunks++;
+
+    if (added) {
+        newChunks++;
+        newBytes += fill;
+    }
+
+    fill = 0;
+    hash = 0;
+    return true;
+}
+
+// Stores the last chunk and writes the end of the recipe (a record
+// with no size followed by the total size). The new chunks are synced
+// to the disk first, so a recipe never refers to lost chunks.
+bool ChunkOutStream::Finish() {
+    unsigned char record[CHUNK_RECORD_SIZE + 8];
+
+    if (fill > 0 && !WriteChunk())
+        return false;
+
+    if (newChunks > 0)
+        sync();
+
+    memset(record, 0, sizeof(record));
+    PutLE64(&record[CHUNK_RECORD_SIZE], bytes);
+
+    if (!out->Write(record, sizeof(record)))
+        return false;
+
+    log << INFO << "Chunked " << bytes << " bytes into " << chunks << " chunks, " << newChunks
+        << " new (" << newBytes << " bytes)." << endl;
+    return true;
+}
+
+long long ChunkOutStream::GetByteCount() const {
+    return bytes;
+}
+
+long long ChunkOutStream::GetChunkCount() const {
+    return chunks;
+}
+
+long long ChunkOutStream::GetNewChunkCount() const {
+    return newChunks;
+}
+
+long long ChunkOutStream::GetNewByteCount() const {
+    return newBytes;
+}
+
+// Cuts a chunk where the "gear" hash of the last bytes has CHUNK_MASK
+// bits clear. The first CHUNK_MIN_SIZE bytes of a chunk are not even
+// hashed, as a cut there is not allowed.
+bool ChunkOutStream::Write(const void *buf, size_t len) {
+    const unsigned char *data = (const unsigned char *)buf;
+
+    bytes += len;
+
+    while (len > 0) {
+        size_t n = 0;
+        bool cut = false;
+
+        if (fill < CHUNK_MIN_SIZE)
+            n = (len < CHUNK_MIN_SIZE - fill) ? len : CHUNK_MIN_SIZE - fill;
+
+        for (; n < len; n++) {
+            hash = (hash << 1) + gGear[data[n]];
+
+            if ((hash & CHUNK_MASK) == 0 || fill + n + 1 >= CHUNK_MAX_SIZE) {
+                cut = true;
+                n++;
+                break;
+            }
+        }
+
+        memcpy(buffer + fill, data, n);
+        fill += n;
+        data += n;
+        len -= n;
+
+        if (cut && !WriteChunk())
+            return false;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+ChunkInStream::ChunkInStream() {
+    store = NULL;
+    in = NULL;
+    buffer = new char[CHUNK_MAX_SIZE];
+    pos = len = 0;
+    bytes = 0;
+    end = false;
+}
+
+ChunkInStream::~ChunkInStream() {
+    delete[] buffer;
+}
+
+// Reads the recipe header.
+bool ChunkInStream::Init(ChunkStore &store, InStream &in) {
+    char magic[sizeof(RECIPE_MAGIC)];
+
+    this->store = &store;
+    this->in = &in;
+    pos = len = 0;
+    bytes = 0;
+    end = false;
+
+    if (!ReadFully(in, magic, sizeof(magic)) || memcmp(magic, RECIPE_MAGIC, sizeof(magic))) {
+        log << ERRR << "Invalid backup recipe." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the next chunk of the recipe.
+bool ChunkInStream::ReadChunk() {
+    unsigned char record[CHUNK_RECORD_SIZE];
+    unsigned char total[8];
+
+    if (!ReadFully(*in, record, sizeof(record)))
+        return false;
+
+    len = GetLE32(&record[SHA256_SIZE]);
+    pos = 0;
+
+    // The end of the recipe carries the total size as a check.
+    if (len == 0) {
+        if (!ReadFully(*in, total, sizeof(total)))
+            return false;
+
+        if ((long long)GetLE64(total) != bytes) {
+            log << ERRR << "The backup recipe is truncated." << endl;
+            return false;
+        }
+
+        end = true;
+        return true;
+    }
+
+    if (len > CHUNK_MAX_SIZE) {
+        log << ERRR << "Invalid chunk size in backup recipe." << endl;
+        return false;
+    }
+
+    bytes += len;
+    return store->Get(record, buffer, len);
+}
+
+ssize_t ChunkInStream::Read(void *buf, size_t len) {
+    if (pos == this->len) {
+        if (end)
+            return 0;
+
+        if (!ReadChunk())
+            return -1;
+
+        if (end)
+            return 0;
+    }
+
+    if (len > this->len - pos)
+        len = this->len - pos;
+
+    memcpy(buf, buffer + pos, len);
+    pos += len;
+    return len;
+}
+
+// ============================================================================
+// Generates the "gear" table (xorshift32 from a fixed seed).
+static void InitGear() {
+    unsigned int x = 0x4d494443;
+
+    if (gGearInit)
+        return;
+
+    for (int i = 0; i < 256; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        gGear[i] = x;
+    }
+
+    gGearInit = true;
+}
+
+// Writes a file.
+static bool WriteFile(const string &path, const void *buf, size_t len) {
+    FileOutStream out;
+
+    if (!out.Open(path.c_str()))
+        return false;
+
+    if (!out.Write(buf, len)) {
+        out.Close();
+        return false;
+    }
+
+    return out.Close();
+}
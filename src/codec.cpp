@@ -0,0 +1,202 @@
+/*
+ *  codec.cpp:
+ *      - Implementation of backup compression codecs.
+ */
+#include <string>
+#include <string.h>
+#include <stdio.h>
+
+#include "include/log.h"
+#include "include/codec.h"
+
+using namespace std;
+
+// The "lzop" tool is used for LZO (its default level is the fastest).
+static const char *LZO_COMPRESS = "lzop -c";
+static const char *LZO_DECOMPRESS = "lzop -dc";
+
+// Magic bytes at the start of the data.
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char LZO_MAGIC[] = { 0x89, 'L', 'Z', 'O', 0, '\r', '\n', 0x1a, '\n' };
+
+// Structure constructor.
+Codec::Codec(CodecType type, int level) {
+    this->type = type;
+    this->level = level;
+}
+
+// Returns the name of the codec.
+string CodecGetName(const Codec &codec) {
+    char name[16];
+
+    switch (codec.type) {
+    case CODEC_NONE:
+        return "none";
+    case CODEC_LZO:
+        return "lzo";
+    default:
+        sprintf(name, "gzip%d", codec.level);
+        return name;
+    }
+}
+
+// Parses the name of a codec.
+bool CodecParseName(const string &name, Codec &codec) {
+    if (name == "none")
+        codec = Codec(CODEC_NONE);
+    else if (name == "lzo")
+        codec = Codec(CODEC_LZO);
+    else if (name.length() == 5 && !name.compare(0, 4, "gzip") && 
+            name[4] >= '1' && name[4] <= '9')
+        codec = Codec(CODEC_GZIP, name[4] - '0');
+    else
+        return false;
+
+    return true;
+}
+
+// Returns the archive extension of the codec.
+const char *CodecGetExtension(const Codec &codec, bool archive) {
+    switch (codec.type) {
+    case CODEC_NONE:
+        return archive ? ".tar" : "";
+    case CODEC_LZO:
+        return archive ? ".tar.lzo" : ".lzo";
+    default:
+        return archive ? ".tgz" : ".gz";
+    }
+}
+
+// Checks the magic bytes of the data.
+Codec CodecDetect(const void *head, size_t len) {
+    if (len >= sizeof(GZIP_MAGIC) && !memcmp(head, GZIP_MAGIC, sizeof(GZIP_MAGIC)))
+        return Codec(CODEC_GZIP);
+    else if (len >= sizeof(LZO_MAGIC) && !memcmp(head, LZO_MAGIC, sizeof(LZO_MAGIC)))
+        return Codec(CODEC_LZO);
+    else
+        return Codec(CODEC_NONE);
+}
+
+// ============================================================================
+// Class constructor.
+CompressOutStream::CompressOutStream() {
+    out = NULL;
+    init = false;
+}
+
+// Starts compressing to the given stream.
+bool CompressOutStream::Init(OutStream &out, const Codec &codec) {
+    this->out = &out;
+    this->codec = codec;
+
+    log << INFO << "Compressing with '" << CodecGetName(codec) << "'." << endl;
+
+    switch (codec.type) {
+    case CODEC_NONE:
+        init = true;
+        break;
+    case CODEC_LZO:
+        init = lzo.Open(LZO_COMPRESS, out);
+        break;
+    default:
+        init = gzip.Init(out, codec.level);
+        break;
+    }
+
+    return init;
+}
+
+// Flushes the compressed data.
+bool CompressOutStream::Finish() {
+    if (!init)
+        return false;
+
+    init = false;
+
+    switch (codec.type) {
+    case CODEC_NONE:
+        return true;
+    case CODEC_LZO:
+        return lzo.Close();
+    default:
+        return gzip.Finish();
+    }
+}
+
+// Passes the hint to "gzip" ("lzop" is fast enough anyway).
+void CompressOutStream::SetCompressible(bool compressible) {
+    if (init && codec.type == CODEC_GZIP)
+        gzip.SetCompressible(compressible);
+}
+
+// Compresses the data.
+bool CompressOutStream::Write(const void *buf, size_t len) {
+    if (!init)
+        return false;
+
+    switch (codec.type) {
+    case CODEC_NONE:
+        return out->Write(buf, len);
+    case CODEC_LZO:
+        return lzo.Write(buf, len);
+    default:
+        return gzip.Write(buf, len);
+    }
+}
+
+// ============================================================================
+// Class constructor.
+DecompressInStream::DecompressInStream() {
+    source = NULL;
+}
+
+// Starts decompressing the given stream.
+bool DecompressInStream::Init(InStream &in) {
+    unsigned char head[sizeof(LZO_MAGIC)];
+    ssize_t len;
+
+    this->in.Init(in);
+    source = NULL;
+
+    if ((len = this->in.Peek(head, sizeof(head))) < 0)
+        return false;
+
+    codec = CodecDetect(head, len);
+    log << INFO << "Detected compression: " << 
+        (codec.type == CODEC_GZIP ? "gzip" : CodecGetName(codec)) << endl;
+
+    switch (codec.type) {
+    case CODEC_NONE:
+        source = &this->in;
+        break;
+    case CODEC_LZO:
+        if (lzo.Open(LZO_DECOMPRESS, this->in))
+            source = &lzo;
+        break;
+    default:
+        if (gzip.Init(this->in, false))
+            source = &gzip;
+        break;
+    }
+
+    return source != NULL;
+}
+
+// Stops decompressing, returning false if the codec failed.
+bool DecompressInStream::Finish() {
+    if (!source)
+        return false;
+
+    source = NULL;
+    return (codec.type != CODEC_LZO) || lzo.Close();
+}
+
+// Returns the detected codec.
+const Codec &DecompressInStream::GetCodec() const {
+    return codec;
+}
+
+// Reads the decompressed data.
+ssize_t DecompressInStream::Read(void *buf, size_t len) {
+    return source ? source->Read(buf, len) : -1;
+}
@@ -0,0 +1,251 @@
+/*
+ *  delta.cpp:
+ *      - Implementation of binary delta patches of installed files.
+ */
+#include <string>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "include/log.h"
+#include "include/util.h"
+#include "include/delta.h"
+
+using namespace std;
+
+// Offsets of the header fields.
+static const size_t DELTA_SOURCE_SIZE = 8;
+static const size_t DELTA_SOURCE_DIGEST = DELTA_SOURCE_SIZE + 8;
+static const size_t DELTA_TARGET_SIZE = DELTA_SOURCE_DIGEST + SHA256_SIZE;
+static const size_t DELTA_TARGET_DIGEST = DELTA_TARGET_SIZE + 8;
+
+// Size of a record of a delta (without its data).
+static const size_t DELTA_RECORD_SIZE = 3 * 8;
+
+// Utility function(s).
+static off_t GetOffset(const unsigned char *p);
+static bool ReadSource(int fd, off_t sourceSize, char *buf, size_t len, off_t pos);
+static bool HashFile(int fd, char *buf, unsigned char *digest);
+
+// ============================================================================
+// Class constructor.
+DeltaPatcher::DeltaPatcher() {
+    buffer = source = NULL;
+    applied = skipped = 0;
+}
+
+// Class destructor.
+DeltaPatcher::~DeltaPatcher() {
+    free(buffer);
+    free(source);
+}
+
+// Applies the delta to the file, through a temporary file that then
+// replaces it.
+bool DeltaPatcher::Apply(const string &path, InStream &delta, off_t size, time_t mtime) {
+    unsigned char header[DELTA_HEADER_SIZE], digest[SHA256_SIZE];
+    string temp = path + ".patching";
+    FileOutStream out;
+    Sha256 sha;
+    struct stat st;
+    struct utimbuf times;
+    off_t sourceSize, targetSize;
+    bool success = false;
+    int fd = -1;
+
+    if ((!buffer && !(buffer = (char *)malloc(STREAM_BUFFER_SIZE))) ||
+            (!source && !(source = (char *)malloc(STREAM_BUFFER_SIZE)))) {
+        log << ERRR << "Out of memory." << endl;
+        return false;
+    }
+
+    if (size < (off_t)DELTA_HEADER_SIZE || !ReadFully(delta, header, sizeof(header)) ||
+            memcmp(header, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0) {
+        log << ERRR << "Invalid delta of " << path << endl;
+        return false;
+    }
+
+    sourceSize = GetLE64(header + DELTA_SOURCE_SIZE);
+    targetSize = GetLE64(header + DELTA_TARGET_SIZE);
+
+    if ((fd = open(path.c_str(), O_RDONLY)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            !HashFile(fd, source, digest)) {
+        log << ERRR << "Unable to read the file to patch: " << path << endl;
+        goto done;
+    }
+
+    // The file may already be the target (patch applied before).
+    if (st.st_size == targetSize && memcmp(digest, header + DELTA_TARGET_DIGEST, SHA256_SIZE) == 0) {
+        log << INFO << "Already patched: " << path << endl;
+        skipped++;
+        success = true;
+        goto done;
+    }
+
+    if (st.st_size != sourceSize || memcmp(digest, header + DELTA_SOURCE_DIGEST, SHA256_SIZE) != 0) {
+        log << ERRR << "File does not match the source of its delta: " << path << endl;
+        goto done;
+    }
+
+    if (!out.Open(temp.c_str()))
+        goto done;
+
+    if (!Patch(fd, sourceSize, delta, size - DELTA_HEADER_SIZE, out, sha, targetSize) || !out.Close())
+        goto fail;
+
+    sha.Final(digest);
+
+    if (memcmp(digest, header + DELTA_TARGET_DIGEST, SHA256_SIZE) != 0) {
+        log << ERRR << "Patched file does not match the target of its delta: " << path << endl;
+        goto fail;
+    }
+
+    // Ownership is set first as "chown" clears the set-id bits.
+    times.actime = times.modtime = mtime;
+
+    if (chown(temp.c_str(), st.st_uid, st.st_gid) != 0 || chmod(temp.c_str(), st.st_mode & 07777) != 0 ||
+            utime(temp.c_str(), &times) != 0 || rename(temp.c_str(), path.c_str()) != 0) {
+        log << ERRR << "Unable to replace '" << path << "': " << strerror(errno) << endl;
+        goto fail;
+    }
+
+    log << INFO << "Patched: " << path << endl;
+    applied++;
+    success = true;
+    goto done;
+
+fail:
+    out.Close();
+    unlink(temp.c_str());
+
+done:
+    if (fd >= 0)
+        close(fd);
+
+    return success;
+}
+
+// Returns the number of files patched.
+long long DeltaPatcher::GetAppliedCount() const {
+    return applied;
+}
+
+// Returns the number of files that were already patched.
+long long DeltaPatcher::GetSkippedCount() const {
+    return skipped;
+}
+
+// Writes the target built by the records of the delta ("size" bytes
+// left) from the source file, updating its digest.
+bool DeltaPatcher::Patch(int fd, off_t sourceSize, InStream &delta, off_t size,
+        OutStream &out, Sha256 &digest, off_t targetSize) {
+
+    off_t sourcePos = 0, targetPos = 0;
+
+    while (targetPos < targetSize) {
+        unsigned char record[DELTA_RECORD_SIZE];
+        off_t add, copy, seek;
+
+        if (size < (off_t)DELTA_RECORD_SIZE || !ReadFully(delta, record, sizeof(record)))
+            goto invalid;
+
+        size -= DELTA_RECORD_SIZE;
+        add = GetOffset(record);
+        copy = GetOffset(record + 8);
+        seek = GetOffset(record + 16);
+
+        if (add < 0 || copy < 0 || add > targetSize - targetPos - copy || add > size - copy)
+            goto invalid;
+
+        // Bytes added to those of the source.
+        for (off_t done = 0; done < add; ) {
+            size_t len = min(off_t(STREAM_BUFFER_SIZE), add - done);
+
+            if (!ReadFully(delta, buffer, len) ||
+                    !ReadSource(fd, sourceSize, source, len, sourcePos + done))
+                return false;
+
+            for (size_t i = 0; i < len; i++)
+                buffer[i] += source[i];
+
+            if (!out.Write(buffer, len))
+                return false;
+
+            digest.Update(buffer, len);
+            done += len;
+        }
+
+        // Bytes copied as is.
+        for (off_t done = 0; done < copy; ) {
+            size_t len = min(off_t(STREAM_BUFFER_SIZE), copy - done);
+
+            if (!ReadFully(delta, buffer, len) || !out.Write(buffer, len))
+                return false;
+
+            digest.Update(buffer, len);
+            done += len;
+        }
+
+        size -= add + copy;
+        sourcePos += add + seek;
+        targetPos += add + copy;
+    }
+
+    if (size == 0)
+        return true;
+
+invalid:
+    log << ERRR << "Invalid delta record." << endl;
+    return false;
+}
+
+// ============================================================================
+// Reads a signed number as "bsdiff" writes it (the sign is the top bit).
+static off_t GetOffset(const unsigned char *p) {
+    off_t value = GetLE64(p) & ~(1ULL << 63);
+    return (p[7] & 0x80) ? -value : value;
+}
+
+// Reads the source bytes at the position. Those outside of the file
+// are zero (as in "bsdiff").
+static bool ReadSource(int fd, off_t sourceSize, char *buf, size_t len, off_t pos) {
+    off_t start = max(pos, off_t(0));
+    off_t end = min(pos + off_t(len), sourceSize);
+
+    memset(buf, 0, len);
+
+    if (start >= end)
+        return true;
+
+    return ReadAt(fd, buf + (start - pos), end - start, start);
+}
+
+// Computes the digest of the file.
+static bool HashFile(int fd, char *buf, unsigned char *digest) {
+    Sha256 sha;
+    off_t offset = 0;
+
+    for (;;) {
+        ssize_t ret = pread(fd, buf, STREAM_BUFFER_SIZE, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0)
+            return false;
+
+        if (ret == 0)
+            break;
+
+        sha.Update(buf, ret);
+        offset += ret;
+    }
+
+    sha.Final(digest);
+    return true;
+}
@@ -0,0 +1,330 @@
+/*
+ *  diskio.cpp:
+ *      - Implementation of large-block copying between devices and
+ *        streams.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "include/log.h"
+#include "include/diskio.h"
+
+using namespace std;
+
+// Utility function(s).
+static long long Now();
+
+// ============================================================================
+// Class constructor.
+DiskDumper::DiskDumper() {
+    fd = -1;
+    writing = direct = false;
+    offset = remaining = 0;
+    in = NULL;
+    out = NULL;
+    bytes = milliseconds = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&buffers[i], DISK_ALIGNMENT, DISK_BUFFER_SIZE) != 0)
+            buffers[i] = NULL;
+
+        lengths[i] = 0;
+        full[i] = false;
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+// Class destructor.
+DiskDumper::~DiskDumper() {
+    Close();
+
+    free(buffers[0]);
+    free(buffers[1]);
+
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+}
+
+// Copies "length" bytes of the device at "offset" to the stream.
+bool DiskDumper::Read(const char *path, off_t offset, off_t length, OutStream &out,
+        bool direct) {
+
+    if (!Open(path, O_RDONLY, offset, direct))
+        return false;
+
+    writing = false;
+    remaining = length;
+    this->out = &out;
+
+    bool success = Run();
+
+    Close();
+    return success;
+}
+
+// Copies the stream to the device at "offset".
+bool DiskDumper::Write(InStream &in, const char *path, off_t offset, off_t length,
+        bool direct) {
+
+    bool success;
+
+    if (!Open(path, O_WRONLY, offset, direct))
+        return false;
+
+    writing = true;
+    remaining = length;
+    this->in = &in;
+
+    success = Run();
+
+    // The time includes flushing the data to the device.
+    if (success && fdatasync(fd) != 0) {
+        log << ERRR << "Unable to flush " << path << " (errno = " << errno << ")." << endl;
+        success = false;
+    }
+
+    milliseconds = Now() - milliseconds;
+
+    Close();
+    return success;
+}
+
+long long DiskDumper::GetByteCount() const {
+    return bytes;
+}
+
+long long DiskDumper::GetMilliseconds() const {
+    return milliseconds;
+}
+
+// Returns the throughput of the last copy in KB/s.
+long long DiskDumper::GetThroughput() const {
+    return milliseconds > 0 ? bytes * 1000 / 1024 / milliseconds : 0;
+}
+
+// Opens the device. O_DIRECT is only used if the offset is aligned
+// and the device supports it.
+bool DiskDumper::Open(const char *path, int flags, off_t offset, bool direct) {
+    Close();
+
+    if (!buffers[0] || !buffers[1]) {
+        log << ERRR << "Out of memory." << endl;
+        return false;
+    }
+
+    this->direct = direct && (offset % DISK_SECTOR_SIZE) == 0;
+    this->offset = offset;
+    bytes = 0;
+    milliseconds = Now();
+
+    if (this->direct && (fd = open(path, flags | O_DIRECT)) < 0) {
+        log << WARN << "Unable to open " << path << " for direct I/O (errno = "
+            << errno << ")." << endl;
+        this->direct = false;
+    }
+
+    if (!this->direct && (fd = open(path, flags)) < 0) {
+        log << ERRR << "Unable to open " << path << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Closes the device.
+void DiskDumper::Close() {
+    if (fd >= 0)
+        close(fd);
+
+    fd = -1;
+    in = NULL;
+    out = NULL;
+}
+
+// Produces the next buffer: from the device when reading, from the
+// stream when writing. A length of 0 marks the end.
+bool DiskDumper::Fill(char *buf, size_t &len) {
+    len = 0;
+
+    if (!writing) {
+        size_t count = (remaining < (off_t)DISK_BUFFER_SIZE) ? remaining : DISK_BUFFER_SIZE;
+        size_t request = count;
+
+        // Direct reads must cover whole sectors.
+        if (direct && request % DISK_SECTOR_SIZE)
+            request += DISK_SECTOR_SIZE - request % DISK_SECTOR_SIZE;
+
+        while (len < count) {
+            ssize_t ret = pread(fd, buf + len, request - len, offset + len);
+
+            if (ret < 0 && errno == EINTR)
+                continue;
+
+            if (ret <= 0) {
+                log << ERRR << "Unable to read at " << (long long)(offset + len)
+                    << " (errno = " << (ret < 0 ? errno : 0) << ")." << endl;
+                return false;
+            }
+
+            len += ret;
+        }
+
+        len = count;
+        offset += len;
+        remaining -= len;
+        return true;
+    }
+
+    while (len < DISK_BUFFER_SIZE) {
+        ssize_t ret = in->Read(buf + len, DISK_BUFFER_SIZE - len);
+
+        if (ret < 0)
+            return false;
+
+        if (ret == 0)
+            break;
+
+        len += ret;
+    }
+
+    if ((off_t)len > remaining) {
+        log << ERRR << "The data is larger than the target area." << endl;
+        return false;
+    }
+
+    remaining -= len;
+    return true;
+}
+
+// Consumes a buffer: to the stream when reading, to the device when
+// writing.
+bool DiskDumper::Drain(const char *buf, size_t len) {
+    size_t done = 0;
+
+    if (!writing)
+        return out->Write(buf, len);
+
+    // A partial last sector can not be written directly.
+    if (direct && len % DISK_SECTOR_SIZE) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = false;
+    }
+
+    while (done < len) {
+        ssize_t ret = pwrite(fd, buf + done, len - done, offset + done);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Unable to write at " << (long long)(offset + done)
+                << " (errno = " << (ret < 0 ? errno : 0) << ")." << endl;
+            return false;
+        }
+
+        done += ret;
+    }
+
+    offset += len;
+    return true;
+}
+
+// Runs the copy: the producer fills the buffers in turn on a thread
+// of its own, while they are drained here.
+bool DiskDumper::Run() {
+    pthread_t thread;
+    bool success = true;
+
+    full[0] = full[1] = false;
+    failed = false;
+
+    if (pthread_create(&thread, NULL, Producer, this) != 0) {
+        log << ERRR << "Unable to create copy thread." << endl;
+        return false;
+    }
+
+    for (int i = 0; ; i ^= 1) {
+        size_t len;
+
+        pthread_mutex_lock(&lock);
+
+        while (!full[i] && !failed)
+            pthread_cond_wait(&cond, &lock);
+
+        len = lengths[i];
+        success = !failed;
+        pthread_mutex_unlock(&lock);
+
+        if (!success || len == 0)
+            break;
+
+        success = Drain(buffers[i], len);
+        bytes += len;
+
+        pthread_mutex_lock(&lock);
+        full[i] = false;
+        failed |= !success;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        if (!success)
+            break;
+    }
+
+    pthread_join(thread, NULL);
+
+    if (!writing)
+        milliseconds = Now() - milliseconds;
+
+    return success;
+}
+
+// Producer thread: fills the buffers in turn.
+void *DiskDumper::Producer(void *arg) {
+    DiskDumper *self = (DiskDumper *)arg;
+
+    for (int i = 0; ; i ^= 1) {
+        size_t len;
+        bool success;
+
+        pthread_mutex_lock(&self->lock);
+
+        while (self->full[i] && !self->failed)
+            pthread_cond_wait(&self->cond, &self->lock);
+
+        success = !self->failed;
+        pthread_mutex_unlock(&self->lock);
+
+        if (!success)
+            break;
+
+        success = self->Fill(self->buffers[i], len);
+
+        pthread_mutex_lock(&self->lock);
+        self->lengths[i] = len;
+        self->full[i] = success;
+        self->failed |= !success;
+        pthread_cond_broadcast(&self->cond);
+        pthread_mutex_unlock(&self->lock);
+
+        if (!success || len == 0)
+            break;
+    }
+
+    return NULL;
+}
+
+// ============================================================================
+// Returns the current time in milliseconds.
+static long long Now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
@@ -2,9 +2,44 @@
  *  mtd.cpp:
  *      - MTD device definition.
  */
+#include <algorithm>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <mtd/mtd-user.h>
+
+#include "../include/log.h"
+#include "../include/stream.h"
+#include "../include/util.h"
+#include "../include/image.h"
 #include "mtd.h"
 
+using namespace std;
+
+// Older kernel headers lack the MLC type.
+#ifndef MTD_MLCNANDFLASH
+#define MTD_MLCNANDFLASH 8
+#endif
+
+// Magic numbers of the recognized contents: of ARM "zImage" (at 0x24, 
+// followed by the start and end addresses) and of "u-boot" images (a
+// big-endian header of 64 bytes, with the data size at 12).
+static const unsigned int ZIMAGE_MAGIC = 0x016f2818;
+static const unsigned int UIMAGE_MAGIC = 0x27051956;
+static const off_t UIMAGE_HEADER_SIZE = 64;
+
+// Utility function(s).
+static int OpenDevice(const char *device, int flags, MTDGeometry &geometry);
+static bool IsBadBlock(int fd, const MTDGeometry &geometry, off_t offset, bool &bad);
+static bool EraseBlock(int fd, off_t offset, off_t length);
+static char *AllocateBlock(const MTDGeometry &geometry);
+static ssize_t ReadBlock(InStream &in, char *buf, size_t len);
+static bool WritePages(int fd, const MTDGeometry &geometry, const char *buf, 
+    ssize_t len, off_t offset);
+
 struct MTD gMTDs[MTD_MAX + 1];
 
 MTD::MTD() { }
@@ -35,3 +70,351 @@ void MTD::Init() {
 #endif
 }
 
+
+// Returns the offset of the partition on the internal SD card.
+off_t MTD::GetDiskOffset() const {
+    return 512 + (off_t)start;
+}
+
+// Returns the geometry of the device.
+bool MTD::GetGeometry(MTDGeometry &geometry) const {
+    int fd = OpenDevice(device, O_RDONLY, geometry);
+
+    if (fd < 0)
+        return false;
+
+    close(fd);
+    return true;
+}
+
+// Writes the data of all good blocks to the stream (as "nanddump -o -b").
+bool MTD::Dump(OutStream &out, off_t length) const {
+    MTDGeometry geometry;
+    char *buffer = NULL;
+    bool success = false;
+    int fd = OpenDevice(device, O_RDONLY, geometry), skipped = 0;
+
+    if (fd < 0 || !(buffer = AllocateBlock(geometry)))
+        goto out;
+
+    if (length < 0)
+        length = geometry.size;
+
+    for (off_t offset = 0; offset < geometry.size && length > 0; offset += geometry.eraseSize) {
+        bool bad;
+
+        if (!IsBadBlock(fd, geometry, offset, bad))
+            goto out;
+
+        if (bad) {
+            skipped++;
+            continue;
+        }
+
+        if (pread(fd, buffer, geometry.eraseSize, offset) != geometry.eraseSize) {
+            log << ERRR << "Unable to read " << device << " at " << (long long)offset
+                << " (errno = " << errno << ")." << endl;
+            goto out;
+        }
+
+        if (!out.Write(buffer, min(length, geometry.eraseSize)))
+            goto out;
+
+        length -= min(length, geometry.eraseSize);
+    }
+
+    log << INFO << "Dumped " << device << " (" << skipped << " bad blocks skipped)." << endl;
+    success = true;
+
+out:
+    free(buffer);
+
+    if (fd >= 0)
+        close(fd);
+
+    return success;
+}
+
+// Erases all good blocks (as "flash_eraseall").
+bool MTD::Erase() const {
+    MTDGeometry geometry;
+    bool success = false;
+    int fd = OpenDevice(device, O_RDWR, geometry);
+
+    if (fd < 0)
+        return false;
+
+    for (off_t offset = 0; offset < geometry.size; offset += geometry.eraseSize) {
+        bool bad;
+
+        if (!IsBadBlock(fd, geometry, offset, bad))
+            goto out;
+
+        if (!bad && !EraseBlock(fd, offset, geometry.eraseSize))
+            goto out;
+    }
+
+    success = true;
+
+out:
+    close(fd);
+    return success;
+}
+
+// Writes the stream to the device block by block (as "nandwrite -p"),
+// erasing each good block just before it is programmed. With "compare",
+// each block is read first and is only erased and programmed if its
+// contents differ, which saves time and wear on re-flashes.
+bool MTD::Flash(InStream &in, bool compare, MTDFlashStats *stats) const {
+    MTDGeometry geometry;
+    MTDFlashStats counts = { 0, 0, 0 };
+    char *buffer = NULL, *current = NULL;
+    bool success = false;
+    int fd = OpenDevice(device, O_RDWR, geometry);
+    off_t offset = 0;
+
+    if (fd < 0 || !(buffer = AllocateBlock(geometry)) || 
+            (compare && !(current = AllocateBlock(geometry))))
+        goto out;
+
+    for (;;) {
+        ssize_t len = ReadBlock(in, buffer, geometry.eraseSize);
+        bool bad = true;
+
+        if (len < 0)
+            goto out;
+
+        if (len == 0)
+            break;
+
+        // Find the next good block.
+        while (offset < geometry.size) {
+            if (!IsBadBlock(fd, geometry, offset, bad))
+                goto out;
+
+            if (!bad)
+                break;
+
+            counts.bad++;
+            offset += geometry.eraseSize;
+        }
+
+        if (bad) {
+            log << ERRR << "The image does not fit in " << device << "." << endl;
+            goto out;
+        }
+
+        // The block as it is after flashing: the data, and the rest
+        // erased. A block that can not be read is simply flashed.
+        memset(buffer + len, 0xff, geometry.eraseSize - len);
+
+        if (compare && pread(fd, current, geometry.eraseSize, offset) == geometry.eraseSize &&
+                memcmp(buffer, current, geometry.eraseSize) == 0) {
+            counts.unchanged++;
+        } else {
+            // Only whole pages can be written, the rest of the block is
+            // left erased.
+            if (len % geometry.writeSize)
+                len += geometry.writeSize - len % geometry.writeSize;
+
+            if (!EraseBlock(fd, offset, geometry.eraseSize))
+                goto out;
+
+            if (!WritePages(fd, geometry, buffer, len, offset)) {
+                log << ERRR << "Unable to write " << device << " at " << (long long)offset
+                    << " (errno = " << errno << ")." << endl;
+                goto out;
+            }
+
+            counts.written++;
+        }
+
+        offset += geometry.eraseSize;
+
+        if (len < geometry.eraseSize)
+            break;
+    }
+
+    log << INFO << "Flashed " << device << ": " << counts.written << " blocks written, " 
+        << counts.unchanged << " unchanged, " << counts.bad << " bad skipped." << endl;
+    success = true;
+
+out:
+    free(buffer);
+    free(current);
+
+    if (fd >= 0)
+        close(fd);
+
+    if (stats)
+        *stats = counts;
+
+    return success;
+}
+
+// Parses the known headers. A length that does not fit in the partition
+// means the content is not what it seems.
+MTDPayload MTD::GetPayload(const void *head, size_t len) const {
+    const unsigned char *p = (const unsigned char *)head;
+    MTDPayload payload = { MTD_CONTENT_UNKNOWN, size };
+    off_t length = 0;
+
+    if (len < MTD_PAYLOAD_HEAD_SIZE)
+        return payload;
+
+    if (GetLE32(p + 0x24) == ZIMAGE_MAGIC && GetLE32(p + 0x2c) > GetLE32(p + 0x28)) {
+        payload.type = MTD_CONTENT_ZIMAGE;
+        length = GetLE32(p + 0x2c) - GetLE32(p + 0x28);
+    } else if (GetBE32(p) == UIMAGE_MAGIC) {
+        payload.type = MTD_CONTENT_UIMAGE;
+        length = UIMAGE_HEADER_SIZE + GetBE32(p + 12);
+    } else if (p[0] == 'B' && p[1] == 'M') {
+        payload.type = MTD_CONTENT_BMP;
+        length = GetLE32(p + 2);
+    }
+
+    if (length > 0 && length <= size)
+        payload.length = length;
+    else
+        payload.type = MTD_CONTENT_UNKNOWN;
+
+    return payload;
+}
+
+// ============================================================================
+// Returns the name of a content type.
+const char *GetMTDContentName(MTDContentType type) {
+    switch (type) {
+    case MTD_CONTENT_ZIMAGE:
+        return "zImage";
+    case MTD_CONTENT_UIMAGE:
+        return "uImage";
+    case MTD_CONTENT_BMP:
+        return "bmp";
+    default:
+        return "raw";
+    }
+}
+
+// ============================================================================
+// Opens the MTD character device and queries its geometry.
+static int OpenDevice(const char *device, int flags, MTDGeometry &geometry) {
+    struct mtd_info_user info;
+    int fd;
+
+    if (!device || (fd = open(device, flags)) < 0) {
+        log << ERRR << "Unable to open MTD device " << (device ? device : "(none)")
+            << " (errno = " << errno << ")." << endl;
+        return -1;
+    }
+
+    if (ioctl(fd, MEMGETINFO, &info) != 0 || info.erasesize == 0) {
+        log << ERRR << "Unable to query MTD device " << device << " (errno = " 
+            << errno << ")." << endl;
+        close(fd);
+        return -1;
+    }
+
+    geometry.size = info.size;
+    geometry.eraseSize = info.erasesize;
+    geometry.writeSize = info.writesize ? info.writesize : 1;
+    geometry.nand = (info.type == MTD_NANDFLASH || info.type == MTD_MLCNANDFLASH);
+    return fd;
+}
+
+// Checks if the block at the offset is marked bad (NAND only).
+static bool IsBadBlock(int fd, const MTDGeometry &geometry, off_t offset, bool &bad) {
+    loff_t position = offset;
+    int ret;
+
+    bad = false;
+
+    if (!geometry.nand)
+        return true;
+
+    if ((ret = ioctl(fd, MEMGETBADBLOCK, &position)) < 0) {
+        // Devices without bad block support have none.
+        if (errno == EOPNOTSUPP)
+            return true;
+
+        log << ERRR << "Unable to check block at " << (long long)offset 
+            << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    bad = (ret > 0);
+    return true;
+}
+
+// Erases the block at the offset.
+static bool EraseBlock(int fd, off_t offset, off_t length) {
+    struct erase_info_user erase;
+
+    erase.start = offset;
+    erase.length = length;
+
+    if (ioctl(fd, MEMERASE, &erase) != 0) {
+        log << ERRR << "Unable to erase block at " << (long long)offset
+            << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Allocates a page aligned buffer of one eraseblock.
+static char *AllocateBlock(const MTDGeometry &geometry) {
+    void *buffer;
+
+    if (posix_memalign(&buffer, sysconf(_SC_PAGESIZE), geometry.eraseSize) != 0) {
+        log << ERRR << "Out of memory." << endl;
+        return NULL;
+    }
+
+    return (char *)buffer;
+}
+
+// Reads up to "len" bytes, less only at the end of the stream.
+static ssize_t ReadBlock(InStream &in, char *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = in.Read(buf + done, len - done);
+
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+            break;
+
+        done += ret;
+    }
+
+    return done;
+}
+
+// Writes the pages of an erased block, skipping the pages that are all
+// 0xFF on NAND (they already read as such).
+static bool WritePages(int fd, const MTDGeometry &geometry, const char *buf, 
+        ssize_t len, off_t offset) {
+
+    if (!geometry.nand)
+        return pwrite(fd, buf, len, offset) == len;
+
+    for (ssize_t start = 0; start < len; ) {
+        ssize_t end = start;
+        unsigned int fill;
+
+        // Find the next run of pages to program.
+        while (end < len && !(IsUniform(buf + end, geometry.writeSize, fill) && 
+                fill == 0xffffffff))
+            end += geometry.writeSize;
+
+        if (end > start && pwrite(fd, buf + start, end - start, offset + start) != end - start)
+            return false;
+
+        start = end + geometry.writeSize;
+    }
+
+    return true;
+}
@@ -5,6 +5,11 @@
 #ifndef __MTD_H_
 #define __MTD_H_
 
+#include <sys/types.h>
+
+class InStream;
+class OutStream;
+
 enum MTD_Index {
     MTD_BOOTLOADER,
     MTD_BOOTARGS,
@@ -17,6 +22,39 @@ enum MTD_Index {
     MTD_MAX = MTD_ROOTFS,
 };
 
+// Geometry of an MTD device (as reported by MEMGETINFO).
+struct MTDGeometry {
+    off_t size;
+    off_t eraseSize;
+    off_t writeSize;
+    bool nand;                  // may have bad blocks
+};
+
+// Counts of the blocks handled by MTD::Flash().
+struct MTDFlashStats {
+    int written;
+    int unchanged;              // already holding the data (not written)
+    int bad;
+};
+
+// Contents of MTD partitions recognized from their headers.
+enum MTDContentType {
+    MTD_CONTENT_UNKNOWN,
+    MTD_CONTENT_ZIMAGE,         // ARM "zImage"
+    MTD_CONTENT_UIMAGE,         // "u-boot" image ("mkimage")
+    MTD_CONTENT_BMP,
+};
+
+// The payload at the start of a partition: the rest of the partition
+// is padding. Unknown contents span the whole partition.
+struct MTDPayload {
+    MTDContentType type;
+    off_t length;
+};
+
+// Size of the partition head needed to find the payload.
+static const size_t MTD_PAYLOAD_HEAD_SIZE = 64;
+
 class MTD {
 public:
     const char *name;
@@ -35,8 +73,29 @@ public:
         const char *filepattern);
 
     static void Init();
+
+    // Returns the offset of the partition on the internal SD card of
+    // devices without NAND (the partitions follow the MBR sector).
+    off_t GetDiskOffset() const;
+
+    // Native I/O through the MTD character device. Bad blocks are
+    // skipped (not dumped, not written), and only the blocks about
+    // to be written are erased. The last page is padded with 0xFF.
+    // With "compare", blocks already holding the data are left alone.
+    // A "length" limits the dump to the first bytes of the partition.
+    bool GetGeometry(MTDGeometry &geometry) const;
+    bool Dump(OutStream &out, off_t length = -1) const;
+    bool Erase() const;
+    bool Flash(InStream &in, bool compare = false, MTDFlashStats *stats = NULL) const;
+
+    // Finds the payload from the head of the partition (at least
+    // MTD_PAYLOAD_HEAD_SIZE bytes).
+    MTDPayload GetPayload(const void *head, size_t len) const;
 };
 
+// Returns the name of a content type.
+const char *GetMTDContentName(MTDContentType type);
+
 extern MTD gMTDs[];
 
 #endif  //  __MTD_H_
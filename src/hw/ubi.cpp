@@ -0,0 +1,282 @@
+/*
+ *  ubi.cpp:
+ *      - UBI device and volume control.
+ */
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <mtd/ubi-user.h>
+
+#include "../include/log.h"
+#include "ubi.h"
+
+using namespace std;
+
+// The UBI control device and the "sysfs" directory of UBI devices and
+// volumes ("ubiX" and "ubiX_Y").
+static const char *UBI_CTRL = "/dev/ubi_ctrl";
+static const char *UBI_SYSFS = "/sys/class/ubi";
+
+// Utility function(s).
+static int OpenNode(const char *name, int flags);
+static bool ReadNumber(const char *name, const char *attribute, long long &value);
+
+// ============================================================================
+// Attaches the MTD device, unless already attached.
+bool UBI::Attach(int mtd, int device) {
+    struct ubi_attach_req req;
+    int attached = GetMTD(device), fd;
+
+    if (attached == mtd)
+        return true;
+
+    if (attached >= 0) {
+        log << ERRR << "UBI device " << device << " is attached to MTD device "
+            << attached << "." << endl;
+        return false;
+    }
+
+    if ((fd = open(UBI_CTRL, O_RDONLY)) < 0) {
+        log << ERRR << "Unable to open " << UBI_CTRL << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.ubi_num = device;
+    req.mtd_num = mtd;
+
+    if (ioctl(fd, UBI_IOCATT, &req) < 0) {
+        log << ERRR << "Unable to attach MTD device " << mtd << " (errno = " << errno << ")." << endl;
+        close(fd);
+        return false;
+    }
+
+    log << INFO << "Attached MTD device " << mtd << " as UBI device " << device << "." << endl;
+    close(fd);
+    return true;
+}
+
+// Detaches the device, if attached.
+bool UBI::Detach(int device) {
+    int fd;
+    __s32 number = device;
+
+    if (GetMTD(device) < 0)
+        return true;
+
+    if ((fd = open(UBI_CTRL, O_RDONLY)) < 0) {
+        log << ERRR << "Unable to open " << UBI_CTRL << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    if (ioctl(fd, UBI_IOCDET, &number) < 0) {
+        log << ERRR << "Unable to detach UBI device " << device << " (errno = " << errno << ")." << endl;
+        close(fd);
+        return false;
+    }
+
+    log << INFO << "Detached UBI device " << device << "." << endl;
+    close(fd);
+    return true;
+}
+
+// Returns the MTD device the device is attached to.
+int UBI::GetMTD(int device) {
+    char name[32];
+    long long mtd;
+
+    sprintf(name, "ubi%d", device);
+    return ReadNumber(name, "mtd_num", mtd) ? (int)mtd : -1;
+}
+
+// Creates a dynamic volume.
+bool UBI::MakeVolume(int device, int volume, const char *name, long long bytes) {
+    struct ubi_mkvol_req req;
+    char node[32];
+    long long blocks, blockSize;
+    int fd;
+
+    sprintf(node, "ubi%d", device);
+
+    // The available space is that of the free eraseblocks.
+    if (bytes < 0) {
+        if (!ReadNumber(node, "avail_eraseblocks", blocks) ||
+                !ReadNumber(node, "eraseblock_size", blockSize))
+            return false;
+
+        bytes = blocks * blockSize;
+    }
+
+    if ((fd = OpenNode(node, O_RDONLY)) < 0)
+        return false;
+
+    memset(&req, 0, sizeof(req));
+    req.vol_id = volume;
+    req.alignment = 1;
+    req.bytes = bytes;
+    req.vol_type = UBI_DYNAMIC_VOLUME;
+    req.name_len = strlen(name);
+    strncpy(req.name, name, sizeof(req.name) - 1);
+
+    if (ioctl(fd, UBI_IOCMKVOL, &req) < 0) {
+        log << ERRR << "Unable to create UBI volume '" << name << "' (errno = " << errno << ")." << endl;
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    // Make sure the volume can be opened.
+    sprintf(node, "ubi%d_%d", device, volume);
+
+    if ((fd = OpenNode(node, O_RDONLY)) < 0)
+        return false;
+
+    log << INFO << "Created UBI volume '" << name << "' of " << bytes << " bytes." << endl;
+    close(fd);
+    return true;
+}
+
+// Removes a volume.
+bool UBI::RemoveVolume(int device, int volume) {
+    char node[32];
+    __s32 number = volume;
+    int fd;
+
+    sprintf(node, "ubi%d", device);
+
+    if ((fd = OpenNode(node, O_RDONLY)) < 0)
+        return false;
+
+    if (ioctl(fd, UBI_IOCRMVOL, &number) < 0) {
+        log << ERRR << "Unable to remove UBI volume " << volume << " (errno = " << errno << ")." << endl;
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+UBIVolume::UBIVolume() {
+    fd = device = volume = -1;
+}
+
+// Class destructor.
+UBIVolume::~UBIVolume() {
+    Close();
+}
+
+// Opens the character device of the volume.
+bool UBIVolume::Open(int device, int volume, int flags) {
+    char node[32];
+
+    Close();
+    sprintf(node, "ubi%d_%d", device, volume);
+
+    if ((fd = OpenNode(node, flags)) < 0)
+        return false;
+
+    this->device = device;
+    this->volume = volume;
+    return true;
+}
+
+// Closes the volume.
+void UBIVolume::Close() {
+    if (fd >= 0)
+        close(fd);
+
+    fd = device = volume = -1;
+}
+
+int UBIVolume::GetDescriptor() const {
+    return fd;
+}
+
+// Returns the size of the data of the volume.
+long long UBIVolume::GetDataSize() const {
+    char name[32];
+    long long value;
+
+    sprintf(name, "ubi%d_%d", device, volume);
+    return ReadNumber(name, "data_bytes", value) ? value : -1;
+}
+
+// Returns the size of the logical eraseblocks of the volume.
+long long UBIVolume::GetEraseblockSize() const {
+    char name[32];
+    long long value;
+
+    sprintf(name, "ubi%d_%d", device, volume);
+    return ReadNumber(name, "usable_eb_size", value) ? value : -1;
+}
+
+// Returns if a logical eraseblock is mapped.
+bool UBIVolume::IsMapped(int leb) const {
+    __s32 number = leb;
+    return fd < 0 || ioctl(fd, UBI_IOCEBISMAP, &number) != 0;
+}
+
+// Starts a volume update.
+bool UBIVolume::BeginUpdate(long long bytes) {
+    __s64 number = bytes;
+
+    if (ioctl(fd, UBI_IOCVOLUP, &number) < 0) {
+        log << ERRR << "Unable to start the update of UBI volume " << volume 
+            << " (errno = " << errno << ")." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Opens "/dev/<name>". The node is created from the "sysfs" device
+// numbers if missing (e.g. no "mdev").
+static int OpenNode(const char *name, int flags) {
+    string path = string("/dev/") + name;
+    char dev[32];
+    unsigned int major, minor;
+    FILE *fp;
+    int fd;
+
+    if ((fd = open(path.c_str(), flags)) >= 0 || errno != ENOENT)
+        goto done;
+
+    fp = fopen((string(UBI_SYSFS) + "/" + name + "/dev").c_str(), "r");
+
+    if (fp && fgets(dev, sizeof(dev), fp) && sscanf(dev, "%u:%u", &major, &minor) == 2 &&
+            mknod(path.c_str(), S_IFCHR | 0600, makedev(major, minor)) == 0)
+        fd = open(path.c_str(), flags);
+
+    if (fp)
+        fclose(fp);
+
+done:
+    if (fd < 0)
+        log << ERRR << "Unable to open " << path << " (errno = " << errno << ")." << endl;
+
+    return fd;
+}
+
+// Reads a numeric attribute of a UBI device or volume.
+static bool ReadNumber(const char *name, const char *attribute, long long &value) {
+    FILE *fp = fopen((string(UBI_SYSFS) + "/" + name + "/" + attribute).c_str(), "r");
+    bool success;
+
+    if (!fp)
+        return false;
+
+    success = (fscanf(fp, "%lld", &value) == 1);
+    fclose(fp);
+    return success;
+}
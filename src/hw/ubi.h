@@ -0,0 +1,63 @@
+/*
+ *  ubi.h:
+ *      - UBI device and volume control.
+ */
+#ifndef __UBI_H_
+#define __UBI_H_
+
+#include <fcntl.h>
+
+// UBI devices, controlled through the UBI ioctls of "/dev/ubi_ctrl" and
+// of the device nodes. Attaching a device scans the whole MTD device,
+// so a device stays attached for the rest of the session: Attach() does
+// nothing if it is already attached to the same MTD device. Detach() is
+// only needed before the MTD device is erased.
+class UBI {
+public:
+    static bool Attach(int mtd, int device);
+    static bool Detach(int device);
+
+    // Returns the MTD device the device is attached to, or -1.
+    static int GetMTD(int device);
+
+    // Creates a dynamic volume of "bytes" (or all the available space
+    // if -1) and waits for its device node.
+    static bool MakeVolume(int device, int volume, const char *name, long long bytes = -1);
+    static bool RemoveVolume(int device, int volume);
+};
+
+// A handle of a UBI volume (its character device), opened on an
+// attached device.
+class UBIVolume {
+private:
+    int fd;
+    int device;
+    int volume;
+
+public:
+    UBIVolume();
+    ~UBIVolume();
+
+    bool Open(int device, int volume, int flags = O_RDONLY);
+    void Close();
+
+    int GetDescriptor() const;
+
+    // Returns the size of the data of the volume, and of its logical
+    // eraseblocks (or -1).
+    long long GetDataSize() const;
+    long long GetEraseblockSize() const;
+
+    // Returns if a logical eraseblock is mapped to a physical one
+    // (unmapped ones read as 0xFF). Kernels without UBI_IOCEBISMAP
+    // report every block as mapped.
+    bool IsMapped(int leb) const;
+
+    // Starts replacing the contents of the volume with "bytes" bytes,
+    // which must then be written to the descriptor. All the logical
+    // eraseblocks are unmapped first, and those written with 0xFF only
+    // are left so.
+    bool BeginUpdate(long long bytes);
+};
+
+#endif  //  __UBI_H_
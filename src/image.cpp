@@ -0,0 +1,595 @@
+/*
+ *  image.cpp:
+ *      - Implementation of sparse partition images and "ext4"
+ *        used-block scanning.
+ */
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "include/log.h"
+#include "include/util.h"
+#include "include/image.h"
+
+using namespace std;
+
+// Magic bytes and version of the image header.
+static const char IMAGE_MAGIC[8] = { 'M', 'I', 'D', 'S', 'I', 'M', 'G', '\n' };
+static const unsigned int IMAGE_VERSION = 1;
+
+// Extents separated by free space smaller than this are merged, 
+// which keeps the reads sequential.
+static const off_t EXTENT_MERGE_GAP = 32 * 1024;
+
+// "ext4" superblock location, magic and feature flags.
+static const off_t EXT4_SUPERBLOCK_OFFSET = 1024;
+static const unsigned int EXT4_MAGIC = 0xEF53;
+static const unsigned int EXT4_INCOMPAT_META_BG = 0x10;
+static const unsigned int EXT4_INCOMPAT_64BIT = 0x80;
+static const unsigned int EXT4_RO_COMPAT_SPARSE_SUPER = 0x1;
+static const unsigned int EXT4_RO_COMPAT_GDT_CSUM = 0x10;
+static const unsigned int EXT4_RO_COMPAT_METADATA_CSUM = 0x400;
+static const unsigned int EXT4_BG_BLOCK_UNINIT = 0x2;
+
+// Utility function(s).
+static bool IsPowerOf(unsigned int value, unsigned int base);
+static void MarkUsed(vector<unsigned char> &used, unsigned long long start,
+    unsigned long long count);
+
+// ============================================================================
+// Class constructor.
+ImageWriter::ImageWriter() {
+    out = NULL;
+    size = position = remaining = 0;
+    dataBytes = 0;
+}
+
+// Writes the image header.
+bool ImageWriter::Init(OutStream &out, off_t size, unsigned int blockSize) {
+    unsigned char header[IMAGE_HEADER_SIZE];
+
+    this->out = &out;
+    this->size = size;
+    position = remaining = 0;
+    dataBytes = 0;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    PutLE32(header + 8, IMAGE_VERSION);
+    PutLE32(header + 12, blockSize);
+    PutLE64(header + 16, size);
+
+    return out.Write(header, sizeof(header));
+}
+
+// Starts a data record.
+bool ImageWriter::AddData(off_t offset, off_t length) {
+    ImageRecord record = { IMAGE_DATA, offset, length, 0 };
+
+    if (!WriteRecord(record))
+        return false;
+
+    remaining = length;
+    dataBytes += length;
+    return true;
+}
+
+// Adds a record of repeated data.
+bool ImageWriter::AddFill(off_t offset, off_t length, unsigned int fill) {
+    ImageRecord record = { IMAGE_FILL, offset, length, fill };
+    return WriteRecord(record);
+}
+
+// Writes the end record.
+bool ImageWriter::Finish() {
+    ImageRecord record = { IMAGE_END, size, 0, 0 };
+    return WriteRecord(record);
+}
+
+// Returns the number of bytes of data records.
+long long ImageWriter::GetDataBytes() const {
+    return dataBytes;
+}
+
+// Writes data of the current record.
+bool ImageWriter::Write(const void *buf, size_t len) {
+    if (!out || (off_t)len > remaining) {
+        log << ERRR << "Image data exceeds its record." << endl;
+        return false;
+    }
+
+    remaining -= len;
+    return out->Write(buf, len);
+}
+
+// Checks and writes a record header.
+bool ImageWriter::WriteRecord(const ImageRecord &record) {
+    unsigned char header[IMAGE_RECORD_SIZE];
+
+    if (!out || remaining != 0 || record.offset < position || 
+            record.length < 0 || record.offset + record.length > size) {
+        log << ERRR << "Invalid image record at " << (long long)record.offset << "." << endl;
+        return false;
+    }
+
+    PutLE32(header, record.type);
+    PutLE32(header + 4, record.fill);
+    PutLE64(header + 8, record.offset);
+    PutLE64(header + 16, record.length);
+
+    position = record.offset + record.length;
+    return out->Write(header, sizeof(header));
+}
+
+// ============================================================================
+// Class constructor.
+ImageReader::ImageReader() {
+    in = NULL;
+    size = position = remaining = 0;
+    blockSize = 0;
+    end = false;
+}
+
+// Reads and checks the image header.
+bool ImageReader::Init(InStream &in) {
+    unsigned char header[IMAGE_HEADER_SIZE];
+
+    this->in = &in;
+    position = remaining = 0;
+    end = false;
+
+    if (!ReadFully(in, header, sizeof(header)))
+        return false;
+
+    if (memcmp(header, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))) {
+        log << ERRR << "Not a partition image." << endl;
+        return false;
+    }
+
+    if (GetLE32(header + 8) > IMAGE_VERSION) {
+        log << ERRR << "Unsupported partition image version." << endl;
+        return false;
+    }
+
+    blockSize = GetLE32(header + 12);
+    size = GetLE64(header + 16);
+    return true;
+}
+
+// Returns the size of the image.
+off_t ImageReader::GetSize() const {
+    return size;
+}
+
+// Returns the block size of the imaged filesystem (or device).
+unsigned int ImageReader::GetBlockSize() const {
+    return blockSize;
+}
+
+// Reads the next record header.
+bool ImageReader::Next(ImageRecord &record) {
+    unsigned char header[IMAGE_RECORD_SIZE];
+    char skip[4096];
+
+    if (!in || end)
+        return false;
+
+    while (remaining > 0) {
+        ssize_t ret = Read(skip, min(off_t(sizeof(skip)), remaining));
+
+        if (ret <= 0)
+            return false;
+    }
+
+    if (!ReadFully(*in, header, sizeof(header)))
+        return false;
+
+    record.type = (ImageRecordType)GetLE32(header);
+    record.fill = GetLE32(header + 4);
+    record.offset = GetLE64(header + 8);
+    record.length = GetLE64(header + 16);
+
+    if (record.type == IMAGE_END) {
+        end = true;
+        return false;
+    }
+
+    if ((record.type != IMAGE_DATA && record.type != IMAGE_FILL) ||
+            record.offset < position || record.length < 0 ||
+            record.offset + record.length > size) {
+        log << ERRR << "Corrupt partition image." << endl;
+        return false;
+    }
+
+    position = record.offset + record.length;
+    remaining = (record.type == IMAGE_DATA) ? record.length : 0;
+    return true;
+}
+
+// Returns if the end record was read.
+bool ImageReader::IsEnd() const {
+    return end;
+}
+
+// Reads data of the current record.
+ssize_t ImageReader::Read(void *buf, size_t len) {
+    if (!in)
+        return -1;
+
+    if ((off_t)len > remaining)
+        len = remaining;
+
+    if (len == 0)
+        return 0;
+
+    ssize_t ret = in->Read(buf, len);
+
+    if (ret == 0) {
+        log << ERRR << "Unexpected end of partition image." << endl;
+        return -1;
+    }
+
+    if (ret > 0)
+        remaining -= ret;
+
+    return ret;
+}
+
+// ============================================================================
+// Class constructor.
+SparseOutStream::SparseOutStream() {
+    buffer = NULL;
+    dataLen = blockLen = 0;
+    position = fillLength = 0;
+    fill = 0;
+}
+
+// Class destructor.
+SparseOutStream::~SparseOutStream() {
+    free(buffer);
+}
+
+// Writes the image header.
+bool SparseOutStream::Init(OutStream &out, off_t size) {
+    if (!buffer && !(buffer = (char *)malloc(IMAGE_RUN_SIZE + IMAGE_SCAN_SIZE))) {
+        log << ERRR << "Out of memory." << endl;
+        return false;
+    }
+
+    dataLen = blockLen = 0;
+    position = fillLength = 0;
+    return image.Init(out, size, IMAGE_SCAN_SIZE);
+}
+
+// Adds the last (partial) block and writes the pending records and
+// the end record.
+bool SparseOutStream::Finish() {
+    if (blockLen && !AddBlock())
+        return false;
+
+    return FlushFill() && FlushData() && image.Finish();
+}
+
+// Returns the number of bytes written.
+long long SparseOutStream::GetByteCount() const {
+    return position;
+}
+
+// Returns the number of bytes stored as data (not as fill records).
+long long SparseOutStream::GetDataBytes() const {
+    return image.GetDataBytes();
+}
+
+// Collects the data in blocks.
+bool SparseOutStream::Write(const void *buf, size_t len) {
+    const char *data = (const char *)buf;
+
+    if (!buffer)
+        return false;
+
+    while (len > 0) {
+        const size_t n = min(len, IMAGE_SCAN_SIZE - blockLen);
+
+        memcpy(buffer + dataLen + blockLen, data, n);
+        blockLen += n;
+        data += n;
+        len -= n;
+
+        if (blockLen == IMAGE_SCAN_SIZE && !AddBlock())
+            return false;
+    }
+
+    return true;
+}
+
+// Adds the current block to the pending fill run if it is uniform,
+// or to the pending data otherwise.
+bool SparseOutStream::AddBlock() {
+    unsigned int pattern;
+
+    if (IsUniform(buffer + dataLen, blockLen, pattern)) {
+        if (!FlushData() || (fillLength && pattern != fill && !FlushFill()))
+            return false;
+
+        fill = pattern;
+        fillLength += blockLen;
+    } else {
+        if (!FlushFill())
+            return false;
+
+        dataLen += blockLen;
+    }
+
+    position += blockLen;
+    blockLen = 0;
+
+    return dataLen < IMAGE_RUN_SIZE || FlushData();
+}
+
+// Writes the pending data as a data record.
+bool SparseOutStream::FlushData() {
+    if (!dataLen)
+        return true;
+
+    if (!image.AddData(position - dataLen, dataLen) || !image.Write(buffer, dataLen))
+        return false;
+
+    // The current block (if any) is moved to the start.
+    memmove(buffer, buffer + dataLen, blockLen);
+    dataLen = 0;
+    return true;
+}
+
+// Writes the pending repeated data as a fill record.
+bool SparseOutStream::FlushFill() {
+    if (!fillLength)
+        return true;
+
+    if (!image.AddFill(position - fillLength, fillLength, fill))
+        return false;
+
+    fillLength = 0;
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+SparseInStream::SparseInStream() {
+    sparse = false;
+    position = remaining = 0;
+    memset(&record, 0, sizeof(record));
+}
+
+// Detects the format of the stream and reads the image header.
+bool SparseInStream::Init(InStream &in) {
+    char magic[sizeof(IMAGE_MAGIC)];
+    ssize_t ret;
+
+    peek.Init(in);
+    position = remaining = 0;
+
+    if ((ret = peek.Peek(magic, sizeof(magic))) < 0)
+        return false;
+
+    sparse = (ret == sizeof(magic) && !memcmp(magic, IMAGE_MAGIC, sizeof(magic)));
+    return !sparse || image.Init(peek);
+}
+
+// Returns if the stream is a sparse image.
+bool SparseInStream::IsSparse() const {
+    return sparse;
+}
+
+// Reads the (expanded) data. The records of the image must cover the
+// data without gaps.
+ssize_t SparseInStream::Read(void *buf, size_t len) {
+    unsigned char *data = (unsigned char *)buf;
+    ssize_t ret;
+
+    if (!sparse)
+        return peek.Read(buf, len);
+
+    while (remaining == 0) {
+        if (!image.Next(record))
+            return image.IsEnd() ? 0 : -1;
+
+        if (record.offset != position) {
+            log << ERRR << "The partition image has a gap at " << (long long)position << "." << endl;
+            return -1;
+        }
+
+        remaining = record.length;
+    }
+
+    if ((off_t)len > remaining)
+        len = remaining;
+
+    if (record.type == IMAGE_DATA) {
+        if ((ret = image.Read(buf, len)) <= 0)
+            return -1;
+    } else {
+        const off_t start = position - record.offset;
+
+        for (size_t i = 0; i < len; i++)
+            data[i] = (record.fill >> (8 * ((start + i) % 4))) & 0xFF;
+
+        ret = len;
+    }
+
+    position += ret;
+    remaining -= ret;
+    return ret;
+}
+
+// ============================================================================
+// Compares a machine word at a time (four per iteration) against the
+// first one, falling back to memcmp() for unaligned buffers.
+bool IsUniform(const void *buf, size_t len, unsigned int &fill) {
+    const unsigned char *data = (const unsigned char *)buf;
+
+    if (len < 4 || len % 4)
+        return false;
+
+    fill = GetLE32(data);
+
+    if ((size_t)data % sizeof(unsigned long) || len % (4 * sizeof(unsigned long)))
+        return memcmp(data, data + 4, len - 4) == 0;
+
+    const unsigned long *words = (const unsigned long *)data;
+    const unsigned long first = words[0];
+    const size_t count = len / sizeof(unsigned long);
+
+    // A word holds the 32-bit pattern repeated.
+    if (memcmp(data, data + 4, sizeof(unsigned long) - 4))
+        return false;
+
+    for (size_t i = 0; i < count; i += 4)
+        if ((words[i] ^ first) | (words[i + 1] ^ first) | 
+                (words[i + 2] ^ first) | (words[i + 3] ^ first))
+            return false;
+
+    return true;
+}
+
+// ============================================================================
+// Reads the superblock and the group descriptors, and collects the
+// used blocks. Groups whose bitmap is not initialized only contain
+// the metadata (superblock backups and the bitmaps and inode tables
+// of any group), which is marked from the descriptors.
+bool Ext4GetUsedExtents(int fd, vector<ImageExtent> &extents,
+        off_t &size, unsigned int &blockSize) {
+
+    unsigned char sb[1024];
+
+    if (!ReadAt(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) || GetLE16(sb + 0x38) != EXT4_MAGIC) {
+        log << ERRR << "No 'ext2\\3\\4' filesystem found." << endl;
+        return false;
+    }
+
+    const unsigned int incompat = GetLE32(sb + 0x60);
+    const unsigned int roCompat = GetLE32(sb + 0x64);
+    const unsigned int firstDataBlock = GetLE32(sb + 0x14);
+    const unsigned int blocksPerGroup = GetLE32(sb + 0x20);
+    const unsigned int inodesPerGroup = GetLE32(sb + 0x28);
+    const unsigned int inodeSize = GetLE32(sb + 0x4C) ? GetLE16(sb + 0x58) : 128;
+    const unsigned int reservedGdt = GetLE16(sb + 0xCE);
+    unsigned int descSize = 32;
+    unsigned long long blocks = GetLE32(sb + 0x04);
+
+    blockSize = 1024 << GetLE32(sb + 0x18);
+
+    if (incompat & EXT4_INCOMPAT_64BIT) {
+        blocks |= (unsigned long long)GetLE32(sb + 0x150) << 32;
+        descSize = max(GetLE16(sb + 0xFE), 32u);
+    }
+
+    if ((incompat & EXT4_INCOMPAT_META_BG) || blockSize > 65536 ||
+            blocksPerGroup == 0 || blocksPerGroup > 8 * blockSize || 
+            blocks <= firstDataBlock || descSize > blockSize) {
+        log << ERRR << "Unsupported 'ext2\\3\\4' filesystem layout." << endl;
+        return false;
+    }
+
+    const bool uninitFlags = (roCompat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM)) != 0;
+    const unsigned long long groups = (blocks - firstDataBlock + blocksPerGroup - 1) / blocksPerGroup;
+    const unsigned long long gdtBlocks = (groups * descSize + blockSize - 1) / blockSize;
+    const unsigned long long tableBlocks = ((unsigned long long)inodesPerGroup * inodeSize + blockSize - 1) / blockSize;
+    vector<unsigned char> used((blocks + 7) / 8, 0);
+    vector<unsigned char> gdt(gdtBlocks * blockSize);
+    vector<unsigned char> bitmap(blockSize);
+
+    size = blocks * blockSize;
+
+    if (!ReadAt(fd, &gdt[0], gdt.size(), (off_t)(firstDataBlock + 1) * blockSize))
+        return false;
+
+    // The boot block (and the primary superblock).
+    MarkUsed(used, 0, firstDataBlock + 1);
+
+    for (unsigned long long g = 0; g < groups; g++) {
+        const unsigned char *desc = &gdt[g * descSize];
+        const unsigned long long start = firstDataBlock + g * blocksPerGroup;
+        const unsigned long long count = min((unsigned long long)blocksPerGroup, blocks - start);
+        unsigned long long blockBitmap = GetLE32(desc), inodeBitmap = GetLE32(desc + 4),
+            inodeTable = GetLE32(desc + 8);
+
+        if (descSize >= 64) {
+            blockBitmap |= (unsigned long long)GetLE32(desc + 0x20) << 32;
+            inodeBitmap |= (unsigned long long)GetLE32(desc + 0x24) << 32;
+            inodeTable |= (unsigned long long)GetLE32(desc + 0x28) << 32;
+        }
+
+        if (blockBitmap >= blocks || inodeBitmap >= blocks || inodeTable >= blocks) {
+            log << ERRR << "Corrupt 'ext2\\3\\4' group descriptor " << g << "." << endl;
+            return false;
+        }
+
+        MarkUsed(used, blockBitmap, 1);
+        MarkUsed(used, inodeBitmap, 1);
+        MarkUsed(used, inodeTable, tableBlocks);
+
+        if (uninitFlags && (GetLE16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)) {
+            // Superblock and descriptor backups (and reserved space).
+            if (g == 0 || g == 1 || !(roCompat & EXT4_RO_COMPAT_SPARSE_SUPER) ||
+                    IsPowerOf(g, 3) || IsPowerOf(g, 5) || IsPowerOf(g, 7))
+                MarkUsed(used, start, 1 + gdtBlocks + reservedGdt);
+
+            continue;
+        }
+
+        if (!ReadAt(fd, &bitmap[0], blockSize, (off_t)blockBitmap * blockSize))
+            return false;
+
+        for (unsigned long long i = 0; i < count; i++)
+            if (bitmap[i / 8] & (1 << (i % 8)))
+                used[(start + i) / 8] |= 1 << ((start + i) % 8);
+    }
+
+    // Collects the runs of used blocks.
+    extents.clear();
+
+    for (unsigned long long b = 0; b < blocks; ) {
+        if (!(used[b / 8] & (1 << (b % 8)))) {
+            b++;
+            continue;
+        }
+
+        unsigned long long e = b;
+
+        while (e < blocks && (used[e / 8] & (1 << (e % 8))))
+            e++;
+
+        ImageExtent extent = { (off_t)b * blockSize, (off_t)(e - b) * blockSize };
+
+        if (extents.size() && extent.offset - (extents.back().offset + 
+                extents.back().length) < EXTENT_MERGE_GAP)
+            extents.back().length = extent.offset + extent.length - extents.back().offset;
+        else
+            extents.push_back(extent);
+
+        b = e;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Returns if the value is a power of the base.
+static bool IsPowerOf(unsigned int value, unsigned int base) {
+    while (value > 1 && value % base == 0)
+        value /= base;
+
+    return value == 1;
+}
+
+// Marks a run of blocks as used (within the bitmap).
+static void MarkUsed(vector<unsigned char> &used, unsigned long long start,
+        unsigned long long count) {
+
+    unsigned long long end = min(start + count, (unsigned long long)used.size() * 8);
+
+    for (unsigned long long b = start; b < end; b++)
+        used[b / 8] |= 1 << (b % 8);
+}
@@ -0,0 +1,265 @@
+/*
+ *  archive.h:
+ *      - In-process "tar" and "gzip" engine.
+ */
+#ifndef __ARCHIVE_H_
+#define __ARCHIVE_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <sys/types.h>
+#include <zlib.h>
+#include "stream.h"
+
+// Size of a "tar" block.
+static const size_t TAR_BLOCK = 512;
+
+// Entry types (as stored in "tar" headers).
+static const char TAR_FILE = '0';
+static const char TAR_HARDLINK = '1';
+static const char TAR_SYMLINK = '2';
+static const char TAR_CHARDEV = '3';
+static const char TAR_BLOCKDEV = '4';
+static const char TAR_DIRECTORY = '5';
+static const char TAR_FIFO = '6';
+
+// Description of an archive entry. The path is relative to the
+// archive root (the root itself is "").
+struct ArchiveEntry {
+    std::string path;
+    std::string link;           // symlink target or hardlink source
+    char type;
+    mode_t mode;                // permission bits only
+    uid_t uid;
+    gid_t gid;
+    off_t size;                 // data size (regular files only)
+    time_t mtime;
+    unsigned int devMajor;
+    unsigned int devMinor;
+
+    ArchiveEntry();
+};
+
+// Receives progress notifications while archiving\extracting.
+class ArchiveProgress {
+public:
+    virtual ~ArchiveProgress() { }
+
+    // Called after each entry with the total bytes processed so far.
+    virtual void Update(const ArchiveEntry &entry, long long bytes) = 0;
+};
+
+class Manifest;
+class DeltaPatcher;
+
+// Fills a "ustar" header for the entry. Returns false if the entry
+// does not fit (long names are handled by TarWriter).
+bool TarMakeHeader(char *block, const ArchiveEntry &entry);
+
+// Parses a "ustar" header, verifying the checksum.
+bool TarParseHeader(const char *block, ArchiveEntry &entry);
+
+// Writes "gzip" data to another stream.
+class GzipOutStream : public OutStream {
+private:
+    z_stream strm;
+    OutStream *out;
+    char *buffer;
+    long long bytesIn;
+    bool init;
+
+    bool Deflate(int flush);
+
+public:
+    GzipOutStream();
+    virtual ~GzipOutStream();
+
+    bool Init(OutStream &out, int level = Z_DEFAULT_COMPRESSION);
+    bool Finish();
+    long long GetBytesIn() const;
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads "gzip" data (including concatenated members) from another
+// stream. If "autodetect" is set, data without the "gzip" magic is
+// passed through unchanged.
+class GzipInStream : public InStream {
+private:
+    z_stream strm;
+    InStream *in;
+    char *buffer;
+    bool init;
+    bool eof;
+    bool detected;
+    bool passthrough;
+    bool memberEnd;
+    bool autodetect;
+
+    bool Fill();
+
+public:
+    GzipInStream();
+    virtual ~GzipInStream();
+
+    bool Init(InStream &in, bool autodetect = true);
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Writes a "tar" archive to a stream.
+class TarWriter : public OutStream {
+private:
+    OutStream *out;
+    ArchiveProgress *progress;
+    Manifest *manifest;
+    const Manifest *parent;
+    std::map<std::pair<dev_t, ino_t>, std::string> links;
+    char *buffer;
+    off_t remaining;
+    off_t padding;
+    long long bytes;
+    long long entries;
+    long long storedBytes;
+    long long unchanged;
+
+    bool WriteLongName(char type, const std::string &name);
+    bool WritePadding(size_t len);
+    bool AddDirectory(const std::string &root, const std::string &path);
+
+public:
+    TarWriter();
+    virtual ~TarWriter();
+
+    void Init(OutStream &out, ArchiveProgress *progress = NULL);
+
+    // Records the files added by AddFile() in the manifest. If the
+    // manifest of a parent archive is given, files unchanged since
+    // (see ManifestEntry::Matches()) are only recorded, not archived.
+    void SetManifest(Manifest *manifest, const Manifest *parent = NULL);
+
+    // Writes an entry header. For regular files, exactly "size" bytes
+    // must be written with Write() afterwards.
+    bool AddEntry(const ArchiveEntry &entry);
+
+    // Adds the file (or directory, symlink, etc.) "root/path". The
+    // data of files that are not compressible (see ArchiveIsCompressible())
+    // is marked so for the output stream.
+    bool AddFile(const std::string &root, const std::string &path);
+
+    // Adds the entire directory tree (including the root itself).
+    bool AddTree(const char *root);
+
+    // Writes the end-of-archive marker.
+    bool Finish();
+
+    long long GetEntryCount() const;
+    long long GetByteCount() const;
+    long long GetStoredByteCount() const;
+    long long GetUnchangedCount() const;
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads a "tar" archive from a stream. The data of the current
+// entry is read through the InStream interface.
+class TarReader : public InStream {
+private:
+    InStream *in;
+    off_t remaining;
+    off_t padding;
+    bool end;
+
+    bool ReadBlock(char *block);
+    bool Skip(off_t len);
+    bool ReadString(std::string &out, off_t len, off_t max);
+
+public:
+    TarReader();
+
+    void Init(InStream &in);
+
+    // Moves to the next entry, skipping unread data. Returns false
+    // at the end of the archive (IsEnd() = true) or on error.
+    bool Next(ArchiveEntry &entry);
+    bool IsEnd() const;
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Creates the entries of a "tar" archive below a directory, setting
+// ownership, permissions and modification times.
+//
+// In update mode the existing files are kept where they match: files
+// of the same size and modification time are not written at all, and
+// files of the same size are compared with the data and only written
+// from where they differ. RemoveStale() then deletes the files that
+// are not in the archive.
+class TarExtractor {
+private:
+    std::string root;
+    std::vector<ArchiveEntry> directories;
+    std::set<std::string> paths;        // of the entries (update mode)
+    ArchiveProgress *progress;
+    DeltaPatcher *patcher;
+    char *buffer;
+    char *existing;
+    long long bytes;
+    long long entries;
+    long long unchanged;
+    long long removed;
+    bool update;
+
+    bool ExtractFile(const ArchiveEntry &entry, const std::string &path, InStream &data);
+    bool UpdateFile(const ArchiveEntry &entry, const std::string &path, InStream &data);
+    bool SetAttributes(const ArchiveEntry &entry, const std::string &path);
+    bool RemoveStale(const std::string &dir, const std::string &path);
+
+public:
+    TarExtractor();
+    ~TarExtractor();
+
+    void Init(const char *root, ArchiveProgress *progress = NULL);
+    void SetUpdate(bool update);
+
+    // Applies the entries that are deltas (see DELTA_EXTENSION) to the
+    // existing files with the patcher, instead of extracting them.
+    void SetDeltaPatcher(DeltaPatcher *patcher);
+
+    // Records an entry whose file is known to be up to date (e.g. by
+    // its checksum); only its attributes are set.
+    bool Keep(const ArchiveEntry &entry);
+
+    // Creates one entry. For regular files the data is read from
+    // "data" (exactly "entry.size" bytes).
+    bool Extract(const ArchiveEntry &entry, InStream &data);
+
+    // Extracts all entries of the archive.
+    bool ExtractAll(TarReader &reader);
+
+    // Applies the deferred directory attributes.
+    bool Finish();
+
+    // Deletes the files (and trees) that are not in the archive from
+    // the directories of the archive (update mode). Mountpoints and
+    // "lost+found" are kept.
+    bool RemoveStale();
+
+    long long GetEntryCount() const;
+    long long GetByteCount() const;
+    long long GetUnchangedCount() const;
+    long long GetRemovedCount() const;
+};
+
+// Returns false for file data that is not worth compressing: files
+// with the extension of a compressed format (e.g. ".apk", ".jpg") or
+// whose first block looks random (high byte entropy).
+bool ArchiveIsCompressible(const std::string &path, const void *head, size_t len);
+
+// Returns the clean relative form of an archive path or false if the
+// path escapes the archive root (e.g. contains "..").
+bool ArchiveCleanPath(std::string &path);
+
+#endif  //  __ARCHIVE_H_
@@ -0,0 +1,110 @@
+/*
+ *  chunkstore.h:
+ *      - Content-addressed chunk store for deduplicated backups.
+ */
+#ifndef __CHUNKSTORE_H_
+#define __CHUNKSTORE_H_
+
+#include <string>
+#include <set>
+#include <sys/types.h>
+#include "stream.h"
+#include "sha256.h"
+
+// Limits of the chunk sizes of content-defined chunking. The average
+// size is set by CHUNK_MASK (16 bits, ~64 KB above the minimum).
+static const size_t CHUNK_MIN_SIZE = 16 * 1024;
+static const size_t CHUNK_MAX_SIZE = 256 * 1024;
+static const unsigned int CHUNK_MASK = 0xffff;
+
+// Size of each chunk file header and of each recipe record.
+static const size_t CHUNK_HEADER_SIZE = 16;
+static const size_t CHUNK_RECORD_SIZE = SHA256_SIZE + 4;
+
+// Codec name of backup members holding recipes (see MFWMember).
+static const char *CHUNK_CODEC_NAME = "chunks";
+
+// A directory of chunks named by the SHA-256 digest of their data
+// ("ab/abcd..."). Each chunk is stored once, compressed with "zlib"
+// unless that does not make it smaller.
+class ChunkStore {
+private:
+    std::string root;
+    std::set<std::string> known;        // chunks known to be stored
+    int level;
+
+    std::string GetChunkPath(const std::string &hex) const;
+
+public:
+    ChunkStore();
+
+    // Opens (creating if needed) the store. The level is used for
+    // new chunks (0 = not compressed).
+    bool Open(const char *root, int level = 1);
+    const char *GetRoot() const;
+
+    bool Has(const unsigned char *digest);
+
+    // Stores a chunk unless already stored ("added" = false).
+    bool Put(const unsigned char *digest, const void *buf, size_t len, bool &added);
+
+    // Reads a chunk of "len" bytes, verifying its CRC32.
+    bool Get(const unsigned char *digest, void *buf, size_t len);
+};
+
+// Splits the data written into content-defined chunks (the cut points
+// depend on the data only, so unchanged data produces the same chunks
+// in every backup) and adds them to a store. The recipe (the list of
+// chunk digests and sizes) is written to the output stream.
+class ChunkOutStream : public OutStream {
+private:
+    ChunkStore *store;
+    OutStream *out;
+    char *buffer;
+    size_t fill;
+    unsigned int hash;
+    long long bytes;
+    long long chunks;
+    long long newChunks;
+    long long newBytes;
+
+    bool WriteChunk();
+
+public:
+    ChunkOutStream();
+    virtual ~ChunkOutStream();
+
+    bool Init(ChunkStore &store, OutStream &out);
+    bool Finish();
+
+    long long GetByteCount() const;
+    long long GetChunkCount() const;
+    long long GetNewChunkCount() const;
+    long long GetNewByteCount() const;
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads the data described by a recipe from a store.
+class ChunkInStream : public InStream {
+private:
+    ChunkStore *store;
+    InStream *in;
+    char *buffer;
+    size_t pos;
+    size_t len;
+    long long bytes;
+    bool end;
+
+    bool ReadChunk();
+
+public:
+    ChunkInStream();
+    virtual ~ChunkInStream();
+
+    bool Init(ChunkStore &store, InStream &in);
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+#endif  //  __CHUNKSTORE_H_
@@ -0,0 +1,83 @@
+/*
+ *  codec.h:
+ *      - Compression codecs of backup archives.
+ */
+#ifndef __CODEC_H_
+#define __CODEC_H_
+
+#include <string>
+#include "stream.h"
+#include "syscall.h"
+#include "archive.h"
+#include "pgzip.h"
+
+enum CodecType {
+    CODEC_NONE,
+    CODEC_LZO,
+    CODEC_GZIP,
+};
+
+// A compression codec (and level, for "gzip" only).
+struct Codec {
+    CodecType type;
+    int level;
+
+    Codec(CodecType type = CODEC_GZIP, int level = 6);
+};
+
+// Returns the name stored in backup metadata ("none", "lzo",
+// "gzip1" to "gzip9").
+std::string CodecGetName(const Codec &codec);
+
+// Parses a name returned by CodecGetName().
+bool CodecParseName(const std::string &name, Codec &codec);
+
+// Returns the extension of a "tar" archive compressed with the
+// codec (".tar", ".tar.lzo" or ".tgz"), or of other data ("", ".lzo"
+// or ".gz") if "archive" = false.
+const char *CodecGetExtension(const Codec &codec, bool archive = true);
+
+// Identifies the codec from the first bytes of the compressed data
+// (the "gzip" level is not detected).
+Codec CodecDetect(const void *head, size_t len);
+
+// Compresses the data with a codec and writes it to another stream.
+class CompressOutStream : public OutStream {
+private:
+    OutStream *out;
+    Codec codec;
+    ParallelGzipOutStream gzip;
+    CommandOutStream lzo;
+    bool init;
+
+public:
+    CompressOutStream();
+
+    bool Init(OutStream &out, const Codec &codec);
+    bool Finish();
+
+    virtual void SetCompressible(bool compressible);
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Decompresses the data of another stream, detecting the codec.
+class DecompressInStream : public InStream {
+private:
+    PeekInStream in;
+    Codec codec;
+    GzipInStream gzip;
+    CommandInStream lzo;
+    InStream *source;
+
+public:
+    DecompressInStream();
+
+    bool Init(InStream &in);
+    bool Finish();
+
+    const Codec &GetCodec() const;
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+#endif  //  __CODEC_H_
@@ -26,6 +26,10 @@ static const char *MOUNT_TMP = "/mnt/tmp";
 static const char *MOUNT_DATA_DALVIK = "/mnt/data/dalvik-cache";
 static const char *MOUNT_ROOT_SYSTEM = "/mnt/root/system";
 
+// The permission table a ROM may ship (see PermissionTable), applied
+// after the default one.
+static const char *PERMS_ROM_TABLE = "/mnt/root/system/etc/fixperms.conf";
+
 static const char *FS_CACHE = "ext4";
 static const char *FS_DATA = "ext4";
 static const char *FS_SYSTEM = "ext4";
@@ -0,0 +1,66 @@
+/*
+ *  delta.h:
+ *      - Binary delta patches of installed files.
+ */
+#ifndef __DELTA_H_
+#define __DELTA_H_
+
+#include <string>
+#include <sys/types.h>
+#include "stream.h"
+#include "sha256.h"
+
+// Extension of the patch entries holding a delta of the file named
+// without it (e.g. "system/app/Foo.apk.delta").
+static const char DELTA_EXTENSION[] = ".delta";
+
+// Magic bytes of deltas.
+static const char DELTA_MAGIC[8] = { 'M', 'R', 'D', 'E', 'L', 'T', 'A', '1' };
+
+// Size of the header of a delta.
+static const size_t DELTA_HEADER_SIZE = 8 + 2 * (8 + SHA256_SIZE);
+
+// Applies deltas made by "mkdelta" (tools/mkdelta.cpp), which finds the
+// records as "bsdiff" does. A delta is stored as one uncompressed stream,
+// so that it is applied while read from the patch archive (which
+// compresses it):
+//
+//     "MRDELTA1"
+//     source size (8 bytes), source SHA-256 (32 bytes)
+//     target size (8 bytes), target SHA-256 (32 bytes)
+//
+// followed by records of three numbers (8 bytes each, little-endian
+// magnitude with the sign in the top bit, as "bsdiff" writes them):
+//
+//     add length, copy length, seek
+//
+// each followed by "add length" bytes that are added to the source
+// bytes at the position, and "copy length" bytes copied as is; the
+// position then moves by "seek". The records end with the target.
+//
+// The installed file must match the source digest, and is replaced
+// only once the result matches the target digest. A file that already
+// matches the target is left as is, so that a patch can be re-applied.
+class DeltaPatcher {
+private:
+    char *buffer;
+    char *source;
+    long long applied;
+    long long skipped;
+
+    bool Patch(int fd, off_t sourceSize, InStream &delta, off_t size,
+        OutStream &out, Sha256 &digest, off_t targetSize);
+
+public:
+    DeltaPatcher();
+    ~DeltaPatcher();
+
+    // Applies the delta ("size" bytes read from "delta") to the file,
+    // keeping its owner and mode and setting its modification time.
+    bool Apply(const std::string &path, InStream &delta, off_t size, time_t mtime);
+
+    long long GetAppliedCount() const;
+    long long GetSkippedCount() const;
+};
+
+#endif  //  __DELTA_H_
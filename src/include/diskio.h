@@ -0,0 +1,72 @@
+/*
+ *  diskio.h:
+ *      - Large-block copying between devices and streams.
+ */
+#ifndef __DISKIO_H_
+#define __DISKIO_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "stream.h"
+
+// Size of each of the two copy buffers.
+static const size_t DISK_BUFFER_SIZE = 1024 * 1024;
+
+// Alignment of buffers, offsets and lengths for O_DIRECT.
+static const size_t DISK_ALIGNMENT = 4096;
+static const size_t DISK_SECTOR_SIZE = 512;
+
+// Copies a range of a device (or file) to a stream or a stream to a
+// range of a device, with large aligned buffers. The copy is double
+// buffered: one buffer is read on a thread of its own while the other
+// is written. Optionally, the device is accessed with O_DIRECT (if the
+// offset is sector aligned), bypassing the page cache.
+class DiskDumper {
+private:
+    int fd;
+    bool writing;
+    bool direct;
+    off_t offset;                       // device position
+    off_t remaining;                    // bytes left to copy (or room)
+    InStream *in;
+    OutStream *out;
+
+    char *buffers[2];
+    size_t lengths[2];
+    bool full[2];
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    long long bytes;
+    long long milliseconds;
+
+    bool Open(const char *path, int flags, off_t offset, bool direct);
+    bool Fill(char *buf, size_t &len);
+    bool Drain(const char *buf, size_t len);
+    bool Run();
+    void Close();
+
+    static void *Producer(void *arg);
+
+public:
+    DiskDumper();
+    ~DiskDumper();
+
+    // Copies "length" bytes of the device at "offset" to the stream.
+    bool Read(const char *path, off_t offset, off_t length, OutStream &out,
+        bool direct = false);
+
+    // Copies the stream to the device at "offset". The stream must not
+    // be longer than "length" bytes.
+    bool Write(InStream &in, const char *path, off_t offset, off_t length,
+        bool direct = false);
+
+    long long GetByteCount() const;
+    long long GetMilliseconds() const;
+
+    // Returns the throughput of the last copy in KB/s.
+    long long GetThroughput() const;
+};
+
+#endif  //  __DISKIO_H_
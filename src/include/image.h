@@ -0,0 +1,164 @@
+/*
+ *  image.h:
+ *      - Sparse partition images and "ext4" used-block scanning.
+ */
+#ifndef __IMAGE_H_
+#define __IMAGE_H_
+
+#include <vector>
+#include <sys/types.h>
+#include "stream.h"
+
+// Size of the image header and of each record header.
+static const size_t IMAGE_HEADER_SIZE = 32;
+static const size_t IMAGE_RECORD_SIZE = 24;
+
+// Granularity of the uniform runs found by SparseOutStream, and the
+// largest data record it writes.
+static const size_t IMAGE_SCAN_SIZE = 4096;
+static const size_t IMAGE_RUN_SIZE = 256 * 1024;
+
+// Record types. The bytes of the image not covered by any record
+// are not used (e.g. free filesystem blocks) and are not restored.
+enum ImageRecordType {
+    IMAGE_DATA = 1,             // data follows the record
+    IMAGE_FILL = 2,             // repeated 32-bit pattern
+    IMAGE_END = 3,
+};
+
+// A run of bytes of the image.
+struct ImageExtent {
+    off_t offset;
+    off_t length;
+};
+
+// A record of the image.
+struct ImageRecord {
+    ImageRecordType type;
+    off_t offset;
+    off_t length;
+    unsigned int fill;
+};
+
+// Writes a sparse image to a stream. The records must be added in 
+// increasing order of offsets and must not overlap.
+class ImageWriter : public OutStream {
+private:
+    OutStream *out;
+    off_t size;
+    off_t position;             // end of the last record
+    off_t remaining;            // data still expected for the record
+    long long dataBytes;
+
+    bool WriteRecord(const ImageRecord &record);
+
+public:
+    ImageWriter();
+
+    bool Init(OutStream &out, off_t size, unsigned int blockSize);
+
+    // Starts a data record. Exactly "length" bytes must be written 
+    // with Write() afterwards.
+    bool AddData(off_t offset, off_t length);
+    bool AddFill(off_t offset, off_t length, unsigned int fill);
+
+    // Writes the end record.
+    bool Finish();
+
+    long long GetDataBytes() const;
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads a sparse image from a stream. The data of the current
+// (data) record is read through the InStream interface.
+class ImageReader : public InStream {
+private:
+    InStream *in;
+    off_t size;
+    unsigned int blockSize;
+    off_t position;
+    off_t remaining;
+    bool end;
+
+public:
+    ImageReader();
+
+    bool Init(InStream &in);
+
+    off_t GetSize() const;
+    unsigned int GetBlockSize() const;
+
+    // Moves to the next record, skipping unread data. Returns false
+    // at the end of the image (IsEnd() = true) or on error.
+    bool Next(ImageRecord &record);
+    bool IsEnd() const;
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Writes the data written as a sparse image of a device dump: blocks
+// of IMAGE_SCAN_SIZE bytes holding a repeated 32-bit pattern (e.g. the
+// erased 0xFF or zero padding of a partition) are stored as fill
+// records. Every byte written is covered by a record, so the data can
+// be read back as a whole with SparseInStream.
+class SparseOutStream : public OutStream {
+private:
+    ImageWriter image;
+    char *buffer;               // pending data, then the current block
+    size_t dataLen;
+    size_t blockLen;
+    off_t position;             // offset of the current block
+    off_t fillLength;           // pending repeated data
+    unsigned int fill;
+
+    bool AddBlock();
+    bool FlushData();
+    bool FlushFill();
+
+public:
+    SparseOutStream();
+    virtual ~SparseOutStream();
+
+    // Writes the image header. At most "size" bytes can be written.
+    bool Init(OutStream &out, off_t size);
+    bool Finish();
+
+    long long GetByteCount() const;
+    long long GetDataBytes() const;
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads a device dump that is either raw or a sparse image (detected
+// by its header), expanding the fill records of the latter.
+class SparseInStream : public InStream {
+private:
+    PeekInStream peek;
+    ImageReader image;
+    ImageRecord record;
+    bool sparse;
+    off_t position;
+    off_t remaining;            // bytes left of the current record
+
+public:
+    SparseInStream();
+
+    bool Init(InStream &in);
+    bool IsSparse() const;
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Returns if the buffer holds a repeated 32-bit pattern, and the
+// pattern (as stored by fill records).
+bool IsUniform(const void *buf, size_t len, unsigned int &fill);
+
+// Returns the allocated extents of the "ext4" (or "ext2\3") filesystem
+// on the (unmounted) device read from its block bitmaps, the size of
+// the filesystem and its block size. Returns false if the filesystem
+// is not supported.
+bool Ext4GetUsedExtents(int fd, std::vector<ImageExtent> &extents,
+    off_t &size, unsigned int &blockSize);
+
+#endif  //  __IMAGE_H_
@@ -0,0 +1,54 @@
+/*
+ *  manifest.h:
+ *      - Per-file manifests of backup archives.
+ */
+#ifndef __MANIFEST_H_
+#define __MANIFEST_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include "stream.h"
+#include "archive.h"
+
+// Description of an archived file: its attributes and the CRC32 of 
+// its data (regular files only).
+struct ManifestEntry {
+    ArchiveEntry entry;
+    unsigned long crc;
+
+    ManifestEntry();
+    ManifestEntry(const ArchiveEntry &entry, unsigned long crc);
+
+    // Returns if the file is unchanged (by type, attributes, size
+    // and modification time).
+    bool Matches(const ArchiveEntry &other) const;
+};
+
+// List of the files of an archive. It is stored as text, one line 
+// per file with tab-separated fields (path, type, mode, uid, gid,
+// size, mtime, crc and link target).
+class Manifest {
+private:
+    std::map<std::string, ManifestEntry> entries;
+
+public:
+    void Clear();
+    void Add(const ManifestEntry &entry);
+    const ManifestEntry *Find(const std::string &path) const;
+    size_t GetCount() const;
+
+    // Returns the paths (sorted) that are missing in the other
+    // manifest, i.e. were deleted since this one.
+    void GetMissing(const Manifest &other, std::vector<std::string> &paths) const;
+
+    bool Save(OutStream &out) const;
+    bool Load(InStream &in);
+};
+
+// Writes\reads a list of paths (one per line, escaped like the paths
+// of a manifest).
+bool SavePathList(const std::vector<std::string> &paths, OutStream &out);
+bool LoadPathList(std::vector<std::string> &paths, InStream &in);
+
+#endif  //  __MANIFEST_H_
@@ -0,0 +1,180 @@
+/*
+ *  mfw.h:
+ *      - MID recovery backup (*.mfw) container.
+ */
+#ifndef __MFW_H_
+#define __MFW_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "stream.h"
+#include "workers.h"
+
+// Versions of the container. Version 1 is a plain "tar" archive of
+// the partition backups. Version 2 is still a valid "tar" archive, but
+// adds an index member (MFW_INDEX_NAME) and a trailing block pointing
+// to it, so the contents can be listed and members read directly.
+//
+// The index is text: a header line "MFW <version> <root>", then one
+// line per member with space-separated fields (name, partition,
+// offset, size, uncompressed size, CRC32, codec, root, block size and
+// the comma-separated leaves), "-" standing for an empty field.
+static const int MFW_VERSION_TAR = 1;
+static const int MFW_VERSION_INDEXED = 2;
+static const char *MFW_INDEX_NAME = "mfw.index";
+
+// Size of the blocks of member data hashed separately (the leaves of
+// the hash tree recorded in the index).
+static const off_t MFW_HASH_BLOCK = 1024 * 1024;
+
+// Description of a member of the container.
+struct MFWMember {
+    std::string name;
+    std::string partition;      // source partition ("" if unknown)
+    off_t offset;               // offset of the data in the container
+    off_t size;                 // stored size
+    off_t usize;                // uncompressed size (0 if unknown)
+    unsigned long crc;          // CRC32 of the stored data (version 2)
+    std::string codec;          // compression codec ("" if unknown)
+    off_t blockSize;            // size of the hashed blocks (0 if none)
+    std::vector<unsigned long> leaves;  // CRC32 of each block
+    std::string root;           // SHA-256 of the leaves ("" if none)
+};
+
+// Receives progress notifications while verifying.
+class MFWProgress {
+public:
+    virtual ~MFWProgress() { }
+
+    // Called after each block with the bytes verified so far.
+    virtual void Update(off_t done, off_t total) = 0;
+};
+
+// Returns the root of the hash tree of a member: the SHA-256 digest
+// of its leaves (in hexadecimal).
+std::string MFWHashLeaves(const std::vector<unsigned long> &leaves);
+
+// Returns the root of the hash tree of the container: the SHA-256
+// digest of the roots of the members.
+std::string MFWHashMembers(const std::vector<MFWMember> &members);
+
+// Writes a backup container. The container is a plain "tar"
+// archive whose members are streamed in one pass: the header of
+// each member is written with a zero size and is patched once the
+// member is complete, so no temporary files are needed.
+class MFWWriter : public OutStream {
+private:
+    FileOutStream out;
+    std::string path;
+    std::vector<MFWMember> members;
+    MFWMember member;
+    unsigned char head[2];
+    unsigned char tail[4];
+    unsigned long leafCrc;
+    off_t leafSize;
+    off_t offset;
+    bool inMember;
+
+    void AddLeaf();
+
+    bool WriteHeader(const char *name, off_t size, off_t at);
+    bool WriteIndex();
+    bool WritePadding(size_t len);
+
+public:
+    MFWWriter();
+    virtual ~MFWWriter();
+
+    bool Open(const char *path);
+    bool BeginMember(const char *name, const char *partition = NULL,
+        const char *codec = NULL);
+    bool EndMember(off_t usize = -1);
+    bool Close();
+    void Abort();
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads a backup container. The members are listed from the index
+// (version 2) or by walking the "tar" headers (version 1). The data
+// of the current member is read through the InStream interface and
+// is verified against the index checksum when read completely.
+class MFWReader : public InStream {
+private:
+    FileInStream in;
+    std::vector<MFWMember> members;
+    std::string root;
+    int version;
+    int current;
+    off_t remaining;
+    unsigned long crc;
+
+    bool LoadIndex();
+    bool ScanHeaders();
+
+public:
+    MFWReader();
+
+    bool Open(const char *path);
+    void Close();
+
+    int GetVersion() const;
+    const char *GetRoot() const;
+    int GetMemberCount() const;
+    const MFWMember &GetMember(int i) const;
+    int FindMember(const char *name) const;
+
+    bool Rewind();
+    bool Next();
+    bool Select(int i);
+
+    bool IsEnd() const;
+    const char *GetMemberName() const;
+    off_t GetMemberSize() const;
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// A block of member data checked by a worker of MFWVerifier.
+struct MFWVerifyJob : public WorkerJob {
+    char *data;
+    size_t len;
+    int member;
+    size_t leaf;
+    unsigned long crc;
+};
+
+// Verifies the members of a version 2 container without extracting
+// them. The container is read sequentially in blocks, whose CRC32s are
+// computed on a pool of worker threads (one per online CPU) and are
+// checked against the hash tree in the index.
+class MFWVerifier {
+private:
+    std::vector<MFWMember> members;
+    std::vector<std::string> failed;
+
+    WorkerPool pool;
+    std::vector<MFWVerifyJob *> jobs;   // all jobs (ring)
+
+    // Running state of the member being checked.
+    std::vector<unsigned long> leaves;
+    unsigned long memberCrc;
+    bool memberFailed;
+
+    bool Start(int threads);
+    void Check(MFWVerifyJob *job);
+
+public:
+    MFWVerifier();
+    ~MFWVerifier();
+
+    // Returns false if the container could not be read. The members
+    // that failed the checks are listed by GetFailedMembers().
+    bool Verify(const char *path, MFWProgress *progress = NULL, int threads = 0);
+
+    const std::vector<std::string> &GetFailedMembers() const;
+    const std::vector<MFWMember> &GetMembers() const;
+};
+
+#endif  //  __MFW_H_
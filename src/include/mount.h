@@ -0,0 +1,68 @@
+/*
+ *  mount.h:
+ *      - Mounts shared by the operations of a session.
+ */
+#ifndef __MOUNT_H_
+#define __MOUNT_H_
+
+#include <string>
+#include <vector>
+
+// A mount as listed in "/proc/mounts".
+struct MountInfo {
+    std::string dev;
+    std::string mountpoint;
+    std::string fs;
+    bool readOnly;
+};
+
+// Mounts through mount(2), counting the references to each mountpoint.
+// An existing mount of the device is reused (remounted if the mode
+// differs and it is not in use), and a mount stays after its last
+// reference is released, so that chained operations do not mount and
+// unmount (and replay journals) again. Our mounts are unmounted when
+// the session ends (UnmountAll()) or the device is needed unmounted.
+class MountManager {
+private:
+    struct Entry {
+        std::string dev;
+        std::string mountpoint;
+        int refs;
+        bool owned;             // mounted by us
+    };
+
+    std::vector<Entry> entries;
+
+    Entry *Find(const char *mountpoint);
+    bool DoUnmount(const char *mountpoint);
+
+public:
+    // Mounts the device (or reuses its mount) on the mountpoint. The
+    // "opts" are those of mount(8): "ro", "rw", flags like "noatime",
+    // and filesystem options. Without "fs", the filesystems of
+    // "/proc/filesystems" are tried.
+    bool Acquire(const char *dev, const char *mountpoint, const char *fs = NULL,
+        const char *opts = NULL);
+
+    // Drops a reference, syncing the filesystem if it was the last.
+    void Release(const char *mountpoint);
+
+    // Unmounts now (lazily if busy). Fails if the mount is in use.
+    bool Unmount(const char *mountpoint);
+
+    // Unmounts the device wherever it is mounted.
+    bool UnmountDevice(const char *dev);
+
+    // Unmounts all our mounts, in the reverse order.
+    bool UnmountAll();
+
+    // Returns if the device is mounted (anywhere).
+    bool IsMounted(const char *dev) const;
+};
+
+// Reads "/proc/mounts".
+bool ReadMounts(std::vector<MountInfo> &mounts);
+
+extern MountManager gMounts;
+
+#endif  //  __MOUNT_H_
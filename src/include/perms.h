@@ -0,0 +1,81 @@
+/*
+ *  perms.h:
+ *      - Permission tables of ROMs.
+ */
+#ifndef __PERMS_H_
+#define __PERMS_H_
+
+#include <string>
+#include <vector>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Sets the owner and mode of a file, or (if recursive) of a tree. The
+// directories get "dirMode" and the regular files "fileMode"; other
+// files only get the owner, unless the rule is for that file alone.
+// A mode of -1 is left unchanged.
+struct PermRule {
+    std::string path;           // below the root, even if absolute
+    uid_t uid;
+    gid_t gid;
+    int dirMode;
+    int fileMode;
+    bool recursive;
+};
+
+// Rules applied in one walk of the trees, as if applied in order: the
+// last rule matching a file wins. The rules are those of the shell
+// functions of ROM updater scripts:
+//
+//     set_perm <uid> <gid> <mode> <path>
+//     set_perm_recursive <uid> <gid> <dir mode> <file mode> <path>
+//
+// Other lines (and comments) of a table file are ignored, so that an
+// existing "fixperms.sh" can be used as is.
+class PermissionTable {
+private:
+    std::vector<PermRule> rules;
+    std::vector<std::string> paths;     // full paths of the rules
+    std::string root;                   // of "paths"
+    long long changed;
+    long long failed;
+
+    static PermissionTable *applying;
+
+    void Resolve(const char *root);
+    const PermRule *Match(const std::string &path, bool isDir) const;
+    static int GetMode(const PermRule &rule, mode_t type);
+
+    static int Visit(const char *path, const struct stat *st, int flag,
+        struct FTW *ftw);
+
+public:
+    PermissionTable();
+
+    void Clear();
+    void Add(const PermRule &rule);
+
+    // Adds the rules of Android (the defaults of the recovery).
+    void AddDefaults();
+
+    // Adds the rules of a table file. Returns false if it can not be
+    // read or has an invalid rule.
+    bool Load(const char *file);
+
+    size_t GetCount() const;
+
+    // Applies the rules under the root, in one walk of each tree. Only
+    // files that differ are changed.
+    bool Apply(const char *root);
+
+    long long GetChangedCount() const;
+
+    // Returns the owner and mode the rules give to the file "root/path"
+    // of the type (S_IFDIR, etc.), e.g. to create it with them. Returns
+    // false if no rule matches. The mode is -1 if left unchanged.
+    bool Lookup(const char *root, const std::string &path, mode_t type, uid_t &uid,
+        gid_t &gid, int &mode);
+};
+
+#endif  //  __PERMS_H_
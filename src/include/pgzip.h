@@ -0,0 +1,80 @@
+/*
+ *  pgzip.h:
+ *      - Block-parallel "gzip" compression.
+ */
+#ifndef __PGZIP_H_
+#define __PGZIP_H_
+
+#include <vector>
+#include <zlib.h>
+#include "stream.h"
+#include "workers.h"
+
+// Size of the input blocks compressed independently.
+static const size_t PGZIP_BLOCK_SIZE = 128 * 1024;
+
+// Size of the dictionary carried over from the previous block.
+static const size_t PGZIP_DICT_SIZE = 32 * 1024;
+
+// One block of input and its compressed output.
+struct PGzipJob : public WorkerJob {
+    char *in;
+    char *out;
+    size_t inLen;
+    size_t outLen;
+    size_t outSize;
+    size_t dictLen;
+    unsigned char dict[PGZIP_DICT_SIZE];
+    unsigned long crc;
+    int level;
+    bool last;
+    bool failed;
+};
+
+// Writes a single "gzip" member whose deflate data is produced by
+// compressing blocks of the input on a pool of worker threads (as
+// "pigz" does). Each block is primed with the last 32 KB of the
+// previous block and ends on a byte boundary (sync flush), so the
+// blocks are simply concatenated, and the CRCs are combined. The
+// output is decodable by any "gzip" implementation. The level may
+// change between blocks.
+class ParallelGzipOutStream : public OutStream {
+private:
+    OutStream *out;
+    int level;
+    int blockLevel;                     // level of the current block
+    bool init;
+
+    WorkerPool pool;
+    std::vector<PGzipJob *> jobs;       // all jobs (ring)
+    size_t next;                        // next free job
+    PGzipJob *current;                  // job being filled
+
+    unsigned char tail[PGZIP_DICT_SIZE];  // end of the last block
+    size_t tailLen;
+
+    unsigned long crc;
+    long long bytesIn;
+
+    bool Submit(bool last);
+    bool Drain(bool all);
+    void Stop();
+
+public:
+    ParallelGzipOutStream();
+    virtual ~ParallelGzipOutStream();
+
+    // Starts compressing to the stream. With "threads" = 0, one
+    // worker per online CPU is used.
+    bool Init(OutStream &out, int level = Z_DEFAULT_COMPRESSION, int threads = 0);
+    bool Finish();
+    long long GetBytesIn() const;
+
+    // Data that is not compressible is stored in blocks of its own
+    // (deflate level 0), which costs no CPU time.
+    virtual void SetCompressible(bool compressible);
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+#endif  //  __PGZIP_H_
@@ -0,0 +1,38 @@
+/*
+ *  sha256.h:
+ *      - SHA-256 message digest.
+ */
+#ifndef __SHA256_H_
+#define __SHA256_H_
+
+#include <string>
+#include <sys/types.h>
+
+// Size of a digest in bytes.
+static const size_t SHA256_SIZE = 32;
+
+// Computes the SHA-256 digest of data passed in any number of parts.
+class Sha256 {
+private:
+    unsigned int state[8];
+    unsigned char block[64];
+    size_t blockLen;
+    unsigned long long length;
+
+    void Transform(const unsigned char *data);
+
+public:
+    Sha256();
+
+    void Init();
+    void Update(const void *buf, size_t len);
+    void Final(unsigned char *digest);
+};
+
+// Computes the digest of a buffer.
+void Sha256Digest(const void *buf, size_t len, unsigned char *digest);
+
+// Returns the lowercase hexadecimal form of a digest.
+std::string Sha256ToHex(const unsigned char *digest);
+
+#endif  //  __SHA256_H_
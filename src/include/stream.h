@@ -0,0 +1,132 @@
+/*
+ *  stream.h:
+ *      - Byte stream interfaces used for backup creation\restoration.
+ */
+#ifndef __STREAM_H_
+#define __STREAM_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Size of the buffers used while copying between streams.
+static const size_t STREAM_BUFFER_SIZE = 256 * 1024;
+
+// Sink for a stream of bytes.
+class OutStream {
+public:
+    virtual ~OutStream() { }
+
+    // Writes all "len" bytes or returns false.
+    virtual bool Write(const void *buf, size_t len) = 0;
+
+    // Hints whether the following data is worth compressing (for
+    // compressing streams only).
+    virtual void SetCompressible(bool /* compressible */) { }
+};
+
+// Source of a stream of bytes.
+class InStream {
+public:
+    virtual ~InStream() { }
+
+    // Returns the number of bytes read, 0 at the end of
+    // the stream or -1 on error.
+    virtual ssize_t Read(void *buf, size_t len) = 0;
+};
+
+// Buffered output to a file descriptor.
+class FileOutStream : public OutStream {
+private:
+    int fd;
+    bool owner;
+    char *buffer;
+    size_t used;
+
+public:
+    FileOutStream();
+    virtual ~FileOutStream();
+
+    bool Open(const char *path);
+    void Attach(int fd);
+    bool Flush();
+    bool Close();
+
+    int GetDescriptor() const;
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Unbuffered input from a file descriptor.
+class FileInStream : public InStream {
+private:
+    int fd;
+    bool owner;
+
+public:
+    FileInStream();
+    virtual ~FileInStream();
+
+    bool Open(const char *path);
+    void Attach(int fd);
+    void Close();
+
+    int GetDescriptor() const;
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Output to a memory buffer of a fixed size.
+class BufferOutStream : public OutStream {
+private:
+    char *buffer;
+    size_t size;
+    size_t used;
+
+public:
+    BufferOutStream(void *buffer, size_t size);
+
+    size_t GetLength() const;
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Input from another stream whose first bytes can be examined
+// (e.g. to detect the format) before being read.
+class PeekInStream : public InStream {
+private:
+    InStream *in;
+    char head[16];
+    size_t headLen;
+    size_t headPos;
+    bool eof;
+    bool started;
+
+public:
+    PeekInStream();
+
+    void Init(InStream &in);
+
+    // Returns up to "len" (at most 16) bytes from the start of the
+    // stream without consuming them, or -1 on error. Must be called
+    // before the first Read().
+    ssize_t Peek(void *buf, size_t len);
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Copies the entire input to the output. Returns false on
+// any read or write error.
+bool CopyStream(InStream &in, OutStream &out);
+
+// Copies the entire contents of a "stdio" stream to the output.
+bool CopyStream(FILE *in, OutStream &out);
+
+// Copies the entire input to a "stdio" stream.
+bool CopyStream(InStream &in, FILE *out);
+
+// Reads exactly "len" bytes from the stream. Returns false on any
+// error or at the end of the stream.
+bool ReadFully(InStream &in, void *buf, size_t len);
+
+// Reads exactly "len" bytes of the file at the offset, without moving
+// its position. Returns false on any error or at the end of the file.
+bool ReadAt(int fd, void *buf, size_t len, off_t offset);
+
+#endif  //  __STREAM_H_
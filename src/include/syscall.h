@@ -5,7 +5,95 @@
 #ifndef __SYSCALL_H_
 #define __SYSCALL_H_
 
-int SysCall(const char *str, bool logOutput = true);
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "stream.h"
 
-#endif  //  __SYSCALL_H_
+// The size of the tail of the output of a command kept to be logged
+// on failure, and how often the progress is updated while it runs (in
+// milliseconds).
+#define SYSCALL_TAIL_SIZE       4096
+#define SYSCALL_POLL_INTERVAL   250
+
+// How the output of a command is logged.
+enum SysCallLog {
+    SYSCALL_LOG_TAIL,           // line count, and the tail on failure
+    SYSCALL_LOG_ALL             // all the output
+};
+
+// Receives the progress of a command while it runs.
+class SysCallProgress {
+public:
+    virtual ~SysCallProgress() { }
+
+    // Called every SYSCALL_POLL_INTERVAL ms at most, and when output
+    // arrives, with the lines of output so far.
+    virtual void Update(long long lines) = 0;
+};
+
+// Runs the command in a subshell of a shell started once for the
+// session, so that no command changes the state of the shell for the
+// later ones. Returns the exit status of the command.
+int SysCall(const char *str, SysCallLog output = SYSCALL_LOG_TAIL,
+    SysCallProgress *progress = NULL);
+
+// Starts the command with its standard output ("r") or standard
+// input ("w") connected to the returned pipe. Any other output is
+// appended to the log. Close with SysCallClose().
+FILE *SysCallOpen(const char *str, const char *mode);
+int SysCallClose(FILE *pipe);
+
+// Pipes the data written through a command (e.g. a compressor) to
+// another stream. The output of the command is copied by a thread.
+class CommandOutStream : public OutStream {
+private:
+    OutStream *out;
+    int fd;                     // standard input of the command
+    int outFd;                  // standard output of the command
+    pid_t pid;
+    pthread_t thread;
+    bool failed;
+
+    static void *Pump(void *arg);
+
+public:
+    CommandOutStream();
+    virtual ~CommandOutStream();
+
+    bool Open(const char *cmd, OutStream &out);
 
+    // Waits for the command and returns false if it (or writing
+    // its output) failed.
+    bool Close();
+
+    virtual bool Write(const void *buf, size_t len);
+};
+
+// Reads the output of a command (e.g. a decompressor) whose input
+// is copied from another stream by a thread.
+class CommandInStream : public InStream {
+private:
+    InStream *in;
+    int fd;                     // standard output of the command
+    int inFd;                   // standard input of the command
+    pid_t pid;
+    pthread_t thread;
+    bool failed;
+
+    static void *Pump(void *arg);
+
+public:
+    CommandInStream();
+    virtual ~CommandInStream();
+
+    bool Open(const char *cmd, InStream &in);
+
+    // Discards the remaining output, waits for the command and
+    // returns false if it (or reading its input) failed.
+    bool Close();
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+#endif  //  __SYSCALL_H_
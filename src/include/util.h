@@ -5,6 +5,7 @@
 #ifndef __UTIL_H_
 #define __UTIL_H_
 
+#include <string>
 #include <stdio.h>
 #include <sys/stat.h>
 
@@ -54,5 +55,37 @@ inline const char *NumberToString(int value) {
     return temp;
 }
 
+// Loads a little-endian 16-bit value.
+inline unsigned int GetLE16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+// Loads a little-endian 32-bit value.
+inline unsigned int GetLE32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Loads a little-endian 64-bit value.
+inline unsigned long long GetLE64(const unsigned char *p) {
+    return GetLE32(p) | ((unsigned long long)GetLE32(p + 4) << 32);
+}
+
+// Loads a big-endian 32-bit value.
+inline unsigned int GetBE32(const unsigned char *p) {
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Stores a little-endian 32-bit value.
+inline void PutLE32(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (value >> (8 * i)) & 0xFF;
+}
+
+// Stores a little-endian 64-bit value.
+inline void PutLE64(unsigned char *p, unsigned long long value) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (value >> (8 * i)) & 0xFF;
+}
+
 #endif  //  __UTIL_H_
 
@@ -0,0 +1,80 @@
+/*
+ *  workers.h:
+ *      - Pool of worker threads whose jobs are collected in order.
+ */
+#ifndef __WORKERS_H_
+#define __WORKERS_H_
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+// Upper limit for the number of worker threads.
+static const int WORKER_MAX_THREADS = 8;
+
+// A job run by a WorkerPool (the base of the jobs of its users).
+struct WorkerJob {
+    bool done;
+};
+
+// The work done by the threads of a WorkerPool. It is called from
+// several threads at once.
+class WorkerHandler {
+public:
+    virtual ~WorkerHandler() { }
+
+    // Returns the state of a thread (e.g. a compressor), used for all
+    // of its jobs, and releases it.
+    virtual void *StartWorker() { return NULL; }
+    virtual void StopWorker(void * /* state */) { }
+
+    // Runs a job with the state of the thread.
+    virtual void Run(WorkerJob *job, void *state) = 0;
+};
+
+// Runs jobs on a pool of worker threads. The jobs are collected in
+// the order they were submitted, so that their results can be used
+// in order while the workers keep running. With one thread, the jobs
+// are run as they are submitted.
+class WorkerPool {
+private:
+    WorkerHandler *handler;
+    int threads;
+    void *syncState;                    // used without workers
+    bool started;
+
+    std::vector<pthread_t> workers;
+    std::deque<WorkerJob *> pending;    // jobs waiting for a worker
+    std::deque<WorkerJob *> inFlight;   // jobs submitted, not collected
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t doneCond;
+    bool quit;
+
+    static void *Worker(void *arg);
+
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    // Starts the workers. With "threads" = 0, one worker per online
+    // CPU is used.
+    bool Start(WorkerHandler &handler, int threads = 0);
+    void Stop();
+
+    int GetThreadCount() const;
+
+    // Returns the number of jobs that keep the workers busy.
+    size_t GetJobCount() const;
+
+    // Returns the number of jobs submitted and not collected.
+    size_t GetInFlightCount() const;
+
+    void Submit(WorkerJob *job);
+
+    // Returns the oldest job in flight once it is done (waiting for it
+    // if "wait" is set), or NULL.
+    WorkerJob *Collect(bool wait);
+};
+
+#endif  //  __WORKERS_H_
@@ -0,0 +1,121 @@
+/*
+ *  zip.h:
+ *      - In-process "zip" extraction.
+ */
+#ifndef __ZIP_H_
+#define __ZIP_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <zlib.h>
+#include "stream.h"
+#include "archive.h"
+
+class PermissionTable;
+
+// Compression methods.
+static const unsigned int ZIP_STORED = 0;
+static const unsigned int ZIP_DEFLATED = 8;
+
+// Description of a "zip" entry, from the central directory.
+struct ZipEntry {
+    std::string path;
+    mode_t mode;                // file type and permission bits
+    unsigned int method;
+    unsigned long crc;
+    off_t compressedSize;
+    off_t size;
+    off_t offset;               // of the local header
+    time_t mtime;
+
+    ZipEntry();
+};
+
+// Reads the central directory of a "zip" file. Archives spanning
+// disks, encrypted entries and "zip64" archives are not supported.
+class ZipReader {
+private:
+    int fd;
+    std::vector<ZipEntry> entries;
+
+    bool ReadDirectory(off_t offset, off_t size, size_t count);
+
+public:
+    ZipReader();
+    ~ZipReader();
+
+    bool Open(const char *path);
+    void Close();
+
+    int GetDescriptor() const;
+    const std::vector<ZipEntry> &GetEntries() const;
+    const ZipEntry *Find(const std::string &path) const;
+};
+
+// Reads the (inflated) data of an entry, verifying its CRC32 at the
+// end.
+class ZipEntryInStream : public InStream {
+private:
+    z_stream strm;
+    int fd;
+    const ZipEntry *entry;
+    char *buffer;
+    off_t offset;               // of the compressed data left
+    off_t remaining;            // compressed bytes left
+    off_t left;                 // uncompressed bytes left
+    unsigned long crc;
+    bool init;
+
+    ssize_t Fill();
+
+public:
+    ZipEntryInStream();
+    virtual ~ZipEntryInStream();
+
+    bool Open(const ZipReader &zip, const ZipEntry &entry);
+    void Close();
+
+    virtual ssize_t Read(void *buf, size_t len);
+};
+
+// Extracts the entries of a "zip" file below a directory in the order
+// of their data in the file, so that it is read sequentially. The
+// owner and mode of the files are those given by the permission table
+// (if any), set as they are created; otherwise the mode is that of the
+// entry and the owner root.
+//
+// In update mode (see TarExtractor) files of the same size whose CRC32
+// matches that of the entry are kept without decompressing the entry.
+class ZipExtractor {
+private:
+    std::string root;
+    PermissionTable *table;
+    TarExtractor extractor;
+    ZipEntryInStream data;
+    bool update;
+
+    bool GetEntry(const ZipEntry &zipEntry, ArchiveEntry &entry);
+
+public:
+    ZipExtractor();
+
+    void Init(const char *root, PermissionTable *table = NULL,
+        ArchiveProgress *progress = NULL);
+    void SetUpdate(bool update);
+    void SetDeltaPatcher(DeltaPatcher *patcher);
+
+    // Extracts one entry.
+    bool Extract(const ZipReader &zip, const ZipEntry &entry);
+
+    // Extracts all entries, the directories (including those only
+    // implied by the paths of the files) first.
+    bool ExtractAll(const ZipReader &zip);
+
+    long long GetEntryCount() const;
+    long long GetByteCount() const;
+    long long GetUnchangedCount() const;
+    long long GetRemovedCount() const;
+};
+
+#endif  //  __ZIP_H_
@@ -21,7 +21,11 @@ bool Log::Init(const int argc, const char *argv[]) {
     else
         logPath = "log.txt";
     
+    // The log is truncated and then opened in append mode, so output
+    // appended by child processes (see SysCallOpen()) is not overwritten.
     log.open(logPath.c_str());
+    log.close();
+    log.open(logPath.c_str(), ios::app);
 
     if (!log.fail())
         if (argc != 1) {
@@ -5,6 +5,7 @@
 #include <iostream>
 #include "include/log.h"
 #include "include/config.h"
+#include "include/mount.h"
 #include "include/Window.h"
 #include "ui/Screens.h"
 
@@ -22,6 +23,8 @@ int main(const int argc, const char *argv[]) {
 
     w->Show();
 
+    gMounts.UnmountAll();
+
     ConfigDeInit();
 
     Log::Close();
@@ -0,0 +1,252 @@
+/*
+ *  manifest.cpp:
+ *      - Implementation of per-file manifests of backup archives.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "include/log.h"
+#include "include/manifest.h"
+
+using namespace std;
+
+// Header line of a manifest.
+static const char *MANIFEST_MAGIC = "MANIFEST 1";
+
+// Utility function(s).
+static string Escape(const string &str);
+static string Unescape(const string &str);
+static bool ReadAll(InStream &in, string &out);
+static void Split(const string &line, vector<string> &fields);
+
+// ============================================================================
+// Structure constructor.
+ManifestEntry::ManifestEntry() {
+    crc = 0;
+}
+
+// Structure constructor.
+ManifestEntry::ManifestEntry(const ArchiveEntry &entry, unsigned long crc) {
+    this->entry = entry;
+    this->crc = crc;
+}
+
+// Compares everything but the data.
+bool ManifestEntry::Matches(const ArchiveEntry &other) const {
+    return entry.type == other.type && entry.mode == other.mode &&
+        entry.uid == other.uid && entry.gid == other.gid &&
+        entry.size == other.size && entry.mtime == other.mtime &&
+        entry.link == other.link && entry.devMajor == other.devMajor &&
+        entry.devMinor == other.devMinor;
+}
+
+// ============================================================================
+// Removes all entries.
+void Manifest::Clear() {
+    entries.clear();
+}
+
+// Adds (or replaces) an entry.
+void Manifest::Add(const ManifestEntry &entry) {
+    entries[entry.entry.path] = entry;
+}
+
+// Returns the entry of the path or NULL.
+const ManifestEntry *Manifest::Find(const string &path) const {
+    map<string, ManifestEntry>::const_iterator it = entries.find(path);
+    return (it != entries.end()) ? &it->second : NULL;
+}
+
+// Returns the number of entries.
+size_t Manifest::GetCount() const {
+    return entries.size();
+}
+
+// Lists the paths not in the other manifest.
+void Manifest::GetMissing(const Manifest &other, vector<string> &paths) const {
+    paths.clear();
+
+    for (map<string, ManifestEntry>::const_iterator it = entries.begin(); 
+            it != entries.end(); ++it)
+        if (!other.Find(it->first))
+            paths.push_back(it->first);
+}
+
+// Writes the manifest as text.
+bool Manifest::Save(OutStream &out) const {
+    ostringstream text;
+
+    text << MANIFEST_MAGIC << "\n";
+
+    for (map<string, ManifestEntry>::const_iterator it = entries.begin(); 
+            it != entries.end(); ++it) {
+
+        const ArchiveEntry &e = it->second.entry;
+        char fields[160];
+
+        sprintf(fields, "\t%c\t%o\t%u\t%u\t%lld\t%ld\t%08lx\t%u\t%u\t", e.type, 
+            (unsigned int)e.mode, (unsigned int)e.uid, (unsigned int)e.gid, 
+            (long long)e.size, (long)e.mtime, it->second.crc, e.devMajor, e.devMinor);
+
+        text << Escape(e.path) << fields << Escape(e.link) << "\n";
+    }
+
+    const string data = text.str();
+    return out.Write(data.data(), data.length());
+}
+
+// Reads a manifest written by Save().
+bool Manifest::Load(InStream &in) {
+    string data, line;
+    vector<string> fields;
+
+    entries.clear();
+
+    if (!ReadAll(in, data))
+        return false;
+
+    istringstream text(data);
+
+    if (!getline(text, line) || line != MANIFEST_MAGIC) {
+        log << ERRR << "Not a backup manifest." << endl;
+        return false;
+    }
+
+    while (getline(text, line)) {
+        ManifestEntry m;
+        ArchiveEntry &e = m.entry;
+
+        Split(line, fields);
+
+        if (fields.size() != 11 || fields[1].length() != 1) {
+            log << ERRR << "Invalid backup manifest line: " << line << endl;
+            entries.clear();
+            return false;
+        }
+
+        e.path = Unescape(fields[0]);
+        e.type = fields[1][0];
+        e.mode = strtoul(fields[2].c_str(), NULL, 8);
+        e.uid = strtoul(fields[3].c_str(), NULL, 10);
+        e.gid = strtoul(fields[4].c_str(), NULL, 10);
+        e.size = strtoll(fields[5].c_str(), NULL, 10);
+        e.mtime = strtol(fields[6].c_str(), NULL, 10);
+        m.crc = strtoul(fields[7].c_str(), NULL, 16);
+        e.devMajor = strtoul(fields[8].c_str(), NULL, 10);
+        e.devMinor = strtoul(fields[9].c_str(), NULL, 10);
+        e.link = Unescape(fields[10]);
+
+        entries[e.path] = m;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Writes the paths, one per line.
+bool SavePathList(const vector<string> &paths, OutStream &out) {
+    string data;
+
+    for (size_t i = 0; i < paths.size(); i++)
+        data += Escape(paths[i]) + "\n";
+
+    return out.Write(data.data(), data.length());
+}
+
+// Reads the paths written by SavePathList().
+bool LoadPathList(vector<string> &paths, InStream &in) {
+    string data, line;
+
+    paths.clear();
+
+    if (!ReadAll(in, data))
+        return false;
+
+    istringstream text(data);
+
+    while (getline(text, line))
+        paths.push_back(Unescape(line));
+
+    return true;
+}
+
+// ============================================================================
+// Escapes backslashes, tabs and newlines.
+static string Escape(const string &str) {
+    string out;
+
+    for (size_t i = 0; i < str.length(); i++)
+        switch (str[i]) {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        default:
+            out += str[i];
+            break;
+        }
+
+    return out;
+}
+
+// Reverses Escape().
+static string Unescape(const string &str) {
+    string out;
+
+    for (size_t i = 0; i < str.length(); i++) {
+        if (str[i] != '\\' || i + 1 == str.length()) {
+            out += str[i];
+            continue;
+        }
+
+        switch (str[++i]) {
+        case 't':
+            out += '\t';
+            break;
+        case 'n':
+            out += '\n';
+            break;
+        default:
+            out += str[i];
+            break;
+        }
+    }
+
+    return out;
+}
+
+// Reads the entire stream.
+static bool ReadAll(InStream &in, string &out) {
+    char buffer[4096];
+    ssize_t ret;
+
+    out.resize(0);
+
+    while ((ret = in.Read(buffer, sizeof(buffer))) > 0)
+        out.append(buffer, ret);
+
+    return ret == 0;
+}
+
+// Splits a line at tabs.
+static void Split(const string &line, vector<string> &fields) {
+    size_t start = 0, tab;
+
+    fields.clear();
+
+    while ((tab = line.find('\t', start)) != string::npos) {
+        fields.push_back(line.substr(start, tab - start));
+        start = tab + 1;
+    }
+
+    fields.push_back(line.substr(start));
+}
@@ -0,0 +1,794 @@
+/*
+ *  mfw.cpp:
+ *      - Implementation of MID recovery backup (*.mfw) container.
+ */
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "include/log.h"
+#include "include/util.h"
+#include "include/archive.h"
+#include "include/sha256.h"
+#include "include/mfw.h"
+
+using namespace std;
+
+// Magic at the beginning of the trailing block of version 2.
+static const char *MFW_TRAILER_MAGIC = "MFWINDEX";
+
+// Maximum size of the index that is accepted.
+static const off_t MFW_INDEX_MAX = 1024 * 1024;
+
+// Maximum size of the hashed blocks.
+static const off_t MFW_HASH_BLOCK_MAX = 64 * 1024 * 1024;
+
+// Computes the CRC32s of the blocks checked by MFWVerifier.
+class MFWChecker : public WorkerHandler {
+public:
+    virtual void Run(WorkerJob *job, void *state);
+};
+
+static MFWChecker gChecker;
+
+// ============================================================================
+// Class constructor.
+MFWWriter::MFWWriter() {
+    offset = 0;
+    inMember = false;
+}
+
+// Class destructor. Deletes the archive if not closed.
+MFWWriter::~MFWWriter() {
+    if (path.length() != 0)
+        Abort();
+}
+
+// Creates the container.
+bool MFWWriter::Open(const char *path) {
+    if (!out.Open(path))
+        return false;
+
+    this->path = path;
+    members.clear();
+    offset = 0;
+    inMember = false;
+    return true;
+}
+
+// Starts a new member. Data written till EndMember() is stored in 
+// the member. The partition is recorded in the index.
+bool MFWWriter::BeginMember(const char *name, const char *partition,
+        const char *codec) {
+
+    if (inMember || path.length() == 0)
+        return false;
+
+    if (strlen(name) >= 100 || strchr(name, ' ') || 
+            (partition && strchr(partition, ' ')) || (codec && strchr(codec, ' '))) {
+        log << ERRR << "Invalid backup member name: " << name << endl;
+        return false;
+    }
+
+    // Header is written now and patched in EndMember().
+    if (!WriteHeader(name, 0, -1))
+        return false;
+
+    member.name = name;
+    member.partition = partition ? partition : "";
+    member.codec = codec ? codec : "";
+    member.offset = offset;
+    member.size = member.usize = 0;
+    member.crc = crc32(0, Z_NULL, 0);
+    member.blockSize = MFW_HASH_BLOCK;
+    member.leaves.clear();
+    member.root.resize(0);
+    leafCrc = crc32(0, Z_NULL, 0);
+    leafSize = 0;
+    memset(head, 0, sizeof(head));
+    memset(tail, 0, sizeof(tail));
+    inMember = true;
+    return true;
+}
+
+// Finishes the current member, padding the data and
+// patching the header with the actual size. The uncompressed
+// size may be given if the data itself does not tell.
+bool MFWWriter::EndMember(off_t usize) {
+    if (!inMember)
+        return false;
+
+    inMember = false;
+
+    if (member.size % TAR_BLOCK && !WritePadding(TAR_BLOCK - member.size % TAR_BLOCK))
+        return false;
+
+    if (!out.Flush())
+        return false;
+
+    if (leafSize > 0)
+        AddLeaf();
+
+    member.root = MFWHashLeaves(member.leaves);
+
+    if (!WriteHeader(member.name.c_str(), member.size, member.offset - TAR_BLOCK)) {
+        log << ERRR << "Unable to update header of backup member: "
+            << member.name << endl;
+        return false;
+    }
+
+    // For "gzip" data, the uncompressed size (modulo 4 GB) is
+    // stored in the last 4 bytes. Data of other codecs has no
+    // known size, and otherwise the data is raw.
+    if (usize >= 0)
+        member.usize = usize;
+    else if (member.size >= 18 && head[0] == 0x1f && head[1] == 0x8b)
+        member.usize = GetLE32(tail);
+    else if (member.codec.length() == 0 || member.codec == "none")
+        member.usize = member.size;
+
+    members.push_back(member);
+
+    log << INFO << "Added '" << member.name << "' (" << member.size
+        << " bytes) to backup." << endl;
+    return true;
+}
+
+// Writes the index, the end-of-archive marker and the trailing 
+// block, and closes the container.
+bool MFWWriter::Close() {
+    bool success = !inMember && WriteIndex();
+
+    success &= out.Close();
+    path.resize(0);
+    return success;
+}
+
+// Closes and deletes a partial container.
+void MFWWriter::Abort() {
+    out.Close();
+
+    if (path.length() != 0) {
+        log << INFO << "Deleting partial backup: " << path << endl;
+        unlink(path.c_str());
+    }
+
+    path.resize(0);
+    inMember = false;
+}
+
+// Writes data to the current member.
+bool MFWWriter::Write(const void *buf, size_t len) {
+    const unsigned char *data = (const unsigned char *)buf;
+
+    if (!inMember || !out.Write(buf, len))
+        return false;
+
+    // Remember the first 2 and the last 4 bytes.
+    for (size_t i = 0; i < len && member.size + i < 2; i++)
+        head[member.size + i] = data[i];
+
+    if (len >= 4) {
+        memcpy(tail, data + len - 4, 4);
+    } else {
+        memmove(tail, tail + len, 4 - len);
+        memcpy(tail + 4 - len, data, len);
+    }
+
+    member.size += len;
+    offset += len;
+
+    // Each block is a leaf of the hash tree. The CRC of the member is
+    // combined from the leaves.
+    while (len > 0) {
+        size_t count = len;
+
+        if ((off_t)count > member.blockSize - leafSize)
+            count = member.blockSize - leafSize;
+
+        leafCrc = crc32(leafCrc, data, count);
+        leafSize += count;
+        data += count;
+        len -= count;
+
+        if (leafSize == member.blockSize)
+            AddLeaf();
+    }
+
+    return true;
+}
+
+// Completes the current block of the member.
+void MFWWriter::AddLeaf() {
+    member.crc = crc32_combine(member.crc, leafCrc, leafSize);
+    member.leaves.push_back(leafCrc);
+    leafCrc = crc32(0, Z_NULL, 0);
+    leafSize = 0;
+}
+
+// Writes a header at the current offset ("at" = -1) or patches an 
+// existing header.
+bool MFWWriter::WriteHeader(const char *name, off_t size, off_t at) {
+    char block[TAR_BLOCK];
+    ArchiveEntry entry;
+
+    entry.path = name;
+    entry.size = size;
+    entry.mtime = time(0);
+    TarMakeHeader(block, entry);
+
+    if (at >= 0)
+        return pwrite(out.GetDescriptor(), block, TAR_BLOCK, at) == TAR_BLOCK;
+
+    if (!out.Write(block, TAR_BLOCK))
+        return false;
+
+    offset += TAR_BLOCK;
+    return true;
+}
+
+// Writes the index as the last member, followed by the end-of-archive
+// marker and the trailing block that points to the index.
+bool MFWWriter::WriteIndex() {
+    ostringstream index;
+    char block[TAR_BLOCK];
+
+    index << "MFW " << MFW_VERSION_INDEXED << ' ' << MFWHashMembers(members) << "\n";
+
+    for (size_t i = 0; i < members.size(); i++) {
+        const MFWMember &m = members[i];
+        char crc[16];
+        sprintf(crc, "%08lx", m.crc);
+
+        index << m.name << ' ' << (m.partition.length() ? m.partition : "-")
+            << ' ' << (long long)m.offset << ' ' << (long long)m.size
+            << ' ' << (long long)m.usize << ' ' << crc 
+            << ' ' << (m.codec.length() ? m.codec : "-")
+            << ' ' << m.root << ' ' << (long long)m.blockSize << ' ';
+
+        for (size_t j = 0; j < m.leaves.size(); j++) {
+            sprintf(crc, "%08lx", m.leaves[j]);
+            index << (j ? "," : "") << crc;
+        }
+
+        index << (m.leaves.size() ? "\n" : "-\n");
+    }
+
+    const string data = index.str();
+    const off_t indexOffset = offset + TAR_BLOCK;
+    const unsigned long indexCrc = crc32(crc32(0, Z_NULL, 0), 
+        (const Bytef *)data.data(), data.length());
+
+    if (!WriteHeader(MFW_INDEX_NAME, data.length(), -1) ||
+            !out.Write(data.data(), data.length()))
+        return false;
+
+    offset += data.length();
+
+    if (data.length() % TAR_BLOCK && !WritePadding(TAR_BLOCK - data.length() % TAR_BLOCK))
+        return false;
+
+    if (!WritePadding(2 * TAR_BLOCK))
+        return false;
+
+    // The trailing block is beyond the end-of-archive marker,
+    // so it is ignored by "tar".
+    memset(block, 0, TAR_BLOCK);
+    sprintf(block, "%s %d %lld %lld %08lx\n", MFW_TRAILER_MAGIC, MFW_VERSION_INDEXED,
+        (long long)indexOffset, (long long)data.length(), indexCrc);
+
+    if (!out.Write(block, TAR_BLOCK))
+        return false;
+
+    offset += TAR_BLOCK;
+    return true;
+}
+
+// Writes "len" zero bytes.
+bool MFWWriter::WritePadding(size_t len) {
+    char block[TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+
+    while (len > 0) {
+        size_t count = len < TAR_BLOCK ? len : TAR_BLOCK;
+
+        if (!out.Write(block, count))
+            return false;
+
+        offset += count;
+        len -= count;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+MFWReader::MFWReader() {
+    version = 0;
+    current = -1;
+    remaining = 0;
+    crc = 0;
+}
+
+// Opens the container and lists the members.
+bool MFWReader::Open(const char *path) {
+    Close();
+
+    if (!in.Open(path))
+        return false;
+
+    if (LoadIndex())
+        version = MFW_VERSION_INDEXED;
+    else if (ScanHeaders())
+        version = MFW_VERSION_TAR;
+    else
+        Close();
+
+    return version != 0;
+}
+
+// Closes the container.
+void MFWReader::Close() {
+    in.Close();
+    members.clear();
+    root.resize(0);
+    version = 0;
+    current = -1;
+    remaining = 0;
+}
+
+// Returns the container version (0 if not open).
+int MFWReader::GetVersion() const {
+    return version;
+}
+
+// Returns the root of the hash tree ("" if not recorded).
+const char *MFWReader::GetRoot() const {
+    return root.c_str();
+}
+
+// Returns the number of members.
+int MFWReader::GetMemberCount() const {
+    return members.size();
+}
+
+// Returns the description of a member.
+const MFWMember &MFWReader::GetMember(int i) const {
+    return members[i];
+}
+
+// Returns the index of the named member or -1.
+int MFWReader::FindMember(const char *name) const {
+    for (size_t i = 0; i < members.size(); i++)
+        if (members[i].name == name)
+            return i;
+
+    return -1;
+}
+
+// Positions the reader before the first member.
+bool MFWReader::Rewind() {
+    current = -1;
+    remaining = 0;
+    return version != 0;
+}
+
+// Moves to the next member. Returns false at the end of the 
+// archive (IsEnd() = true) or on error.
+bool MFWReader::Next() {
+    if (current >= GetMemberCount())
+        return false;
+
+    if (current + 1 == GetMemberCount()) {
+        current++;
+        remaining = 0;
+        return false;
+    }
+
+    return Select(current + 1);
+}
+
+// Moves directly to the given member.
+bool MFWReader::Select(int i) {
+    if (i < 0 || i >= GetMemberCount())
+        return false;
+
+    if (lseek(in.GetDescriptor(), members[i].offset, SEEK_SET) != members[i].offset) {
+        log << ERRR << "Unable to seek in backup archive." << endl;
+        return false;
+    }
+
+    current = i;
+    remaining = members[i].size;
+    crc = crc32(0, Z_NULL, 0);
+    return true;
+}
+
+// Returns if the end of the archive was reached.
+bool MFWReader::IsEnd() const {
+    return current >= GetMemberCount();
+}
+
+// Returns the name of the current member.
+const char *MFWReader::GetMemberName() const {
+    return members[current].name.c_str();
+}
+
+// Returns the size of the current member.
+off_t MFWReader::GetMemberSize() const {
+    return members[current].size;
+}
+
+// Reads data of the current member.
+ssize_t MFWReader::Read(void *buf, size_t len) {
+    if (remaining <= 0)
+        return 0;
+
+    if ((off_t)len > remaining)
+        len = remaining;
+
+    ssize_t ret = in.Read(buf, len);
+
+    if (ret == 0) {
+        log << ERRR << "Backup archive is truncated." << endl;
+        return -1;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    remaining -= ret;
+
+    // The checksum can be verified once all data is read.
+    if (version >= MFW_VERSION_INDEXED) {
+        crc = crc32(crc, (const Bytef *)buf, ret);
+
+        if (remaining == 0 && crc != members[current].crc) {
+            log << ERRR << "Checksum mismatch for backup member: " 
+                << members[current].name << endl;
+            return -1;
+        }
+    }
+
+    return ret;
+}
+
+// Reads the index of a version 2 container.
+bool MFWReader::LoadIndex() {
+    char block[TAR_BLOCK + 1];
+    char magic[16];
+    int ver;
+    long long indexOffset, indexSize;
+    unsigned long indexCrc;
+    off_t end = lseek(in.GetDescriptor(), 0, SEEK_END);
+
+    if (end < (off_t)TAR_BLOCK || !ReadAt(in.GetDescriptor(), block, TAR_BLOCK, end - TAR_BLOCK))
+        return false;
+
+    block[TAR_BLOCK] = '\0';
+
+    if (sscanf(block, "%15s %d %lld %lld %lx", magic, &ver, &indexOffset, 
+            &indexSize, &indexCrc) != 5 || strcmp(magic, MFW_TRAILER_MAGIC))
+        return false;
+
+    if (ver < MFW_VERSION_INDEXED || indexSize > MFW_INDEX_MAX ||
+            indexOffset + indexSize > end) {
+        log << WARN << "Unsupported backup index, reading as plain archive." << endl;
+        return false;
+    }
+
+    string data(indexSize, '\0');
+
+    if (!ReadAt(in.GetDescriptor(), &data[0], indexSize, indexOffset) ||
+            crc32(crc32(0, Z_NULL, 0), (const Bytef *)data.data(), indexSize) != indexCrc) {
+        log << WARN << "Corrupt backup index, reading as plain archive." << endl;
+        return false;
+    }
+
+    istringstream index(data);
+    string line;
+
+    members.clear();
+    getline(index, line);
+
+    istringstream header(line);
+    string word;
+
+    if (!(header >> word >> word >> root))
+        goto invalid;
+
+    while (getline(index, line)) {
+        MFWMember m;
+        long long offset, size, usize, blockSize;
+        string crcString, leaves;
+        istringstream fields(line);
+
+        if (!(fields >> m.name >> m.partition >> offset >> size >> usize >> crcString
+                >> m.codec >> m.root >> blockSize >> leaves) || blockSize <= 0)
+            goto invalid;
+
+        if (m.partition == "-")
+            m.partition.resize(0);
+
+        if (m.codec == "-")
+            m.codec.resize(0);
+
+        if (leaves != "-")
+            for (size_t i = 0; i < leaves.length(); i += 9)
+                m.leaves.push_back(strtoul(leaves.c_str() + i, NULL, 16));
+
+        if ((long long)m.leaves.size() != (size + blockSize - 1) / blockSize) {
+            log << WARN << "Invalid hash tree of backup member: " << m.name << endl;
+            goto invalid;
+        }
+
+        m.offset = offset;
+        m.size = size;
+        m.usize = usize;
+        m.crc = strtoul(crcString.c_str(), NULL, 16);
+        m.blockSize = blockSize;
+        members.push_back(m);
+    }
+
+    return true;
+
+invalid:
+    log << WARN << "Invalid backup index, reading as plain archive." << endl;
+    members.clear();
+    root.resize(0);
+    return false;
+}
+
+// Lists the members of a version 1 container by walking the 
+// "tar" headers (and seeking over the data).
+bool MFWReader::ScanHeaders() {
+    char block[TAR_BLOCK];
+    off_t offset = 0;
+
+    members.clear();
+
+    for (;;) {
+        MFWMember m;
+        ArchiveEntry entry;
+
+        // End of file is treated as end of archive.
+        if (!ReadAt(in.GetDescriptor(), block, TAR_BLOCK, offset))
+            return true;
+
+        // A zero block marks the end of archive.
+        if (block[0] == '\0')
+            return true;
+
+        if (!TarParseHeader(block, entry) || !ArchiveCleanPath(entry.path)) {
+            log << ERRR << "Invalid header in backup archive at offset "
+                << (long long)offset << "." << endl;
+            return false;
+        }
+
+        m.name = entry.path;
+        m.size = entry.size;
+        m.offset = offset + TAR_BLOCK;
+        m.usize = 0;
+        m.crc = 0;
+        m.blockSize = 0;
+        offset = m.offset + (m.size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+        // Only regular files carry data that is of interest.
+        if (entry.type == TAR_FILE && m.name != MFW_INDEX_NAME)
+            members.push_back(m);
+    }
+}
+
+// ============================================================================
+// Class constructor.
+MFWVerifier::MFWVerifier() {
+    memberCrc = 0;
+    memberFailed = false;
+}
+
+// Class destructor.
+MFWVerifier::~MFWVerifier() {
+    pool.Stop();
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        free(jobs[i]->data);
+        delete jobs[i];
+    }
+}
+
+// Verifies the container. Each block is checked against its leaf and
+// each member against its CRC and the root of its hash tree (members
+// of containers written before the hash tree only against the CRC).
+bool MFWVerifier::Verify(const char *path, MFWProgress *progress, int threads) {
+    MFWReader reader;
+    FileInStream in;
+    off_t blockSize = MFW_HASH_BLOCK, total = 0, done = 0;
+    size_t next = 0;
+    bool success = false;
+
+    members.clear();
+    failed.clear();
+
+    if (!reader.Open(path) || !in.Open(path))
+        return false;
+
+    if (reader.GetVersion() < MFW_VERSION_INDEXED) {
+        log << ERRR << "The backup has no index to verify against: " << path << endl;
+        return false;
+    }
+
+    for (int i = 0; i < reader.GetMemberCount(); i++) {
+        members.push_back(reader.GetMember(i));
+        total += members[i].size;
+
+        if (members[i].blockSize > blockSize)
+            blockSize = members[i].blockSize;
+    }
+
+    if (blockSize > MFW_HASH_BLOCK_MAX) {
+        log << ERRR << "Invalid hash block size in backup index." << endl;
+        return false;
+    }
+
+    // The index itself is protected by its CRC, the root only needs 
+    // to agree with it.
+    if (strlen(reader.GetRoot()) && MFWHashMembers(members) != reader.GetRoot())
+        failed.push_back(MFW_INDEX_NAME);
+
+    if (!Start(threads))
+        return false;
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i]->data = (char *)realloc(jobs[i]->data, blockSize);
+
+        if (!jobs[i]->data) {
+            log << ERRR << "Out of memory." << endl;
+            goto out;
+        }
+    }
+
+    for (size_t i = 0; i < members.size(); i++) {
+        const MFWMember &m = members[i];
+        const off_t size = m.blockSize ? m.blockSize : MFW_HASH_BLOCK;
+
+        leaves.clear();
+        memberCrc = crc32(0, Z_NULL, 0);
+        memberFailed = false;
+
+        for (off_t offset = 0; offset < m.size || pool.GetInFlightCount() > 0; ) {
+            // Check the oldest block once all jobs are in flight or 
+            // the member was read completely.
+            if (pool.GetInFlightCount() == jobs.size() || offset >= m.size) {
+                MFWVerifyJob *job = (MFWVerifyJob *)pool.Collect(true);
+
+                Check(job);
+
+                done += job->len;
+
+                if (progress)
+                    progress->Update(done, total);
+
+                continue;
+            }
+
+            MFWVerifyJob *job = jobs[next];
+
+            job->len = (m.size - offset < size) ? m.size - offset : size;
+            job->member = i;
+            job->leaf = offset / size;
+
+            if (!ReadAt(in.GetDescriptor(), job->data, job->len, m.offset + offset)) {
+                log << ERRR << "Unable to read backup member: " << m.name << endl;
+                goto out;
+            }
+
+            pool.Submit(job);
+            next = (next + 1) % jobs.size();
+            offset += job->len;
+        }
+
+        if (memberCrc != m.crc || (m.root.length() && MFWHashLeaves(leaves) != m.root))
+            memberFailed = true;
+
+        if (memberFailed) {
+            log << ERRR << "Verification failed for backup member: " << m.name << endl;
+            failed.push_back(m.name);
+        } else {
+            log << INFO << "Verified backup member: " << m.name << endl;
+        }
+    }
+
+    success = true;
+
+out:
+    pool.Stop();
+    return success;
+}
+
+// Returns the members that failed verification.
+const vector<string> &MFWVerifier::GetFailedMembers() const {
+    return failed;
+}
+
+// Returns the members of the verified container.
+const vector<MFWMember> &MFWVerifier::GetMembers() const {
+    return members;
+}
+
+// Starts the workers and creates a job for each block they check at
+// once. With one thread, the blocks are checked by the reading thread.
+bool MFWVerifier::Start(int threads) {
+    if (!pool.Start(gChecker, threads))
+        return false;
+
+    for (size_t i = jobs.size(); i < pool.GetJobCount(); i++) {
+        MFWVerifyJob *job = new MFWVerifyJob;
+        job->data = NULL;
+        jobs.push_back(job);
+    }
+
+    log << INFO << "Verifying with " << pool.GetThreadCount() << " thread(s)." << endl;
+    return true;
+}
+
+// Checks a block (in order) against its leaf, adding it to the 
+// running state of the member.
+void MFWVerifier::Check(MFWVerifyJob *job) {
+    const MFWMember &m = members[job->member];
+
+    if (job->leaf < m.leaves.size() && m.leaves[job->leaf] != job->crc) {
+        log << ERRR << "Block " << job->leaf << " of backup member '" << m.name 
+            << "' is corrupt." << endl;
+        memberFailed = true;
+    }
+
+    leaves.push_back(job->crc);
+    memberCrc = crc32_combine(memberCrc, job->crc, job->len);
+}
+
+// ============================================================================
+// Computes the CRC32 of a block.
+void MFWChecker::Run(WorkerJob *job, void * /* state */) {
+    MFWVerifyJob *block = (MFWVerifyJob *)job;
+    block->crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)block->data, block->len);
+}
+
+// ============================================================================
+// Returns the root of the hash tree of a member.
+string MFWHashLeaves(const vector<unsigned long> &leaves) {
+    unsigned char digest[SHA256_SIZE];
+    Sha256 sha;
+
+    for (size_t i = 0; i < leaves.size(); i++) {
+        const unsigned char leaf[4] = {
+            (unsigned char)(leaves[i] >> 24), (unsigned char)(leaves[i] >> 16),
+            (unsigned char)(leaves[i] >> 8), (unsigned char)leaves[i]
+        };
+
+        sha.Update(leaf, sizeof(leaf));
+    }
+
+    sha.Final(digest);
+    return Sha256ToHex(digest);
+}
+
+// Returns the root of the hash tree of the container.
+string MFWHashMembers(const vector<MFWMember> &members) {
+    unsigned char digest[SHA256_SIZE];
+    Sha256 sha;
+
+    for (size_t i = 0; i < members.size(); i++)
+        sha.Update(members[i].root.data(), members[i].root.length());
+
+    sha.Final(digest);
+    return Sha256ToHex(digest);
+}
+
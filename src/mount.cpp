@@ -0,0 +1,320 @@
+/*
+ *  mount.cpp:
+ *      - Implementation of the mounts shared by the operations of a
+ *        session.
+ */
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mount.h>
+
+#include "include/log.h"
+#include "include/mount.h"
+
+using namespace std;
+
+// Older headers lack the lazy unmount flag.
+#ifndef MNT_DETACH
+#define MNT_DETACH 2
+#endif
+
+MountManager gMounts;
+
+// Utility function(s).
+static bool FindMount(const char *mountpoint, MountInfo &info);
+static void ParseOptions(const char *opts, unsigned long &flags, string &data);
+static bool MountAny(const char *dev, const char *mountpoint, const char *fs,
+    unsigned long flags, const string &data);
+
+// ============================================================================
+// Mounts the device, or reuses its mount.
+bool MountManager::Acquire(const char *dev, const char *mountpoint, const char *fs,
+        const char *opts) {
+
+    unsigned long flags;
+    string data;
+    MountInfo info;
+    Entry *entry = Find(mountpoint);
+
+    ParseOptions(opts, flags, data);
+
+    if (FindMount(mountpoint, info)) {
+        if (info.dev != dev) {
+            log << ERRR << info.dev << " is mounted on " << mountpoint << "." << endl;
+            return false;
+        }
+
+        // A read-write mount in use also serves readers.
+        if (info.readOnly != ((flags & MS_RDONLY) != 0) && !(entry && entry->refs && !info.readOnly)) {
+            log << CMMD << "mount -o remount," << ((flags & MS_RDONLY) ? "ro " : "rw ") << mountpoint << endl;
+
+            if (mount(dev, mountpoint, info.fs.c_str(), flags | MS_REMOUNT, data.c_str()) != 0) {
+                log << ERRR << "Unable to remount " << mountpoint << ": " << strerror(errno) << endl;
+                return false;
+            }
+        }
+
+        if (!entry) {
+            Entry e = { dev, mountpoint, 0, false };
+            entries.push_back(e);
+            entry = &entries.back();
+        }
+    } else {
+        // The device may still be mounted (unused) elsewhere by us.
+        for (size_t i = entries.size(); i-- > 0; )
+            if (entries[i].dev == dev && entries[i].owned && entries[i].refs == 0)
+                Unmount(entries[i].mountpoint.c_str());
+
+        log << CMMD << "mount " << (fs ? fs : "auto") << " " << dev << " " << mountpoint
+            << " " << (opts ? opts : "") << endl;
+
+        if (!MountAny(dev, mountpoint, fs, flags, data))
+            return false;
+
+        if ((entry = Find(mountpoint)) == NULL) {
+            Entry e = { dev, mountpoint, 0, true };
+            entries.push_back(e);
+            entry = &entries.back();
+        }
+
+        entry->dev = dev;
+        entry->owned = true;
+        entry->refs = 0;
+    }
+
+    entry->refs++;
+    return true;
+}
+
+// Drops a reference.
+void MountManager::Release(const char *mountpoint) {
+    Entry *entry = Find(mountpoint);
+
+    if (!entry || entry->refs == 0) {
+        log << WARN << "Release of " << mountpoint << " without a reference." << endl;
+        return;
+    }
+
+    // The data must be on the device when we are done with it (the
+    // device may be reset before the session ends).
+    if (--entry->refs == 0)
+        sync();
+}
+
+// Unmounts now, after the mounts below the mountpoint.
+bool MountManager::Unmount(const char *mountpoint) {
+    const string prefix = string(mountpoint) + "/";
+    vector<MountInfo> mounts;
+    Entry *entry = Find(mountpoint);
+    MountInfo info;
+
+    if (entry && entry->refs > 0) {
+        log << ERRR << mountpoint << " is in use." << endl;
+        return false;
+    }
+
+    ReadMounts(mounts);
+
+    for (size_t i = mounts.size(); i-- > 0; )
+        if (mounts[i].mountpoint.compare(0, prefix.length(), prefix) == 0 &&
+                !Unmount(mounts[i].mountpoint.c_str()))
+            return false;
+
+    if (FindMount(mountpoint, info) && !DoUnmount(mountpoint))
+        return false;
+
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].mountpoint == mountpoint) {
+            entries.erase(entries.begin() + i);
+            break;
+        }
+
+    return true;
+}
+
+// Unmounts the device wherever mounted.
+bool MountManager::UnmountDevice(const char *dev) {
+    vector<MountInfo> mounts;
+    bool success = true;
+
+    if (!ReadMounts(mounts))
+        return false;
+
+    // The last mount first (mounts may be stacked).
+    for (size_t i = mounts.size(); i-- > 0; )
+        if (mounts[i].dev == dev)
+            success &= Unmount(mounts[i].mountpoint.c_str());
+
+    return success;
+}
+
+// Unmounts all our mounts.
+bool MountManager::UnmountAll() {
+    bool success = true;
+
+    for (size_t i = entries.size(); i-- > 0; ) {
+        if (!entries[i].owned)
+            continue;
+
+        entries[i].refs = 0;
+        success &= Unmount(entries[i].mountpoint.c_str());
+    }
+
+    return success;
+}
+
+// Returns if the device is mounted.
+bool MountManager::IsMounted(const char *dev) const {
+    vector<MountInfo> mounts;
+
+    ReadMounts(mounts);
+
+    for (size_t i = 0; i < mounts.size(); i++)
+        if (mounts[i].dev == dev)
+            return true;
+
+    return false;
+}
+
+// Returns the entry of a mountpoint.
+MountManager::Entry *MountManager::Find(const char *mountpoint) {
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].mountpoint == mountpoint)
+            return &entries[i];
+
+    return NULL;
+}
+
+// Unmounts, and lazily unmounts if busy.
+bool MountManager::DoUnmount(const char *mountpoint) {
+    log << CMMD << "umount " << mountpoint << endl;
+
+    if (umount2(mountpoint, 0) == 0)
+        return true;
+
+    log << WARN << "Unable to unmount " << mountpoint << ": " << strerror(errno)
+        << ", unmounting lazily." << endl;
+
+    if (umount2(mountpoint, MNT_DETACH) != 0) {
+        log << ERRR << "Unable to unmount " << mountpoint << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Reads "/proc/mounts".
+bool ReadMounts(vector<MountInfo> &mounts) {
+    ifstream in("/proc/mounts");
+    string line;
+
+    mounts.clear();
+
+    if (!in) {
+        log << ERRR << "Unable to read /proc/mounts." << endl;
+        return false;
+    }
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        MountInfo info;
+        string opts;
+
+        if (!(fields >> info.dev >> info.mountpoint >> info.fs >> opts))
+            continue;
+
+        info.readOnly = (opts == "ro" || opts.compare(0, 3, "ro,") == 0);
+        mounts.push_back(info);
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Finds the (topmost) mount on the mountpoint.
+static bool FindMount(const char *mountpoint, MountInfo &info) {
+    vector<MountInfo> mounts;
+    bool found = false;
+
+    ReadMounts(mounts);
+
+    for (size_t i = 0; i < mounts.size(); i++)
+        if (mounts[i].mountpoint == mountpoint) {
+            info = mounts[i];
+            found = true;
+        }
+
+    return found;
+}
+
+// Splits the options into mount flags and filesystem data.
+static void ParseOptions(const char *opts, unsigned long &flags, string &data) {
+    static const struct {
+        const char *name;
+        unsigned long set;
+        unsigned long clear;
+    } names[] = {
+        { "ro",         MS_RDONLY,      0 },
+        { "rw",         0,              MS_RDONLY },
+        { "nosuid",     MS_NOSUID,      0 },
+        { "nodev",      MS_NODEV,       0 },
+        { "noexec",     MS_NOEXEC,      0 },
+        { "sync",       MS_SYNCHRONOUS, 0 },
+        { "noatime",    MS_NOATIME,     0 },
+        { "nodiratime", MS_NODIRATIME,  0 },
+    };
+
+    istringstream in(opts ? opts : "");
+    string opt;
+
+    flags = 0;
+    data.clear();
+
+    while (getline(in, opt, ',')) {
+        size_t i;
+
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (opt == names[i].name) {
+                flags = (flags | names[i].set) & ~names[i].clear;
+                break;
+            }
+
+        if (i == sizeof(names) / sizeof(names[0]) && opt.length())
+            data += (data.length() ? "," : "") + opt;
+    }
+}
+
+// Mounts with the filesystem, or tries those of "/proc/filesystems"
+// (except the "nodev" ones) as mount(8) does.
+static bool MountAny(const char *dev, const char *mountpoint, const char *fs,
+        unsigned long flags, const string &data) {
+
+    ifstream in("/proc/filesystems");
+    string line;
+
+    if (fs) {
+        if (mount(dev, mountpoint, fs, flags, data.c_str()) == 0)
+            return true;
+
+        log << ERRR << "Unable to mount " << dev << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    while (getline(in, line)) {
+        if (line.compare(0, 5, "nodev") == 0 || line.length() < 2)
+            continue;
+
+        const string type = line.substr(line.find_first_not_of(" \t"));
+
+        if (mount(dev, mountpoint, type.c_str(), flags, data.c_str()) == 0)
+            return true;
+    }
+
+    log << ERRR << "Unable to mount " << dev << " (no filesystem found)." << endl;
+    return false;
+}
@@ -0,0 +1,346 @@
+/*
+ *  perms.cpp:
+ *      - Implementation of the permission tables of ROMs.
+ */
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "include/log.h"
+#include "include/perms.h"
+
+using namespace std;
+
+// The permissions of Android, as set by the updater scripts of ROMs
+// (the rules were those of "/scripts/fixperms.sh").
+static const struct {
+    const char *path;
+    uid_t uid;
+    gid_t gid;
+    int dirMode;
+    int fileMode;
+    bool recursive;
+} DEFAULT_RULES[] = {
+    { "system", 0, 0, 0755, 0644, true },
+    { "system/addon.d", 0, 0, 0755, 0755, true },
+    { "system/bin", 0, 2000, 0755, 0755, true },
+    { "system/bin/netcfg", 0, 3003, 02750, 02750, false },
+    { "system/bin/ping", 0, 3004, 02755, 02755, false },
+    { "system/bin/run-as", 0, 2000, 06750, 06750, false },
+    { "system/etc/bluetooth", 1002, 1002, 0755, 0440, true },
+    { "system/etc/bluetooth", 0, 0, 0755, 0755, false },
+    { "system/etc/bluetooth/auto_pairing.conf", 1000, 1000, 0640, 0640, false },
+    { "system/etc/bluetooth/bdaddr", 0, 0, 0644, 0644, false },
+    { "system/etc/bluetooth/blacklist.conf", 3002, 3002, 0444, 0444, false },
+    { "system/etc/dbus.conf", 1002, 1002, 0440, 0440, false },
+    { "system/etc/dhcpcd/dhcpcd-run-hooks", 1014, 2000, 0550, 0550, false },
+    { "system/etc/init.d", 0, 2000, 0755, 0755, true },
+    { "system/etc/init.d", 0, 0, 0755, 0755, false },
+    { "system/etc/init.goldfish.sh", 0, 2000, 0550, 0550, false },
+    { "system/etc/install-recovery.sh", 0, 0, 0544, 0544, false },
+    { "system/etc/ppp", 0, 0, 0755, 0555, true },
+    { "system/vendor", 0, 2000, 0755, 0755, false },
+    { "system/vendor/bin", 0, 2000, 0755, 0755, true },
+    { "system/vendor/etc", 0, 2000, 0755, 0644, true },
+    { "system/vendor/etc/audio_effects.conf", 0, 0, 0644, 0644, false },
+    { "system/vendor/lib", 0, 2000, 0755, 0755, false },
+    { "system/vendor/lib/drm", 0, 2000, 0755, 0644, true },
+    { "system/vendor/lib/drm/libdrmwvmplugin.so", 0, 0, 0644, 0644, false },
+    { "system/xbin", 0, 2000, 0755, 0755, true },
+    { "system/xbin/librank", 0, 0, 06755, 06755, false },
+    { "system/xbin/procmem", 0, 0, 06755, 06755, false },
+    { "system/xbin/procrank", 0, 0, 06755, 06755, false },
+    { "system/xbin/su", 0, 0, 06755, 06755, false },
+    { "system/bin/pppd", 0, 0, 04755, 04755, false },
+    { "system/etc/check_property.sh", 0, 0, 0755, 0755, false },
+    { "system/etc/reboot", 0, 0, 0755, 0755, false },
+    { "system/etc/insmod.sh", 0, 0, 0755, 0755, false },
+    { "system/etc/audio_sw.sh", 0, 0, 0755, 0755, false },
+    { "system/etc/apns-conf.xml", 0, 0, 0777, 0777, false },
+};
+
+PermissionTable *PermissionTable::applying = NULL;
+
+// Utility function(s).
+static bool ParseNumber(const string &str, int base, long &value);
+static bool IsInTree(const string &path, const string &tree);
+
+// ============================================================================
+// Class constructor.
+PermissionTable::PermissionTable() {
+    changed = failed = 0;
+}
+
+void PermissionTable::Clear() {
+    rules.clear();
+    paths.clear();
+}
+
+void PermissionTable::Add(const PermRule &rule) {
+    rules.push_back(rule);
+    paths.clear();
+}
+
+// Adds the default rules.
+void PermissionTable::AddDefaults() {
+    for (size_t i = 0; i < sizeof(DEFAULT_RULES) / sizeof(DEFAULT_RULES[0]); i++) {
+        PermRule rule;
+
+        rule.path = DEFAULT_RULES[i].path;
+        rule.uid = DEFAULT_RULES[i].uid;
+        rule.gid = DEFAULT_RULES[i].gid;
+        rule.dirMode = DEFAULT_RULES[i].dirMode;
+        rule.fileMode = DEFAULT_RULES[i].fileMode;
+        rule.recursive = DEFAULT_RULES[i].recursive;
+        Add(rule);
+    }
+}
+
+// Adds the rules of a table file.
+bool PermissionTable::Load(const char *file) {
+    ifstream in(file);
+    string line;
+    int number = 0;
+
+    if (!in) {
+        log << ERRR << "Unable to open " << file << "." << endl;
+        return false;
+    }
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string name, uid, gid, dirMode, fileMode, path;
+        long values[4];
+        PermRule rule;
+        bool valid;
+
+        number++;
+
+        if (!(fields >> name) || (name != "set_perm" && name != "set_perm_recursive"))
+            continue;
+
+        rule.recursive = (name == "set_perm_recursive");
+        fields >> uid >> gid >> dirMode;
+
+        if (rule.recursive)
+            fields >> fileMode;
+        else
+            fileMode = dirMode;
+
+        fields >> path;
+
+        // The path may be quoted.
+        if (path.length() >= 2 && path[0] == '"' && path[path.length() - 1] == '"')
+            path = path.substr(1, path.length() - 2);
+
+        valid = ParseNumber(uid, 10, values[0]) && ParseNumber(gid, 10, values[1]) &&
+            ParseNumber(dirMode, 8, values[2]) && ParseNumber(fileMode, 8, values[3]) &&
+            values[2] <= 07777 && values[3] <= 07777 && !path.empty();
+
+        if (!valid) {
+            log << ERRR << file << ":" << number << ": invalid rule." << endl;
+            return false;
+        }
+
+        rule.path = path;
+        rule.uid = values[0];
+        rule.gid = values[1];
+        rule.dirMode = values[2];
+        rule.fileMode = values[3];
+        Add(rule);
+    }
+
+    return true;
+}
+
+size_t PermissionTable::GetCount() const {
+    return rules.size();
+}
+
+// Applies the rules. Each tree (the path of a rule not under the path
+// of another one) is walked once.
+bool PermissionTable::Apply(const char *root) {
+    vector<string> trees, walked;
+
+    changed = failed = 0;
+
+    Resolve(root);
+    trees = paths;
+    sort(trees.begin(), trees.end());
+
+    applying = this;
+
+    for (size_t i = 0; i < trees.size(); i++) {
+        struct stat st;
+        bool subtree = false;
+
+        // Skip the duplicates and the subtrees of the trees walked (a
+        // tree sorts before its subtrees, but not always right before,
+        // e.g. "/x", "/x-y", "/x/z").
+        for (size_t j = 0; j < walked.size() && !subtree; j++)
+            subtree = IsInTree(trees[i], walked[j]);
+
+        if (subtree)
+            continue;
+
+        walked.push_back(trees[i]);
+
+        if (lstat(trees[i].c_str(), &st) != 0)
+            continue;
+
+        if (nftw(trees[i].c_str(), Visit, 32, FTW_PHYS) != 0) {
+            log << ERRR << "Unable to walk " << trees[i] << " (errno = " << errno << ")." << endl;
+            failed++;
+        }
+    }
+
+    applying = NULL;
+
+    log << (failed ? ERRR : INFO) << "Changed the permissions of " << changed << " file(s), "
+        << failed << " error(s)." << endl;
+    return failed == 0;
+}
+
+long long PermissionTable::GetChangedCount() const {
+    return changed;
+}
+
+// Returns the rule for the file.
+bool PermissionTable::Lookup(const char *root, const string &path, mode_t type, uid_t &uid,
+        gid_t &gid, int &mode) {
+
+    const PermRule *rule;
+
+    Resolve(root);
+
+    if ((rule = Match(string(root) + "/" + path, S_ISDIR(type))) == NULL)
+        return false;
+
+    uid = rule->uid;
+    gid = rule->gid;
+    mode = GetMode(*rule, type);
+    return true;
+}
+
+// Computes the full paths of the rules (again if added to). All paths
+// are below the root: absolute paths are those of the installed system
+// (e.g. "/system/xbin/su"), unless they already start with the root.
+void PermissionTable::Resolve(const char *root) {
+    if (this->root == root && paths.size() == rules.size())
+        return;
+
+    this->root = root;
+    paths.clear();
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        const string &path = rules[i].path;
+
+        if (path == this->root || path.compare(0, this->root.length() + 1, this->root + "/") == 0)
+            paths.push_back(path);
+        else
+            paths.push_back(this->root + (path[0] == '/' ? "" : "/") + path);
+    }
+}
+
+// Returns the last rule matching the file.
+const PermRule *PermissionTable::Match(const string &path, bool isDir) const {
+    for (size_t i = rules.size(); i-- > 0; ) {
+        const string &rulePath = paths[i];
+
+        if (path == rulePath) {
+            if (!rules[i].recursive || isDir)
+                return &rules[i];
+        } else if (rules[i].recursive && path.length() > rulePath.length() &&
+                path[rulePath.length()] == '/' && path.compare(0, rulePath.length(), rulePath) == 0) {
+            return &rules[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Applies the matching rule to a file of the walk.
+int PermissionTable::Visit(const char *path, const struct stat *st, int flag,
+        struct FTW * /* ftw */) {
+
+    PermissionTable *self = applying;
+    const PermRule *rule;
+    bool chowned = false;
+    int mode;
+
+    if (flag == FTW_NS) {
+        log << ERRR << "Unable to stat " << path << "." << endl;
+        self->failed++;
+        return 0;
+    }
+
+    if ((rule = self->Match(path, S_ISDIR(st->st_mode))) == NULL)
+        return 0;
+
+    mode = GetMode(*rule, st->st_mode);
+
+    if (st->st_uid != rule->uid || st->st_gid != rule->gid) {
+        if (fchownat(AT_FDCWD, path, rule->uid, rule->gid, AT_SYMLINK_NOFOLLOW) != 0) {
+            log << ERRR << "Unable to change the owner of " << path << " (errno = " 
+                << errno << ")." << endl;
+            self->failed++;
+            return 0;
+        }
+
+        chowned = true;
+    }
+
+    // Changing the owner clears the set-user-ID and set-group-ID bits.
+    if (mode >= 0 && (chowned || (int)(st->st_mode & 07777) != mode)) {
+        if (fchmodat(AT_FDCWD, path, mode, 0) != 0) {
+            log << ERRR << "Unable to change the mode of " << path << " (errno = " 
+                << errno << ")." << endl;
+            self->failed++;
+            return 0;
+        }
+    }
+
+    if (chowned || (mode >= 0 && (int)(st->st_mode & 07777) != mode))
+        self->changed++;
+
+    return 0;
+}
+
+// Returns the mode the rule gives to a file of the type.
+int PermissionTable::GetMode(const PermRule &rule, mode_t type) {
+    if (S_ISDIR(type))
+        return rule.dirMode;
+
+    if (S_ISREG(type) || (!S_ISLNK(type) && !rule.recursive))
+        return rule.fileMode;
+
+    return -1;
+}
+
+// ============================================================================
+// Parses a number of the base.
+static bool ParseNumber(const string &str, int base, long &value) {
+    char *end;
+
+    if (str.empty())
+        return false;
+
+    value = strtol(str.c_str(), &end, base);
+    return *end == '\0' && value >= 0;
+}
+
+// Returns if the path is the tree or below it.
+static bool IsInTree(const string &path, const string &tree) {
+    if (path.compare(0, tree.length(), tree) != 0)
+        return false;
+
+    return path.length() == tree.length() || tree[tree.length() - 1] == '/' ||
+        path[tree.length()] == '/';
+}
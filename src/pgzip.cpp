@@ -0,0 +1,291 @@
+/*
+ *  pgzip.cpp:
+ *      - Implementation of block-parallel "gzip" compression.
+ */
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "include/log.h"
+#include "include/pgzip.h"
+
+using namespace std;
+
+// Space for the compressed output of one block (incompressible
+// data grows by a few bytes per stored block).
+static const size_t PGZIP_OUT_SIZE = PGZIP_BLOCK_SIZE + PGZIP_BLOCK_SIZE / 8 + 1024;
+
+// The raw deflate stream of a thread and its level.
+struct PGzipState {
+    z_stream strm;
+    int level;
+};
+
+// Compresses the blocks, with a stream per thread.
+class PGzipCompressor : public WorkerHandler {
+public:
+    virtual void *StartWorker();
+    virtual void StopWorker(void *state);
+    virtual void Run(WorkerJob *job, void *state);
+};
+
+static PGzipCompressor gCompressor;
+
+// Utility function(s).
+static bool Compress(z_stream &strm, int &strmLevel, PGzipJob *job);
+
+// ============================================================================
+// Class constructor.
+ParallelGzipOutStream::ParallelGzipOutStream() {
+    out = NULL;
+    level = blockLevel = Z_DEFAULT_COMPRESSION;
+    init = false;
+    next = 0;
+    current = NULL;
+    tailLen = 0;
+    crc = 0;
+    bytesIn = 0;
+}
+
+// Class destructor.
+ParallelGzipOutStream::~ParallelGzipOutStream() {
+    Stop();
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        free(jobs[i]->in);
+        free(jobs[i]->out);
+        delete jobs[i];
+    }
+}
+
+// Starts compressing to the given stream.
+bool ParallelGzipOutStream::Init(OutStream &out, int level, int threads) {
+    // Member header: no name, no time stamp, Unix.
+    static const unsigned char header[10] = {
+        0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+    };
+
+    Stop();
+
+    if (!pool.Start(gCompressor, threads))
+        return false;
+
+    for (size_t i = jobs.size(); i < pool.GetJobCount(); i++) {
+        PGzipJob *job = new PGzipJob;
+        job->in = (char *)malloc(PGZIP_BLOCK_SIZE);
+        job->out = (char *)malloc(PGZIP_OUT_SIZE);
+        job->outSize = PGZIP_OUT_SIZE;
+        jobs.push_back(job);
+
+        if (!job->in || !job->out) {
+            log << ERRR << "Out of memory." << endl;
+            return false;
+        }
+    }
+
+    this->out = &out;
+    this->level = blockLevel = level;
+    next = 0;
+    current = jobs[0];
+    current->inLen = 0;
+    tailLen = 0;
+    crc = crc32(0, Z_NULL, 0);
+    bytesIn = 0;
+
+    log << INFO << "Compressing with " << pool.GetThreadCount() << " thread(s)." << endl;
+
+    init = true;
+    return out.Write(header, sizeof(header));
+}
+
+// Compresses the remaining input and writes the "gzip" trailer.
+bool ParallelGzipOutStream::Finish() {
+    unsigned char trailer[8];
+
+    if (!init)
+        return false;
+
+    bool success = Submit(true) && Drain(true);
+    Stop();
+
+    if (!success)
+        return false;
+
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (crc >> (8 * i)) & 0xFF;
+        trailer[4 + i] = ((unsigned long long)bytesIn >> (8 * i)) & 0xFF;
+    }
+
+    return out->Write(trailer, sizeof(trailer));
+}
+
+// Returns the number of uncompressed bytes written.
+long long ParallelGzipOutStream::GetBytesIn() const {
+    return bytesIn;
+}
+
+// Ends the current block if the level changes.
+void ParallelGzipOutStream::SetCompressible(bool compressible) {
+    int newLevel = compressible ? level : Z_NO_COMPRESSION;
+
+    if (!init || newLevel == blockLevel)
+        return;
+
+    // On failure, the following writes fail.
+    if (current->inLen > 0 && !Submit(false))
+        init = false;
+
+    blockLevel = newLevel;
+}
+
+// Buffers the data, submitting each full block.
+bool ParallelGzipOutStream::Write(const void *buf, size_t len) {
+    const char *data = (const char *)buf;
+
+    if (!init)
+        return false;
+
+    while (len > 0) {
+        size_t count = PGZIP_BLOCK_SIZE - current->inLen;
+
+        if (count > len)
+            count = len;
+
+        memcpy(current->in + current->inLen, data, count);
+        current->inLen += count;
+        bytesIn += count;
+        data += count;
+        len -= count;
+
+        if (current->inLen == PGZIP_BLOCK_SIZE && !Submit(false))
+            return false;
+    }
+
+    return true;
+}
+
+// Hands the current block to the pool and moves to the next free
+// job.
+bool ParallelGzipOutStream::Submit(bool last) {
+    PGzipJob *job = current;
+
+    job->last = last;
+    job->level = blockLevel;
+    job->done = job->failed = false;
+    job->dictLen = tailLen;
+    memcpy(job->dict, tail, tailLen);
+
+    // The end of this block primes the next one.
+    if (job->inLen >= PGZIP_DICT_SIZE) {
+        memcpy(tail, job->in + job->inLen - PGZIP_DICT_SIZE, PGZIP_DICT_SIZE);
+        tailLen = PGZIP_DICT_SIZE;
+    } else if (job->inLen > 0) {
+        size_t keep = (tailLen + job->inLen > PGZIP_DICT_SIZE) ? 
+            PGZIP_DICT_SIZE - job->inLen : tailLen;
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, job->in, job->inLen);
+        tailLen = keep + job->inLen;
+    }
+
+    pool.Submit(job);
+    next = (next + 1) % jobs.size();
+
+    if (!Drain(false))
+        return false;
+
+    current = jobs[next];
+    current->inLen = 0;
+    return true;
+}
+
+// Writes the finished jobs in order. Waits for the oldest job if 
+// all jobs are in flight, or till all are written if "all" is set.
+bool ParallelGzipOutStream::Drain(bool all) {
+    PGzipJob *job;
+
+    while ((job = (PGzipJob *)pool.Collect(all || pool.GetInFlightCount() == jobs.size()))) {
+        if (job->failed) {
+            log << ERRR << "Compression error." << endl;
+            return false;
+        }
+
+        if (!out->Write(job->out, job->outLen))
+            return false;
+
+        crc = crc32_combine(crc, job->crc, job->inLen);
+    }
+
+    return true;
+}
+
+// Stops the workers.
+void ParallelGzipOutStream::Stop() {
+    pool.Stop();
+    init = false;
+}
+
+// ============================================================================
+// Returns a raw deflate stream (NULL on error, failing the jobs).
+void *PGzipCompressor::StartWorker() {
+    PGzipState *state = new PGzipState;
+
+    memset(&state->strm, 0, sizeof(state->strm));
+    state->level = Z_DEFAULT_COMPRESSION;
+
+    // Negative window bits produce raw deflate data.
+    if (deflateInit2(&state->strm, state->level, Z_DEFLATED, -15, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK) {
+        log << ERRR << "Unable to initialize compressor." << endl;
+        delete state;
+        return NULL;
+    }
+
+    return state;
+}
+
+// Releases the stream.
+void PGzipCompressor::StopWorker(void *state) {
+    if (state) {
+        deflateEnd(&((PGzipState *)state)->strm);
+        delete (PGzipState *)state;
+    }
+}
+
+// Compresses a block.
+void PGzipCompressor::Run(WorkerJob *job, void *state) {
+    PGzipState *s = (PGzipState *)state;
+    ((PGzipJob *)job)->failed = !s || !Compress(s->strm, s->level, (PGzipJob *)job);
+}
+
+// Compresses one block as raw deflate data. All blocks but the last 
+// end with a sync flush, so they are byte aligned and not final.
+static bool Compress(z_stream &strm, int &strmLevel, PGzipJob *job) {
+    if (deflateReset(&strm) != Z_OK)
+        return false;
+
+    if (strmLevel != job->level) {
+        if (deflateParams(&strm, job->level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+
+        strmLevel = job->level;
+    }
+
+    if (job->dictLen && deflateSetDictionary(&strm, job->dict, job->dictLen) != Z_OK)
+        return false;
+
+    job->crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)job->in, job->inLen);
+
+    strm.next_in = (Bytef *)job->in;
+    strm.avail_in = job->inLen;
+    strm.next_out = (Bytef *)job->out;
+    strm.avail_out = job->outSize;
+
+    int ret = deflate(&strm, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+
+    if (job->last ? (ret != Z_STREAM_END) : (ret != Z_OK || strm.avail_out == 0))
+        return false;
+
+    job->outLen = job->outSize - strm.avail_out;
+    return true;
+}
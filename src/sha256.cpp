@@ -0,0 +1,148 @@
+/*
+ *  sha256.cpp:
+ *      - Implementation of the SHA-256 message digest (FIPS 180-2).
+ */
+#include <string.h>
+
+#include "include/sha256.h"
+
+using namespace std;
+
+// Round constants.
+static const unsigned int K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+// Utility function(s).
+static inline unsigned int Rotate(unsigned int x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// ============================================================================
+// Class constructor.
+Sha256::Sha256() {
+    Init();
+}
+
+// Starts a new digest.
+void Sha256::Init() {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(state, initial, sizeof(state));
+    blockLen = 0;
+    length = 0;
+}
+
+// Processes one 64 byte block.
+void Sha256::Transform(const unsigned char *data) {
+    unsigned int w[64], a, b, c, d, e, f, g, h;
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (data[4 * i] << 24) | (data[4 * i + 1] << 16) |
+            (data[4 * i + 2] << 8) | data[4 * i + 3];
+
+    for (int i = 16; i < 64; i++) {
+        const unsigned int s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const unsigned int s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0]; b = state[1]; c = state[2]; d = state[3];
+    e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        const unsigned int s1 = Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25);
+        const unsigned int t1 = h + s1 + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        const unsigned int s0 = Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22);
+        const unsigned int t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// Adds data to the digest.
+void Sha256::Update(const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+
+    length += len;
+
+    // Complete a partial block first.
+    if (blockLen) {
+        const size_t n = (len < 64 - blockLen) ? len : 64 - blockLen;
+
+        memcpy(block + blockLen, p, n);
+        blockLen += n;
+        p += n;
+        len -= n;
+
+        if (blockLen < 64)
+            return;
+
+        Transform(block);
+        blockLen = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        Transform(p);
+
+    memcpy(block, p, len);
+    blockLen = len;
+}
+
+// Pads the data and stores the digest (SHA256_SIZE bytes).
+void Sha256::Final(unsigned char *digest) {
+    const unsigned long long bits = length * 8;
+    unsigned char pad[72];
+    const size_t padLen = (blockLen < 56) ? 56 - blockLen : 120 - blockLen;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+
+    for (int i = 0; i < 8; i++)
+        pad[padLen + i] = (unsigned char)(bits >> (56 - 8 * i));
+
+    Update(pad, padLen + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = state[i] >> 24;
+        digest[4 * i + 1] = state[i] >> 16;
+        digest[4 * i + 2] = state[i] >> 8;
+        digest[4 * i + 3] = state[i];
+    }
+}
+
+// ============================================================================
+// Computes the digest of a buffer.
+void Sha256Digest(const void *buf, size_t len, unsigned char *digest) {
+    Sha256 sha;
+
+    sha.Update(buf, len);
+    sha.Final(digest);
+}
+
+// Returns the lowercase hexadecimal form of a digest.
+string Sha256ToHex(const unsigned char *digest) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+
+    for (size_t i = 0; i < SHA256_SIZE; i++) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 0xf];
+    }
+
+    return hex;
+}
@@ -0,0 +1,375 @@
+/*
+ *  stream.cpp:
+ *      - Implementation of byte streams used for backup
+ *        creation\restoration.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "include/log.h"
+#include "include/stream.h"
+
+using namespace std;
+
+// ============================================================================
+// Class constructor.
+FileOutStream::FileOutStream() {
+    fd = -1;
+    owner = false;
+    buffer = NULL;
+    used = 0;
+}
+
+// Class destructor.
+FileOutStream::~FileOutStream() {
+    Close();
+}
+
+// Creates (or truncates) the file for writing.
+bool FileOutStream::Open(const char *path) {
+    Close();
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        log << ERRR << "Unable to create file: " << path << endl;
+        return false;
+    }
+
+    owner = true;
+    return true;
+}
+
+// Writes to an already open descriptor (which is not closed by us).
+void FileOutStream::Attach(int fd) {
+    Close();
+    this->fd = fd;
+    owner = false;
+}
+
+// Writes the buffered data to the file.
+bool FileOutStream::Flush() {
+    size_t done = 0;
+
+    while (done < used) {
+        ssize_t ret = write(fd, buffer + done, used - done);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Write error: " << strerror(errno) << endl;
+            return false;
+        }
+
+        done += ret;
+    }
+
+    used = 0;
+    return true;
+}
+
+// Flushes and closes the file.
+bool FileOutStream::Close() {
+    bool success = true;
+
+    if (fd >= 0) {
+        success = Flush();
+
+        if (owner && close(fd) != 0)
+            success = false;
+    }
+
+    free(buffer);
+    buffer = NULL;
+    used = 0;
+    fd = -1;
+    owner = false;
+    return success;
+}
+
+// Returns the underlying file descriptor (after flushing
+// the buffered data, the offset is valid).
+int FileOutStream::GetDescriptor() const {
+    return fd;
+}
+
+// Writes to the file through the buffer.
+bool FileOutStream::Write(const void *buf, size_t len) {
+    const char *data = (const char *)buf;
+
+    if (fd < 0)
+        return false;
+
+    if (!buffer && !(buffer = (char *)malloc(STREAM_BUFFER_SIZE)))
+        return false;
+
+    while (len > 0) {
+        size_t count = STREAM_BUFFER_SIZE - used;
+
+        if (count > len)
+            count = len;
+
+        memcpy(buffer + used, data, count);
+        used += count;
+        data += count;
+        len -= count;
+
+        if (used == STREAM_BUFFER_SIZE && !Flush())
+            return false;
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+FileInStream::FileInStream() {
+    fd = -1;
+    owner = false;
+}
+
+// Class destructor.
+FileInStream::~FileInStream() {
+    Close();
+}
+
+// Opens the file for reading.
+bool FileInStream::Open(const char *path) {
+    Close();
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        log << ERRR << "Unable to open file: " << path << endl;
+        return false;
+    }
+
+    owner = true;
+    return true;
+}
+
+// Reads from an already open descriptor (which is not closed by us).
+void FileInStream::Attach(int fd) {
+    Close();
+    this->fd = fd;
+    owner = false;
+}
+
+// Closes the file.
+void FileInStream::Close() {
+    if (fd >= 0 && owner)
+        close(fd);
+
+    fd = -1;
+    owner = false;
+}
+
+// Returns the underlying file descriptor.
+int FileInStream::GetDescriptor() const {
+    return fd;
+}
+
+// Reads from the file.
+ssize_t FileInStream::Read(void *buf, size_t len) {
+    ssize_t ret;
+
+    if (fd < 0)
+        return -1;
+
+    do {
+        ret = read(fd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        log << ERRR << "Read error: " << strerror(errno) << endl;
+
+    return ret;
+}
+
+// ============================================================================
+// Class constructor.
+BufferOutStream::BufferOutStream(void *buffer, size_t size) {
+    this->buffer = (char *)buffer;
+    this->size = size;
+    used = 0;
+}
+
+// Returns the number of bytes written.
+size_t BufferOutStream::GetLength() const {
+    return used;
+}
+
+// Appends to the buffer, failing if the data does not fit.
+bool BufferOutStream::Write(const void *buf, size_t len) {
+    if (len > size - used) {
+        log << ERRR << "The buffer is too small." << endl;
+        return false;
+    }
+
+    memcpy(buffer + used, buf, len);
+    used += len;
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+PeekInStream::PeekInStream() {
+    in = NULL;
+    headLen = headPos = 0;
+    eof = started = false;
+}
+
+// Starts reading from the given stream.
+void PeekInStream::Init(InStream &in) {
+    this->in = &in;
+    headLen = headPos = 0;
+    eof = started = false;
+}
+
+// Buffers the first bytes of the stream and returns a copy.
+ssize_t PeekInStream::Peek(void *buf, size_t len) {
+    if (!in || started)
+        return -1;
+
+    if (len > sizeof(head))
+        len = sizeof(head);
+
+    while (headLen < len && !eof) {
+        ssize_t ret = in->Read(head + headLen, len - headLen);
+
+        if (ret < 0)
+            return -1;
+        else if (ret == 0)
+            eof = true;
+
+        headLen += ret;
+    }
+
+    if (len > headLen)
+        len = headLen;
+
+    memcpy(buf, head, len);
+    return len;
+}
+
+// Returns the buffered bytes first, then reads from the stream.
+ssize_t PeekInStream::Read(void *buf, size_t len) {
+    if (!in)
+        return -1;
+
+    started = true;
+
+    if (headPos < headLen) {
+        if (len > headLen - headPos)
+            len = headLen - headPos;
+
+        memcpy(buf, head + headPos, len);
+        headPos += len;
+        return len;
+    }
+
+    return eof ? 0 : in->Read(buf, len);
+}
+
+// ============================================================================
+// Copies the entire input to the output.
+bool CopyStream(InStream &in, OutStream &out) {
+    char *buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+    bool success = (buffer != NULL);
+
+    while (success) {
+        ssize_t ret = in.Read(buffer, STREAM_BUFFER_SIZE);
+
+        if (ret == 0)
+            break;
+
+        success = (ret > 0 && out.Write(buffer, ret));
+    }
+
+    free(buffer);
+    return success;
+}
+
+// Copies the entire contents of a "stdio" stream to the output.
+bool CopyStream(FILE *in, OutStream &out) {
+    char *buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+    bool success = (buffer != NULL);
+
+    while (success) {
+        size_t ret = fread(buffer, 1, STREAM_BUFFER_SIZE, in);
+
+        if (ret == 0) {
+            success = !ferror(in);
+            break;
+        }
+
+        success = out.Write(buffer, ret);
+    }
+
+    free(buffer);
+    return success;
+}
+
+// Copies the entire input to a "stdio" stream.
+bool CopyStream(InStream &in, FILE *out) {
+    char *buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+    bool success = (buffer != NULL);
+
+    while (success) {
+        ssize_t ret = in.Read(buffer, STREAM_BUFFER_SIZE);
+
+        if (ret == 0)
+            break;
+
+        success = (ret > 0 && fwrite(buffer, 1, ret, out) == size_t(ret));
+    }
+
+    free(buffer);
+    return success;
+}
+
+// Reads exactly "len" bytes.
+bool ReadFully(InStream &in, void *buf, size_t len) {
+    char *data = (char *)buf;
+
+    while (len > 0) {
+        ssize_t ret = in.Read(data, len);
+
+        if (ret <= 0) {
+            if (ret == 0)
+                log << ERRR << "Unexpected end of data." << endl;
+
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+// Reads exactly "len" bytes at the offset.
+bool ReadAt(int fd, void *buf, size_t len, off_t offset) {
+    char *data = (char *)buf;
+
+    while (len > 0) {
+        ssize_t ret = pread(fd, data, len, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Unable to read at " << (long long)offset << " (errno = "
+                << (ret < 0 ? errno : 0) << ")." << endl;
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
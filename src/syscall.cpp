@@ -4,9 +4,17 @@
  *        execution of system commands.
  */
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/poll.h>
 
 #include "include/log.h"
 #include "include/syscall.h"
@@ -15,44 +23,671 @@ using namespace std;
 
 static const bool sandboxMode = false;
 
-int SysCall(const char *str, bool logOutput) {
-    if (!sandboxMode) {
-        int ret;
+// The line printed after each command run by the shell, with its exit
+// status.
+static const char *EXIT_MARK = "@midRecovery-exit@";
+
+// The shell running the commands of SysCall(). It is started once, so
+// that a command costs no more than its own process (busybox applets
+// built into the shell not even that).
+static pid_t shellPid = -1;
+static int shellIn = -1;               // standard input of the shell
+static int shellOut = -1;              // its standard output and error
+
+// Utility function(s).
+static bool MakePipe(int fds[2]);
+static bool StartShell();
+static int StopShell();
+static bool WriteShell(const char *data, size_t len);
+static string Quote(const string &str);
+
+// Logs the result of the last command.
+static void LogResult(int ret) {
+    if (ret < 0 || ret == 127)
+        log << ERRR << "Error executing the last command." << std::endl;
+    else if (ret != 0)
+        log << ERRR << "Error while executing the last command." << std::endl;
+    else
+        log << INFO << "The operation completed successfully." << std::endl;
+}
+
+// The output of a command, either logged as it comes or kept in a ring
+// buffer of its tail, which is only logged if the command fails (e.g.
+// a verbose "unzip" writes a line per file to the SD card otherwise).
+class CommandOutput {
+private:
+    char tail[SYSCALL_TAIL_SIZE];
+    size_t end;                 // end of the tail in the ring
+    bool wrapped;
+    bool logAll;
+    char last;                  // last character written
+    long long lines;
+
+public:
+    CommandOutput(bool logAll);
+
+    void Write(const char *data, size_t len);
+
+    // Logs the summary, or the tail if the command failed.
+    void Finish(int status);
+
+    long long GetLineCount() const;
+};
+
+// ============================================================================
+// Runs the command in the shell. The command is followed by a line
+// with the exit mark and its status.
+int SysCall(const char *str, SysCallLog output, SysCallProgress *progress) {
+    CommandOutput out(output == SYSCALL_LOG_ALL);
+    string script, buffer;
+    char chunk[4096];
+    size_t mark;
+    int ret;
+
+    log << CMMD << str << std::endl;
+
+    if (sandboxMode)
+        return 0;
 
-        if (logOutput) {
-            char buffer[256];
-            string cmd = str;
+    // The command is evaluated in a subshell (a fork, but no exec), so
+    // that it can not change the directory, variables, traps or options
+    // of the shell for later commands, and a syntax error ends the
+    // subshell instead of leaving the shell waiting for a quote.
+    script = string("{ ( eval ") + Quote(str) + " ) </dev/null 2>&1; __s=$?; echo; echo '" +
+        EXIT_MARK + "' $__s; }\n";
+
+    if (!StartShell() || !WriteShell(script.data(), script.length())) {
+        LogResult(-1);
+        StopShell();
+        return -1;
+    }
+
+    Log::Flush();
+
+    // Pass on the output until the exit mark, keeping the last line
+    // feed (the one before the mark was added by the shell). While
+    // waiting, the progress is updated.
+    while ((mark = buffer.find(string("\n") + EXIT_MARK + " ")) == string::npos ||
+            buffer.find('\n', mark + 1) == string::npos) {
+
+        size_t last = buffer.rfind('\n');
+        struct pollfd fds = { shellOut, POLLIN, 0 };
+        ssize_t count = 0;
+
+        if (mark == string::npos && last != string::npos && last > 0) {
+            out.Write(buffer.data(), last);
+            buffer.erase(0, last);
+        }
+
+        if (progress)
+            progress->Update(out.GetLineCount());
+
+        if (poll(&fds, 1, SYSCALL_POLL_INTERVAL) < 0 && errno != EINTR)
+            break;
+
+        if (fds.revents & (POLLIN | POLLHUP | POLLERR))
+            while ((count = read(shellOut, chunk, sizeof(chunk))) < 0 && errno == EINTR)
+                ;
+
+        if (fds.revents && count <= 0)
+            break;
+
+        if (count > 0)
+            buffer.append(chunk, count);
+    }
+
+    if (mark == string::npos || buffer.find('\n', mark + 1) == string::npos) {
+        // The shell exited (e.g. by "exit").
+        out.Write(buffer.data(), buffer.length());
+        ret = StopShell();
+    } else {
+        out.Write(buffer.data(), mark);
+        ret = atoi(buffer.c_str() + mark + strlen(EXIT_MARK) + 2);
+    }
+
+    if (progress)
+        progress->Update(out.GetLineCount());
+
+    out.Finish(ret);
+    LogResult(ret);
+    return ret;
+}
+
+FILE *SysCallOpen(const char *str, const char *mode) {
+    string cmd = str;
+    FILE *pipe;
+
+    // The other end of the pipe may exit early, which must
+    // be reported as a write error instead of killing us.
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!sandboxMode) {
+        // Standard error (and standard output, if not connected
+        // to the pipe) is appended to the log.
+        if (mode[0] == 'r') {
+            cmd += " 2>>";
+            cmd += Log::GetPath();
+        } else {
+            cmd += " >>";
+            cmd += Log::GetPath();
             cmd += " 2>&1";
+        }
+
+        log << CMMD << cmd << std::endl;
+        Log::Flush();
+        pipe = popen(cmd.c_str(), mode);
+    } else {
+        log << CMMD << cmd << std::endl;
+        pipe = popen(mode[0] == 'r' ? "true" : "cat > /dev/null", mode);
+    }
+
+    if (!pipe)
+        log << ERRR << "Error creating pipe for the last command." << std::endl;
+
+    return pipe;
+}
+
+int SysCallClose(FILE *pipe) {
+    int ret = pclose(pipe);
+    LogResult(ret);
+    return ret;
+}
+
+// Starts the command with its standard input and output connected
+// to the descriptors. Standard error is appended to the log.
+static pid_t SpawnCommand(const char *str, int in, int out) {
+    const char *cmd = sandboxMode ? "cat" : str;
+    pid_t pid;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    log << CMMD << str << std::endl;
+    Log::Flush();
+
+    if ((pid = fork()) < 0) {
+        log << ERRR << "Error creating process for the last command." << std::endl;
+        return -1;
+    }
+
+    if (pid == 0) {
+        int err = open(Log::GetPath(), O_WRONLY | O_APPEND);
+
+        dup2(in, 0);
+        dup2(out, 1);
+
+        if (err >= 0)
+            dup2(err, 2);
+
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+// Creates a pipe whose ends are not inherited by commands.
+static bool MakePipe(int fds[2]) {
+    if (pipe(fds) != 0) {
+        log << ERRR << "Error creating pipe for the last command." << std::endl;
+        return false;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+// Waits for the command and logs the result.
+static int WaitCommand(pid_t pid) {
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+
+    if (status > 0)
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    LogResult(status);
+    return status;
+}
+
+// ============================================================================
+// Class constructor.
+CommandOutput::CommandOutput(bool logAll) {
+    this->logAll = logAll;
+    end = 0;
+    wrapped = false;
+    last = '\n';
+    lines = 0;
+}
+
+// Logs the output, or adds it to the tail.
+void CommandOutput::Write(const char *data, size_t len) {
+    if (len == 0)
+        return;
+
+    for (size_t i = 0; i < len; i++)
+        lines += (data[i] == '\n');
+
+    last = data[len - 1];
+
+    if (logAll) {
+        log.write(data, len);
+        return;
+    }
+
+    // Only the last SYSCALL_TAIL_SIZE bytes matter.
+    if (len >= SYSCALL_TAIL_SIZE) {
+        data += len - SYSCALL_TAIL_SIZE;
+        len = SYSCALL_TAIL_SIZE;
+    }
+
+    while (len > 0) {
+        size_t count = min(len, SYSCALL_TAIL_SIZE - end);
+
+        memcpy(tail + end, data, count);
+        data += count;
+        len -= count;
+
+        if ((end += count) == SYSCALL_TAIL_SIZE) {
+            end = 0;
+            wrapped = true;
+        }
+    }
+}
+
+// Logs the summary, or the tail.
+void CommandOutput::Finish(int status) {
+    if (last != '\n') {
+        Write("\n", 1);
+    }
+
+    if (logAll || lines == 0)
+        return;
+
+    if (status == 0) {
+        log << INFO << lines << " line(s) of output." << std::endl;
+        return;
+    }
+
+    if (!wrapped) {
+        log.write(tail, end);
+        return;
+    }
+
+    // The first line of the ring is partial.
+    string text = string(tail + end, SYSCALL_TAIL_SIZE - end) + string(tail, end);
+
+    log << INFO << "Last lines of " << lines << " line(s) of output:" << std::endl
+        << text.substr(text.find('\n') + 1);
+}
+
+long long CommandOutput::GetLineCount() const {
+    return lines;
+}
+
+// ============================================================================
+// Class constructor.
+CommandOutStream::CommandOutStream() {
+    out = NULL;
+    fd = outFd = -1;
+    pid = -1;
+    failed = false;
+}
+
+// Class destructor.
+CommandOutStream::~CommandOutStream() {
+    if (pid > 0)
+        Close();
+}
+
+// Starts the command.
+bool CommandOutStream::Open(const char *cmd, OutStream &out) {
+    int in[2], output[2];
+
+    if (!MakePipe(in))
+        return false;
+
+    if (!MakePipe(output)) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+
+    pid = SpawnCommand(cmd, in[0], output[1]);
+    close(in[0]);
+    close(output[1]);
+
+    if (pid < 0) {
+        close(in[1]);
+        close(output[0]);
+        return false;
+    }
+
+    this->out = &out;
+    fd = in[1];
+    outFd = output[0];
+    failed = false;
+
+    if (pthread_create(&thread, NULL, Pump, this) != 0) {
+        log << ERRR << "Unable to create thread for the last command." << std::endl;
+        close(outFd);
+        outFd = -1;
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+// Ends the input of the command and waits for it.
+bool CommandOutStream::Close() {
+    if (pid < 0)
+        return false;
+
+    close(fd);
+
+    if (outFd >= 0)
+        pthread_join(thread, NULL);
+
+    bool success = (WaitCommand(pid) == 0) && !failed;
+
+    fd = outFd = -1;
+    pid = -1;
+    return success;
+}
+
+// Writes to the standard input of the command.
+bool CommandOutStream::Write(const void *buf, size_t len) {
+    const char *data = (const char *)buf;
+
+    if (pid < 0)
+        return false;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Write error: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+// Thread copying the output of the command to the stream. On error
+// the pipe is closed, so that the command (and Write()) fails too.
+void *CommandOutStream::Pump(void *arg) {
+    CommandOutStream *self = (CommandOutStream *)arg;
+    char *buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+
+    for (;;) {
+        ssize_t ret = buffer ? read(self->outFd, buffer, STREAM_BUFFER_SIZE) : -1;
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret == 0)
+            break;
+
+        if (ret < 0 || !self->out->Write(buffer, ret)) {
+            self->failed = true;
+            break;
+        }
+    }
+
+    close(self->outFd);
+    free(buffer);
+    return NULL;
+}
+
+// ============================================================================
+// Class constructor.
+CommandInStream::CommandInStream() {
+    in = NULL;
+    fd = inFd = -1;
+    pid = -1;
+    failed = false;
+}
+
+// Class destructor.
+CommandInStream::~CommandInStream() {
+    if (pid > 0)
+        Close();
+}
+
+// Starts the command.
+bool CommandInStream::Open(const char *cmd, InStream &in) {
+    int input[2], out[2];
+
+    if (!MakePipe(input))
+        return false;
+
+    if (!MakePipe(out)) {
+        close(input[0]);
+        close(input[1]);
+        return false;
+    }
+
+    pid = SpawnCommand(cmd, input[0], out[1]);
+    close(input[0]);
+    close(out[1]);
+
+    if (pid < 0) {
+        close(input[1]);
+        close(out[0]);
+        return false;
+    }
+
+    this->in = &in;
+    fd = out[0];
+    inFd = input[1];
+    failed = false;
+
+    if (pthread_create(&thread, NULL, Pump, this) != 0) {
+        log << ERRR << "Unable to create thread for the last command." << std::endl;
+        close(inFd);
+        inFd = -1;
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the rest of the output and waits for the command.
+bool CommandInStream::Close() {
+    char buffer[4096];
+
+    if (pid < 0)
+        return false;
+
+    for (;;) {
+        ssize_t ret = read(fd, buffer, sizeof(buffer));
+
+        if (ret == 0 || (ret < 0 && errno != EINTR))
+            break;
+    }
+
+    close(fd);
 
-            log << CMMD << cmd << std::endl;
-            FILE *pipe = popen(cmd.c_str(), "r");
+    if (inFd >= 0)
+        pthread_join(thread, NULL);
 
-            if (!pipe) {
-                log << ERRR << "Error creating pipe for the last command." << std::endl;
-                return -1;
+    bool success = (WaitCommand(pid) == 0) && !failed;
+
+    fd = inFd = -1;
+    pid = -1;
+    return success;
+}
+
+// Reads from the standard output of the command.
+ssize_t CommandInStream::Read(void *buf, size_t len) {
+    ssize_t ret;
+
+    if (pid < 0)
+        return -1;
+
+    do {
+        ret = read(fd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        log << ERRR << "Read error: " << strerror(errno) << std::endl;
+
+    return ret;
+}
+
+// Thread copying the stream to the input of the command.
+void *CommandInStream::Pump(void *arg) {
+    CommandInStream *self = (CommandInStream *)arg;
+    char *buffer = (char *)malloc(STREAM_BUFFER_SIZE);
+
+    for (;;) {
+        ssize_t ret = buffer ? self->in->Read(buffer, STREAM_BUFFER_SIZE) : -1;
+
+        if (ret == 0)
+            break;
+
+        if (ret < 0) {
+            self->failed = true;
+            break;
+        }
+
+        for (ssize_t done = 0; done < ret; ) {
+            ssize_t count = write(self->inFd, buffer + done, ret - done);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            // The command exited early.
+            if (count <= 0) {
+                ret = -1;
+                break;
             }
 
-            while (!feof(pipe))
-                if (fgets(buffer, sizeof(buffer), pipe))
-                    log << buffer;
+            done += count;
+        }
 
-            ret = pclose(pipe);
-        } else {
-            log << CMMD << str << std::endl;
-            ret = system(str);
+        if (ret < 0)
+            break;
+    }
+
+    close(self->inFd);
+    free(buffer);
+    return NULL;
+}
+
+// ============================================================================
+// Starts the shell, unless running.
+static bool StartShell() {
+    int in[2], out[2];
+
+    if (shellPid > 0)
+        return true;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!MakePipe(in))
+        return false;
+
+    if (!MakePipe(out)) {
+        close(in[0]);
+        close(in[1]);
+        return false;
+    }
+
+    if ((shellPid = fork()) < 0) {
+        log << ERRR << "Error creating the shell process." << std::endl;
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return false;
+    }
+
+    if (shellPid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", (char *)NULL);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+
+    shellIn = in[1];
+    shellOut = out[0];
+    return true;
+}
+
+// Ends the shell and returns its exit status.
+static int StopShell() {
+    int status;
+
+    if (shellPid < 0)
+        return -1;
+
+    close(shellIn);
+    close(shellOut);
+
+    while (waitpid(shellPid, &status, 0) < 0)
+        if (errno != EINTR) {
+            status = -1;
+            break;
         }
 
-        if (ret < 0 || ret == 127)
-            log << ERRR << "Error executing the last command." << std::endl;
-        else if (ret != 0)
-            log << ERRR << "Error while executing the last command." << std::endl;
-        else
-            log << INFO << "The operation completed successfully." << std::endl;
+    if (status > 0)
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 
-        return ret;
-    } else {
-        log << CMMD << str << std::endl;
-        return 0;
+    shellPid = -1;
+    shellIn = shellOut = -1;
+    return status;
+}
+
+// Writes the commands to the shell.
+static bool WriteShell(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t ret = write(shellIn, data, len);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0) {
+            log << ERRR << "Unable to write to the shell: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        data += ret;
+        len -= ret;
     }
+
+    return true;
 }
 
+// Quotes the string for the shell.
+static string Quote(const string &str) {
+    string quoted = "'";
+
+    for (size_t i = 0; i < str.length(); i++)
+        if (str[i] == '\'')
+            quoted += "'\\''";
+        else
+            quoted += str[i];
+
+    return quoted + "'";
+}
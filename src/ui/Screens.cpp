@@ -3,6 +3,8 @@
  *      - Implementation of various MID recovery windows.
  */
 #include <iostream>
+#include <sstream>
+#include <algorithm>
 #include <vector>
 #include <string>
 
@@ -11,7 +13,10 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
 #include <sys/statvfs.h>
 #include <linux/input.h>
 
@@ -19,11 +24,26 @@
 #include "../include/config.h"
 #include "../include/syscall.h"
 #include "../include/util.h"
+#include "../include/stream.h"
+#include "../include/archive.h"
+#include "../include/pgzip.h"
+#include "../include/codec.h"
+#include "../include/image.h"
+#include "../include/diskio.h"
+#include "../include/manifest.h"
+#include "../include/mount.h"
+#include "../include/perms.h"
+#include "../include/zip.h"
+#include "../include/delta.h"
+#include "../include/sha256.h"
+#include "../include/chunkstore.h"
+#include "../include/mfw.h"
 #include "../include/Window.h"
 #include "../include/FileWindow.h"
 #include "../include/FileView.h"
 #include "../ui/Terminal.h"
 #include "../hw/mtd.h"
+#include "../hw/ubi.h"
 #include "Screens.h"
 
 using namespace std;
@@ -46,7 +66,12 @@ Window *WinSetup() {
     backups.push_back(WindowOption("Create system backup",      CreateSystemBackup));
     backups.push_back(WindowOption("Create data backup",        CreateDataBackup));
     backups.push_back(WindowOption("Create data+system backup", CreateDataSystemBackup));
+    backups.push_back(WindowOption("Create incremental backup", CreateIncrementalBackup));
     backups.push_back(WindowOption("Restore backup",            RestoreBackup));
+    backups.push_back(WindowOption("Verify backup",             VerifyBackup));
+    backups.push_back(WindowOption("Backup compression",        SelectBackupCompression));
+    backups.push_back(WindowOption("Backup method",             SelectBackupMethod));
+    backups.push_back(WindowOption("Backup storage",            SelectBackupStorage));
     backups.push_back(WindowOption("(Back)",                    DisplayMainWindow));
 
     partitions.push_back(WindowOption("Backup logo",            BackupLogo));
@@ -0,0 +1,185 @@
+/*
+ *  workers.cpp:
+ *      - Implementation of the pool of worker threads.
+ */
+#include <vector>
+#include <deque>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "include/log.h"
+#include "include/workers.h"
+
+using namespace std;
+
+// ============================================================================
+// Class constructor.
+WorkerPool::WorkerPool() {
+    handler = NULL;
+    threads = 0;
+    syncState = NULL;
+    started = false;
+    quit = false;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&workCond, NULL);
+    pthread_cond_init(&doneCond, NULL);
+}
+
+// Class destructor.
+WorkerPool::~WorkerPool() {
+    Stop();
+
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&workCond);
+    pthread_cond_destroy(&doneCond);
+}
+
+// Starts the workers, or prepares to run the jobs in the submitting
+// thread if there is only one.
+bool WorkerPool::Start(WorkerHandler &handler, int threads) {
+    Stop();
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    else if (threads > WORKER_MAX_THREADS)
+        threads = WORKER_MAX_THREADS;
+
+    this->handler = &handler;
+    this->threads = threads;
+    quit = false;
+    started = true;
+
+    if (threads == 1) {
+        syncState = handler.StartWorker();
+        return true;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, Worker, this) != 0) {
+            log << ERRR << "Unable to create worker thread." << endl;
+            Stop();
+            return false;
+        }
+
+        workers.push_back(thread);
+    }
+
+    return true;
+}
+
+// Stops the workers. The jobs in flight are dropped.
+void WorkerPool::Stop() {
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&workCond);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+
+    if (started && threads == 1)
+        handler->StopWorker(syncState);
+
+    workers.clear();
+    pending.clear();
+    inFlight.clear();
+    syncState = NULL;
+    started = false;
+}
+
+// Returns the number of threads running the jobs.
+int WorkerPool::GetThreadCount() const {
+    return threads;
+}
+
+// With workers, twice as many jobs keep them busy while the oldest
+// job is used.
+size_t WorkerPool::GetJobCount() const {
+    return (threads <= 1) ? 1 : 2 * threads;
+}
+
+// Returns the number of jobs submitted and not collected.
+size_t WorkerPool::GetInFlightCount() const {
+    return inFlight.size();
+}
+
+// Hands the job to a worker (or runs it without workers).
+void WorkerPool::Submit(WorkerJob *job) {
+    job->done = false;
+    inFlight.push_back(job);
+
+    if (workers.empty()) {
+        handler->Run(job, syncState);
+        job->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    pending.push_back(job);
+    pthread_cond_signal(&workCond);
+    pthread_mutex_unlock(&lock);
+}
+
+// Returns the oldest job in flight if done.
+WorkerJob *WorkerPool::Collect(bool wait) {
+    WorkerJob *job;
+    bool done;
+
+    if (inFlight.empty())
+        return NULL;
+
+    job = inFlight.front();
+    pthread_mutex_lock(&lock);
+
+    while (!job->done && wait)
+        pthread_cond_wait(&doneCond, &lock);
+
+    done = job->done;
+    pthread_mutex_unlock(&lock);
+
+    if (!done)
+        return NULL;
+
+    inFlight.pop_front();
+    return job;
+}
+
+// Worker thread: runs the pending jobs.
+void *WorkerPool::Worker(void *arg) {
+    WorkerPool *self = (WorkerPool *)arg;
+    void *state = self->handler->StartWorker();
+
+    for (;;) {
+        WorkerJob *job;
+
+        pthread_mutex_lock(&self->lock);
+
+        while (self->pending.empty() && !self->quit)
+            pthread_cond_wait(&self->workCond, &self->lock);
+
+        if (self->pending.empty()) {
+            pthread_mutex_unlock(&self->lock);
+            break;
+        }
+
+        job = self->pending.front();
+        self->pending.pop_front();
+        pthread_mutex_unlock(&self->lock);
+
+        self->handler->Run(job, state);
+
+        pthread_mutex_lock(&self->lock);
+        job->done = true;
+        pthread_cond_broadcast(&self->doneCond);
+        pthread_mutex_unlock(&self->lock);
+    }
+
+    self->handler->StopWorker(state);
+    return NULL;
+}
@@ -0,0 +1,549 @@
+/*
+ *  zip.cpp:
+ *      - Implementation of in-process "zip" extraction.
+ */
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "include/log.h"
+#include "include/util.h"
+#include "include/perms.h"
+#include "include/zip.h"
+
+using namespace std;
+
+// Record signatures and sizes (without the variable fields).
+static const unsigned long ZIP_LOCAL_SIGNATURE = 0x04034b50;
+static const unsigned long ZIP_CENTRAL_SIGNATURE = 0x02014b50;
+static const unsigned long ZIP_END_SIGNATURE = 0x06054b50;
+static const size_t ZIP_LOCAL_SIZE = 30;
+static const size_t ZIP_CENTRAL_SIZE = 46;
+static const size_t ZIP_END_SIZE = 22;
+
+// The end of central directory record is followed by a comment of
+// up to 64 KB.
+static const size_t ZIP_END_SEARCH = ZIP_END_SIZE + 0xFFFF;
+
+// The host system of the attributes of unix-made entries.
+static const unsigned int ZIP_HOST_UNIX = 3;
+
+// Utility function(s).
+static time_t DosTime(unsigned int time, unsigned int date);
+static bool CompareOffset(const ZipEntry *a, const ZipEntry *b);
+static bool IsFileCrc(const string &path, const ZipEntry &entry);
+
+// ============================================================================
+// Structure constructor.
+ZipEntry::ZipEntry() {
+    mode = S_IFREG | 0644;
+    method = ZIP_STORED;
+    crc = 0;
+    compressedSize = size = offset = 0;
+    mtime = 0;
+}
+
+// ============================================================================
+// Class constructor.
+ZipReader::ZipReader() {
+    fd = -1;
+}
+
+// Class destructor.
+ZipReader::~ZipReader() {
+    Close();
+}
+
+// Opens the file and reads its central directory.
+bool ZipReader::Open(const char *path) {
+    vector<unsigned char> tail;
+    struct stat st;
+    off_t start;
+
+    Close();
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+        log << ERRR << "Unable to open " << path << " (errno = " << errno << ")." << endl;
+        Close();
+        return false;
+    }
+
+    // Find the end of central directory record, searching backwards.
+    start = (st.st_size > (off_t)ZIP_END_SEARCH) ? st.st_size - ZIP_END_SEARCH : 0;
+    tail.resize(st.st_size - start);
+
+    if (tail.size() < ZIP_END_SIZE || !ReadAt(fd, &tail[0], tail.size(), start))
+        goto invalid;
+
+    for (size_t i = tail.size() - ZIP_END_SIZE + 1; i-- > 0; ) {
+        const unsigned char *end = &tail[i];
+
+        if (GetLE32(end) != ZIP_END_SIGNATURE)
+            continue;
+
+        if (GetLE16(end + 4) != 0 || GetLE16(end + 6) != 0 || GetLE16(end + 8) != GetLE16(end + 10)) {
+            log << ERRR << path << " spans disks." << endl;
+            goto fail;
+        }
+
+        if (GetLE32(end + 16) == 0xFFFFFFFF || GetLE16(end + 10) == 0xFFFF) {
+            log << ERRR << path << " is a 'zip64' archive." << endl;
+            goto fail;
+        }
+
+        if (!ReadDirectory(GetLE32(end + 16), GetLE32(end + 12), GetLE16(end + 10)))
+            goto invalid;
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return true;
+    }
+
+invalid:
+    log << ERRR << path << " is not a valid 'zip' archive." << endl;
+
+fail:
+    Close();
+    return false;
+}
+
+// Closes the file.
+void ZipReader::Close() {
+    if (fd >= 0)
+        close(fd);
+
+    fd = -1;
+    entries.clear();
+}
+
+int ZipReader::GetDescriptor() const {
+    return fd;
+}
+
+const vector<ZipEntry> &ZipReader::GetEntries() const {
+    return entries;
+}
+
+// Returns the entry of the path.
+const ZipEntry *ZipReader::Find(const string &path) const {
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].path == path)
+            return &entries[i];
+
+    return NULL;
+}
+
+// Reads the entries of the central directory.
+bool ZipReader::ReadDirectory(off_t offset, off_t size, size_t count) {
+    vector<unsigned char> directory(size);
+    size_t pos = 0;
+
+    if (size > 0 && !ReadAt(fd, &directory[0], size, offset))
+        return false;
+
+    entries.clear();
+    entries.reserve(count);
+
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *header;
+        ZipEntry entry;
+        size_t nameLen;
+        unsigned long attributes;
+
+        if (pos + ZIP_CENTRAL_SIZE > directory.size())
+            return false;
+
+        if (GetLE32(header = &directory[pos]) != ZIP_CENTRAL_SIGNATURE)
+            return false;
+
+        nameLen = GetLE16(header + 28);
+
+        if (pos + ZIP_CENTRAL_SIZE + nameLen > directory.size())
+            return false;
+
+        entry.path.assign((const char *)header + ZIP_CENTRAL_SIZE, nameLen);
+        entry.method = GetLE16(header + 10);
+        entry.mtime = DosTime(GetLE16(header + 12), GetLE16(header + 14));
+        entry.crc = GetLE32(header + 16);
+        entry.compressedSize = GetLE32(header + 20);
+        entry.size = GetLE32(header + 24);
+        entry.offset = GetLE32(header + 42);
+        attributes = GetLE32(header + 38);
+
+        if (GetLE16(header + 8) & 1) {
+            log << ERRR << "Encrypted entry: " << entry.path << endl;
+            return false;
+        }
+
+        // Directories have a trailing slash; the type and permissions
+        // are only known for unix-made entries.
+        if (entry.path.length() && entry.path[entry.path.length() - 1] == '/')
+            entry.mode = S_IFDIR | 0755;
+
+        if ((GetLE16(header + 4) >> 8) == ZIP_HOST_UNIX && (attributes >> 16) != 0) {
+            mode_t mode = attributes >> 16;
+
+            if (S_ISDIR(entry.mode) || S_ISDIR(mode))
+                entry.mode = S_IFDIR | (mode & 07777);
+            else if (S_ISLNK(mode))
+                entry.mode = mode;
+            else
+                entry.mode = S_IFREG | (mode & 07777);
+        }
+
+        entries.push_back(entry);
+        pos += ZIP_CENTRAL_SIZE + nameLen + GetLE16(header + 30) + GetLE16(header + 32);
+    }
+
+    return true;
+}
+
+// ============================================================================
+// Class constructor.
+ZipEntryInStream::ZipEntryInStream() {
+    memset(&strm, 0, sizeof(strm));
+    fd = -1;
+    entry = NULL;
+    buffer = NULL;
+    offset = remaining = left = 0;
+    crc = 0;
+    init = false;
+}
+
+// Class destructor.
+ZipEntryInStream::~ZipEntryInStream() {
+    Close();
+    free(buffer);
+}
+
+// Starts reading the data of the entry.
+bool ZipEntryInStream::Open(const ZipReader &zip, const ZipEntry &entry) {
+    unsigned char header[ZIP_LOCAL_SIZE];
+
+    Close();
+
+    if (entry.method != ZIP_STORED && entry.method != ZIP_DEFLATED) {
+        log << ERRR << "Unsupported compression method (" << entry.method << "): "
+            << entry.path << endl;
+        return false;
+    }
+
+    if (!buffer && !(buffer = (char *)malloc(STREAM_BUFFER_SIZE))) {
+        log << ERRR << "Out of memory." << endl;
+        return false;
+    }
+
+    // The data follows the local header, whose variable fields may
+    // differ from those of the central directory.
+    fd = zip.GetDescriptor();
+
+    if (!ReadAt(fd, header, sizeof(header), entry.offset) || GetLE32(header) != ZIP_LOCAL_SIGNATURE) {
+        log << ERRR << "Invalid local header: " << entry.path << endl;
+        return false;
+    }
+
+    this->entry = &entry;
+    offset = entry.offset + ZIP_LOCAL_SIZE + GetLE16(header + 26) + GetLE16(header + 28);
+    remaining = entry.compressedSize;
+    left = entry.size;
+    crc = crc32(0L, Z_NULL, 0);
+
+    if (entry.method == ZIP_DEFLATED) {
+        memset(&strm, 0, sizeof(strm));
+
+        // Raw "deflate" data (no zlib header).
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+            log << ERRR << "Unable to initialize decompressor." << endl;
+            return false;
+        }
+
+        init = true;
+    }
+
+    return true;
+}
+
+// Ends reading.
+void ZipEntryInStream::Close() {
+    if (init)
+        inflateEnd(&strm);
+
+    init = false;
+    entry = NULL;
+}
+
+// Reads the data.
+ssize_t ZipEntryInStream::Read(void *buf, size_t len) {
+    size_t count = 0;
+
+    if (!entry)
+        return -1;
+
+    if (left == 0)
+        return 0;
+
+    len = min(off_t(len), left);
+
+    if (entry->method == ZIP_STORED) {
+        if (!ReadAt(fd, buf, len, offset))
+            return -1;
+
+        offset += len;
+        count = len;
+    } else {
+        strm.next_out = (Bytef *)buf;
+        strm.avail_out = len;
+
+        while (strm.avail_out == len) {
+            int ret;
+
+            if (strm.avail_in == 0 && Fill() <= 0) {
+                log << ERRR << "Compressed data is truncated: " << entry->path << endl;
+                return -1;
+            }
+
+            ret = inflate(&strm, Z_NO_FLUSH);
+
+            if ((ret != Z_OK && ret != Z_STREAM_END) ||
+                    (ret == Z_STREAM_END && strm.avail_out && (off_t)(len - strm.avail_out) < left)) {
+                log << ERRR << "Compressed data is corrupt: " << entry->path << endl;
+                return -1;
+            }
+        }
+
+        count = len - strm.avail_out;
+    }
+
+    crc = crc32(crc, (const Bytef *)buf, count);
+
+    if ((left -= count) == 0 && crc != entry->crc) {
+        log << ERRR << "CRC error: " << entry->path << endl;
+        return -1;
+    }
+
+    return count;
+}
+
+// Reads more compressed data.
+ssize_t ZipEntryInStream::Fill() {
+    size_t count = min(off_t(STREAM_BUFFER_SIZE), remaining);
+
+    if (count == 0 || !ReadAt(fd, buffer, count, offset))
+        return count ? -1 : 0;
+
+    offset += count;
+    remaining -= count;
+    strm.next_in = (Bytef *)buffer;
+    strm.avail_in = count;
+    return count;
+}
+
+// ============================================================================
+// Class constructor.
+ZipExtractor::ZipExtractor() {
+    table = NULL;
+    update = false;
+}
+
+// Starts extracting below the given directory.
+void ZipExtractor::Init(const char *root, PermissionTable *table, ArchiveProgress *progress) {
+    this->root = root;
+    this->table = table;
+    extractor.Init(root, progress);
+}
+
+// Sets whether the existing files are updated (see the class).
+void ZipExtractor::SetUpdate(bool update) {
+    this->update = update;
+    extractor.SetUpdate(update);
+}
+
+// Sets the patcher of the deltas (see TarExtractor).
+void ZipExtractor::SetDeltaPatcher(DeltaPatcher *patcher) {
+    extractor.SetDeltaPatcher(patcher);
+}
+
+// Extracts one entry.
+bool ZipExtractor::Extract(const ZipReader &zip, const ZipEntry &zipEntry) {
+    ArchiveEntry entry;
+
+    if (!GetEntry(zipEntry, entry))
+        return false;
+
+    // Files that are known to be up to date need not be decompressed
+    // (those with a different modification time are compared by CRC).
+    if (update && entry.type == TAR_FILE) {
+        string path = root + "/" + entry.path;
+        struct stat st;
+
+        if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+                st.st_size == entry.size &&
+                (st.st_mtime == entry.mtime || IsFileCrc(path, zipEntry)))
+            return extractor.Keep(entry);
+    }
+
+    if (!data.Open(zip, zipEntry))
+        return false;
+
+    // The target of a symlink is its data.
+    if (entry.type == TAR_SYMLINK) {
+        char target[PATH_MAX];
+        ssize_t len = 0, ret;
+
+        while ((ret = data.Read(target + len, sizeof(target) - 1 - len)) > 0)
+            len += ret;
+
+        if (ret < 0)
+            return false;
+
+        entry.link.assign(target, len);
+    }
+
+    return extractor.Extract(entry, data);
+}
+
+// Extracts all entries: the directories first (parents before their
+// contents), then the files by the offset of their data.
+bool ZipExtractor::ExtractAll(const ZipReader &zip) {
+    const vector<ZipEntry> &entries = zip.GetEntries();
+    vector<const ZipEntry *> files;
+    set<string> directories;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        string path = entries[i].path;
+
+        if (!ArchiveCleanPath(path)) {
+            log << ERRR << "Unsafe path in archive: " << entries[i].path << endl;
+            return false;
+        }
+
+        if (S_ISDIR(entries[i].mode))
+            directories.insert(path);
+        else
+            files.push_back(&entries[i]);
+
+        for (size_t pos = 0; (pos = path.find('/', pos)) != string::npos; pos++)
+            directories.insert(path.substr(0, pos));
+    }
+
+    directories.erase("");
+
+    for (set<string>::const_iterator it = directories.begin(); it != directories.end(); ++it) {
+        const ZipEntry *explicitEntry = zip.Find(*it + "/");
+        ZipEntry zipEntry;
+        ArchiveEntry entry;
+
+        if (explicitEntry)
+            zipEntry = *explicitEntry;
+
+        zipEntry.path = *it;
+        zipEntry.mode = S_IFDIR | (explicitEntry ? (explicitEntry->mode & 07777) : 0755);
+
+        if (!GetEntry(zipEntry, entry) || !extractor.Extract(entry, data))
+            return false;
+    }
+
+    sort(files.begin(), files.end(), CompareOffset);
+
+    for (size_t i = 0; i < files.size(); i++)
+        if (!Extract(zip, *files[i]))
+            return false;
+
+    return extractor.Finish();
+}
+
+long long ZipExtractor::GetEntryCount() const {
+    return extractor.GetEntryCount();
+}
+
+long long ZipExtractor::GetByteCount() const {
+    return extractor.GetByteCount();
+}
+
+long long ZipExtractor::GetUnchangedCount() const {
+    return extractor.GetUnchangedCount();
+}
+
+long long ZipExtractor::GetRemovedCount() const {
+    return extractor.GetRemovedCount();
+}
+
+// Describes the entry for the extractor, with the owner and mode from
+// the permission table.
+bool ZipExtractor::GetEntry(const ZipEntry &zipEntry, ArchiveEntry &entry) {
+    int mode;
+
+    entry = ArchiveEntry();
+    entry.path = zipEntry.path;
+
+    if (!ArchiveCleanPath(entry.path)) {
+        log << ERRR << "Unsafe path in archive: " << zipEntry.path << endl;
+        return false;
+    }
+
+    entry.type = S_ISDIR(zipEntry.mode) ? TAR_DIRECTORY :
+        S_ISLNK(zipEntry.mode) ? TAR_SYMLINK : TAR_FILE;
+    entry.mode = zipEntry.mode & 07777;
+    entry.size = (entry.type == TAR_FILE) ? zipEntry.size : 0;
+    entry.mtime = zipEntry.mtime;
+
+    if (table && table->Lookup(root.c_str(), entry.path, zipEntry.mode & S_IFMT,
+            entry.uid, entry.gid, mode) && mode >= 0)
+        entry.mode = mode;
+
+    return true;
+}
+
+// ============================================================================
+// Converts an MS-DOS date and time (local time).
+static time_t DosTime(unsigned int time, unsigned int date) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_sec = (time & 0x1F) * 2;
+    tm.tm_min = (time >> 5) & 0x3F;
+    tm.tm_hour = time >> 11;
+    tm.tm_mday = date & 0x1F;
+    tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+    tm.tm_year = (date >> 9) + 80;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Orders entries by the offset of their data.
+static bool CompareOffset(const ZipEntry *a, const ZipEntry *b) {
+    return a->offset < b->offset;
+}
+
+// Returns if the CRC32 of the file is that of the entry.
+static bool IsFileCrc(const string &path, const ZipEntry &entry) {
+    unsigned long crc = crc32(0L, Z_NULL, 0);
+    char *buffer;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(path.c_str(), O_RDONLY)) < 0)
+        return false;
+
+    if (!(buffer = (char *)malloc(STREAM_BUFFER_SIZE))) {
+        close(fd);
+        return false;
+    }
+
+    while ((ret = read(fd, buffer, STREAM_BUFFER_SIZE)) > 0 ||
+            (ret < 0 && errno == EINTR))
+        if (ret > 0)
+            crc = crc32(crc, (const Bytef *)buffer, ret);
+
+    free(buffer);
+    close(fd);
+    return ret == 0 && crc == entry.crc;
+}
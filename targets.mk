@@ -1,7 +1,7 @@
 # PC simulation
-# (executable only)
+# (executable and host tools)
 pc: TARGET=PC
-pc: $(OBJDIR)/$(BINARY)
+pc: $(OBJDIR)/$(BINARY) $(OBJDIR)/$(MKDELTA)
 
 # Herotab C8/Dropad A8/Haipad M7/iBall Slide i7011 and compatibles
 # (executable only)
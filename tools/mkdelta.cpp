@@ -0,0 +1,455 @@
+/*
+ *  mkdelta.cpp:
+ *      - Host tool creating the binary deltas of patches (see
+ *        DeltaPatcher). Built by "make pc".
+ */
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../src/include/util.h"
+#include "../src/include/stream.h"
+#include "../src/include/sha256.h"
+#include "../src/include/delta.h"
+
+using namespace std;
+
+// Utility function(s).
+static unsigned char *ReadFile(const char *path, off_t &size);
+static void Split(off_t *I, off_t *V, off_t start, off_t len, off_t h);
+static void SuffixSort(off_t *I, off_t *V, const unsigned char *old, off_t oldSize);
+static off_t MatchLength(const unsigned char *old, off_t oldSize,
+    const unsigned char *data, off_t size);
+static off_t Search(const off_t *I, const unsigned char *old, off_t oldSize,
+    const unsigned char *data, off_t size, off_t start, off_t end, off_t &pos);
+static void PutOffset(unsigned char *p, off_t value);
+static bool WriteDelta(FileOutStream &out, const unsigned char *old, off_t oldSize,
+    const unsigned char *data, off_t size);
+static bool CheckDelta(const char *source, const char *delta, const unsigned char *data,
+    off_t size);
+
+// ============================================================================
+// Writes the delta from the source to the target and checks it by
+// applying it to a copy of the source.
+int main(int argc, char *argv[]) {
+    unsigned char *old, *data;
+    off_t oldSize, size;
+    FileOutStream out;
+    struct stat st;
+
+    if (argc != 4) {
+        cerr << "Usage: " << argv[0] << " <source> <target> <delta>" << endl;
+        return 2;
+    }
+
+    if (!(old = ReadFile(argv[1], oldSize)) || !(data = ReadFile(argv[2], size)))
+        return 1;
+
+    if (!out.Open(argv[3]) || !WriteDelta(out, old, oldSize, data, size) || !out.Close()) {
+        cerr << "Unable to write '" << argv[3] << "'." << endl;
+        unlink(argv[3]);
+        return 1;
+    }
+
+    if (!CheckDelta(argv[1], argv[3], data, size)) {
+        cerr << "The delta does not reproduce '" << argv[2] << "'." << endl;
+        unlink(argv[3]);
+        return 1;
+    }
+
+    stat(argv[3], &st);
+    cout << argv[3] << ": " << (long long)st.st_size << " bytes (" << (long long)oldSize
+        << " -> " << (long long)size << " bytes, checked)." << endl;
+
+    free(old);
+    free(data);
+    return 0;
+}
+
+// Writes the header and the records of the delta. The records are
+// found as by "bsdiff": approximate matches of the target in the
+// source, extended forwards and backwards, are stored as differences
+// and the rest as is.
+static bool WriteDelta(FileOutStream &out, const unsigned char *old, off_t oldSize,
+        const unsigned char *data, off_t size) {
+
+    unsigned char header[DELTA_HEADER_SIZE];
+    unsigned char *buffer = (unsigned char *)malloc(STREAM_BUFFER_SIZE);
+    off_t *I = (off_t *)malloc((oldSize + 1) * sizeof(off_t));
+    off_t *V = (off_t *)malloc((oldSize + 1) * sizeof(off_t));
+    off_t scan = 0, len = 0, pos = 0, lastScan = 0, lastPos = 0, lastOffset = 0;
+    bool success = true;
+
+    if (!buffer || !I || !V) {
+        cerr << "Out of memory." << endl;
+        success = false;
+        goto done;
+    }
+
+    memcpy(header, DELTA_MAGIC, sizeof(DELTA_MAGIC));
+    PutLE64(header + 8, oldSize);
+    Sha256Digest(old, oldSize, header + 16);
+    PutLE64(header + 16 + SHA256_SIZE, size);
+    Sha256Digest(data, size, header + 24 + SHA256_SIZE);
+
+    if (!out.Write(header, sizeof(header))) {
+        success = false;
+        goto done;
+    }
+
+    SuffixSort(I, V, old, oldSize);
+
+    while (scan < size) {
+        off_t oldScore = 0;
+
+        for (off_t scsc = scan += len; scan < size; scan++) {
+            len = Search(I, old, oldSize, data + scan, size - scan, 0, oldSize, pos);
+
+            for (; scsc < scan + len; scsc++)
+                if (scsc + lastOffset < oldSize && old[scsc + lastOffset] == data[scsc])
+                    oldScore++;
+
+            if ((len == oldScore && len != 0) || len > oldScore + 8)
+                break;
+
+            if (scan + lastOffset < oldSize && old[scan + lastOffset] == data[scan])
+                oldScore--;
+        }
+
+        if (len == oldScore && scan != size)
+            continue;
+
+        // Extend the last match forwards and this one backwards, and
+        // split their overlap where it scores best.
+        off_t forward = 0, backward = 0, score = 0, best = 0;
+
+        for (off_t i = 0; lastScan + i < scan && lastPos + i < oldSize; ) {
+            if (old[lastPos + i] == data[lastScan + i])
+                score++;
+
+            i++;
+
+            if (score * 2 - i > best * 2 - forward) {
+                best = score;
+                forward = i;
+            }
+        }
+
+        if (scan < size) {
+            score = best = 0;
+
+            for (off_t i = 1; scan >= lastScan + i && pos >= i; i++) {
+                if (old[pos - i] == data[scan - i])
+                    score++;
+
+                if (score * 2 - i > best * 2 - backward) {
+                    best = score;
+                    backward = i;
+                }
+            }
+        }
+
+        if (lastScan + forward > scan - backward) {
+            off_t overlap = (lastScan + forward) - (scan - backward), split = 0;
+            score = best = 0;
+
+            for (off_t i = 0; i < overlap; i++) {
+                if (data[lastScan + forward - overlap + i] == old[lastPos + forward - overlap + i])
+                    score++;
+
+                if (data[scan - backward + i] == old[pos - backward + i])
+                    score--;
+
+                if (score > best) {
+                    best = score;
+                    split = i + 1;
+                }
+            }
+
+            forward += split - overlap;
+            backward -= split;
+        }
+
+        // The record: the differences of the match, then the new data.
+        unsigned char record[3 * 8];
+        const off_t extra = (scan - backward) - (lastScan + forward);
+
+        PutOffset(record, forward);
+        PutOffset(record + 8, extra);
+        PutOffset(record + 16, (pos - backward) - (lastPos + forward));
+
+        if (!out.Write(record, sizeof(record))) {
+            success = false;
+            goto done;
+        }
+
+        for (off_t written = 0; written < forward; ) {
+            off_t count = min(off_t(STREAM_BUFFER_SIZE), forward - written);
+
+            for (off_t i = 0; i < count; i++)
+                buffer[i] = data[lastScan + written + i] - old[lastPos + written + i];
+
+            if (!out.Write(buffer, count)) {
+                success = false;
+                goto done;
+            }
+
+            written += count;
+        }
+
+        if (!out.Write(data + lastScan + forward, extra)) {
+            success = false;
+            goto done;
+        }
+
+        lastScan = scan - backward;
+        lastPos = pos - backward;
+        lastOffset = pos - scan;
+    }
+
+done:
+    free(buffer);
+    free(I);
+    free(V);
+    return success;
+}
+
+// Applies the delta to a copy of the source and compares the result
+// with the target.
+static bool CheckDelta(const char *source, const char *delta, const unsigned char *data,
+        off_t size) {
+
+    const string copy = string(delta) + ".check";
+    DeltaPatcher patcher;
+    FileInStream in;
+    FileOutStream out;
+    unsigned char *old, *result = NULL;
+    off_t oldSize, resultSize;
+    struct stat st;
+    bool success;
+
+    if (!(old = ReadFile(source, oldSize)))
+        return false;
+
+    success = out.Open(copy.c_str()) && out.Write(old, oldSize) && out.Close() &&
+        stat(delta, &st) == 0 && in.Open(delta);
+
+    success = success && patcher.Apply(copy, in, st.st_size, 0) &&
+        (result = ReadFile(copy.c_str(), resultSize)) != NULL &&
+        resultSize == size && memcmp(result, data, size) == 0;
+
+    unlink(copy.c_str());
+    free(old);
+    free(result);
+    return success;
+}
+
+// Reads a whole file (one byte more is allocated, so that the data of
+// an empty file is not NULL).
+static unsigned char *ReadFile(const char *path, off_t &size) {
+    unsigned char *data = NULL;
+    FILE *file = fopen(path, "rb");
+    struct stat st;
+
+    if (!file || fstat(fileno(file), &st) != 0 || !(data = (unsigned char *)malloc(st.st_size + 1)) ||
+            fread(data, 1, st.st_size, file) != (size_t)st.st_size) {
+        cerr << "Unable to read '" << path << "'." << endl;
+        free(data);
+        data = NULL;
+    }
+
+    if (file)
+        fclose(file);
+
+    size = data ? st.st_size : 0;
+    return data;
+}
+
+// Sorts a group of suffixes of the same "h" first bytes by the next
+// "h" bytes (Larsson-Sadakane, as in "bsdiff").
+static void Split(off_t *I, off_t *V, off_t start, off_t len, off_t h) {
+    off_t i, j, k, x, jj, kk;
+
+    if (len < 16) {
+        for (k = start; k < start + len; k += j) {
+            j = 1;
+            x = V[I[k] + h];
+
+            for (i = 1; k + i < start + len; i++) {
+                if (V[I[k + i] + h] < x) {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+
+                if (V[I[k + i] + h] == x) {
+                    swap(I[k + j], I[k + i]);
+                    j++;
+                }
+            }
+
+            for (i = 0; i < j; i++)
+                V[I[k + i]] = k + j - 1;
+
+            if (j == 1)
+                I[k] = -1;
+        }
+
+        return;
+    }
+
+    x = V[I[start + len / 2] + h];
+    jj = kk = 0;
+
+    for (i = start; i < start + len; i++) {
+        if (V[I[i] + h] < x)
+            jj++;
+
+        if (V[I[i] + h] == x)
+            kk++;
+    }
+
+    jj += start;
+    kk += jj;
+    i = start;
+    j = k = 0;
+
+    while (i < jj) {
+        if (V[I[i] + h] < x) {
+            i++;
+        } else if (V[I[i] + h] == x) {
+            swap(I[i], I[jj + j]);
+            j++;
+        } else {
+            swap(I[i], I[kk + k]);
+            k++;
+        }
+    }
+
+    while (jj + j < kk) {
+        if (V[I[jj + j] + h] == x) {
+            j++;
+        } else {
+            swap(I[jj + j], I[kk + k]);
+            k++;
+        }
+    }
+
+    if (jj > start)
+        Split(I, V, start, jj - start, h);
+
+    for (i = 0; i < kk - jj; i++)
+        V[I[jj + i]] = kk - 1;
+
+    if (jj == kk - 1)
+        I[jj] = -1;
+
+    if (start + len > kk)
+        Split(I, V, kk, start + len - kk, h);
+}
+
+// Builds the suffix array of the source in I (V is the inverse).
+static void SuffixSort(off_t *I, off_t *V, const unsigned char *old, off_t oldSize) {
+    off_t buckets[256];
+    off_t i, h, len;
+
+    memset(buckets, 0, sizeof(buckets));
+
+    for (i = 0; i < oldSize; i++)
+        buckets[old[i]]++;
+
+    for (i = 1; i < 256; i++)
+        buckets[i] += buckets[i - 1];
+
+    for (i = 255; i > 0; i--)
+        buckets[i] = buckets[i - 1];
+
+    buckets[0] = 0;
+
+    for (i = 0; i < oldSize; i++)
+        I[++buckets[old[i]]] = i;
+
+    I[0] = oldSize;
+
+    for (i = 0; i < oldSize; i++)
+        V[i] = buckets[old[i]];
+
+    V[oldSize] = 0;
+
+    for (i = 1; i < 256; i++)
+        if (buckets[i] == buckets[i - 1] + 1)
+            I[buckets[i]] = -1;
+
+    I[0] = -1;
+
+    for (h = 1; I[0] != -(oldSize + 1); h += h) {
+        len = 0;
+
+        for (i = 0; i < oldSize + 1; ) {
+            if (I[i] < 0) {
+                len -= I[i];
+                i -= I[i];
+            } else {
+                if (len)
+                    I[i - len] = -len;
+
+                len = V[I[i]] + 1 - i;
+                Split(I, V, i, len, h);
+                i += len;
+                len = 0;
+            }
+        }
+
+        if (len)
+            I[i - len] = -len;
+    }
+
+    for (i = 0; i < oldSize + 1; i++)
+        I[V[i]] = i;
+}
+
+// Returns the length of the common prefix.
+static off_t MatchLength(const unsigned char *old, off_t oldSize,
+        const unsigned char *data, off_t size) {
+
+    off_t i;
+
+    for (i = 0; i < oldSize && i < size; i++)
+        if (old[i] != data[i])
+            break;
+
+    return i;
+}
+
+// Finds the longest match of the data among the sorted suffixes of
+// the source between "start" and "end", by binary search.
+static off_t Search(const off_t *I, const unsigned char *old, off_t oldSize,
+        const unsigned char *data, off_t size, off_t start, off_t end, off_t &pos) {
+
+    while (end - start >= 2) {
+        off_t middle = start + (end - start) / 2;
+
+        if (memcmp(old + I[middle], data, min(oldSize - I[middle], size)) < 0)
+            start = middle;
+        else
+            end = middle;
+    }
+
+    off_t x = MatchLength(old + I[start], oldSize - I[start], data, size);
+    off_t y = MatchLength(old + I[end], oldSize - I[end], data, size);
+
+    pos = (x > y) ? I[start] : I[end];
+    return max(x, y);
+}
+
+// Writes a signed number as "bsdiff" does (the sign is the top bit).
+static void PutOffset(unsigned char *p, off_t value) {
+    PutLE64(p, value < 0 ? -value : value);
+
+    if (value < 0)
+        p[7] |= 0x80;
+}